@@ -0,0 +1,405 @@
+/* Benchmark for the formatter. Times pfa_format over generated stress
+ * inputs and over any Python files given on the command line, printing
+ * one JSON object per input set on stdout and a table on stderr.
+ *
+ * Usage: bench [-r REPS] [-s MB] [-n] [-w WRAP] [files or directories...]
+ *   -r  timed repetitions of each set (default 5); the best is reported
+ *   -s  size of each generated set, in MB (default 4)
+ *   -n  skip the generated sets
+ *   -w  line wrapping, greedy (default) or optimal */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../pfa/format.h"
+#include "../pfa/pfa.h"
+#include "../pfa/scan.h"
+
+struct text {
+  char *data;
+  size_t len;
+};
+
+/* A named set of inputs, each formatted separately */
+struct set {
+  const char *name;
+  struct text *texts;
+  int ntexts;
+  int maxtexts;
+  size_t bytes;
+};
+
+static void set_add(struct set *s, char *data, size_t len) {
+  if (s->ntexts == s->maxtexts) {
+    s->maxtexts = s->maxtexts ? 2 * s->maxtexts : 64;
+    s->texts =
+        (struct text *)realloc(s->texts, sizeof(struct text) * s->maxtexts);
+  }
+  s->texts[s->ntexts].data = data;
+  s->texts[s->ntexts].len = len;
+  s->ntexts++;
+  s->bytes += len;
+}
+
+/* Growable string for building generated inputs */
+struct gen {
+  char *d;
+  size_t len, cap;
+};
+
+static void gen_put(struct gen *g, const char *s, size_t n) {
+  if (g->len + n + 1 > g->cap) {
+    g->cap = 2 * (g->len + n + 1);
+    g->d = (char *)realloc(g->d, g->cap);
+  }
+  memcpy(&g->d[g->len], s, n);
+  g->len += n;
+  g->d[g->len] = '\0';
+}
+
+static void gen_str(struct gen *g, const char *s) { gen_put(g, s, strlen(s)); }
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+static unsigned rng(unsigned n) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state % n;
+}
+
+static const char *words[] = {"alpha", "beta",  "gamma", "delta", "value",
+                              "count", "index", "self",  "data",  "result"};
+
+static void gen_word(struct gen *g) { gen_str(g, words[rng(10)]); }
+
+/* Very long logical lines: calls and arithmetic that must be wrapped */
+static void make_long_lines(struct set *s, size_t size) {
+  struct gen g = {0};
+  while (g.len < size) {
+    gen_str(&g, "result = compute(");
+    for (int i = 0; i < 2000; i++) {
+      gen_word(&g);
+      gen_str(&g, i % 3 ? "+" : ", ");
+      gen_word(&g);
+      gen_str(&g, "[ 1 ]");
+      gen_str(&g, i % 5 ? "," : " *  ");
+    }
+    gen_str(&g, "0)\n");
+  }
+  set_add(s, g.d, g.len);
+}
+
+/* Deeply nested brackets, spread over continuation lines */
+static void make_deep_nesting(struct set *s, size_t size) {
+  struct gen g = {0};
+  static const char open[] = "([{", close[] = ")]}";
+  while (g.len < size) {
+    int depth = 500 + rng(500);
+    gen_str(&g, "x = ");
+    for (int i = 0; i < depth; i++) {
+      gen_put(&g, &open[i % 3], 1);
+      gen_word(&g);
+      gen_str(&g, i % 16 ? ", " : ",\n    ");
+    }
+    for (int i = depth - 1; i >= 0; i--)
+      gen_put(&g, &close[i % 3], 1);
+    gen_str(&g, "\n");
+  }
+  set_add(s, g.d, g.len);
+}
+
+/* A few huge triple-quoted strings */
+static void make_huge_tristr(struct set *s, size_t size) {
+  struct gen g = {0};
+  while (g.len < size) {
+    gen_str(&g, "DOC = \"\"\"\n");
+    for (int l = 0; l < 20000 && g.len < size; l++) {
+      for (int w = 0; w < 10; w++) {
+        gen_word(&g);
+        gen_str(&g, w % 4 ? " " : "  \\' ");
+      }
+      gen_str(&g, "\n");
+    }
+    gen_str(&g, "\"\"\"\n");
+  }
+  set_add(s, g.d, g.len);
+}
+
+/* Many small files, where per-call overhead dominates */
+static void make_tiny_files(struct set *s, size_t size) {
+  size_t total = 0;
+  while (total < size) {
+    struct gen g = {0};
+    gen_str(&g, "import os\n\n\ndef f(a,b):\n    return a+b\n");
+    if (rng(2))
+      gen_str(&g, "x=f( 1,2 )\n");
+    total += g.len;
+    set_add(s, g.d, g.len);
+  }
+}
+
+/* Runs of comment lines, with spacing to collapse */
+static void make_long_comments(struct set *s, size_t size) {
+  struct gen g = {0};
+  while (g.len < size) {
+    gen_str(&g, rng(4) ? "    #" : "#!");
+    for (int w = 0; w < 12; w++) {
+      gen_str(&g, w % 5 ? " " : "   ");
+      gen_word(&g);
+    }
+    gen_str(&g, "\n");
+    if (rng(20) == 0)
+      gen_str(&g, "pass  # trailing  comment\n");
+  }
+  set_add(s, g.d, g.len);
+}
+
+static struct set *corpus_set;
+
+static int add_corpus_file(const char *path, const struct stat *st, int type,
+                           struct FTW *ftw) {
+  (void)ftw;
+  size_t l = strlen(path);
+  if (type != FTW_F || !S_ISREG(st->st_mode) ||
+      !((l > 3 && strcmp(&path[l - 3], ".py") == 0) ||
+        (l > 4 && strcmp(&path[l - 4], ".pyi") == 0)))
+    return 0;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  char *data = (char *)malloc(st->st_size + 1);
+  ssize_t got = 0;
+  while (got < st->st_size) {
+    ssize_t r = read(fd, data + got, st->st_size - got);
+    if (r <= 0)
+      break;
+    got += r;
+  }
+  close(fd);
+  set_add(corpus_set, data, got);
+  return 0;
+}
+
+/* Hardware counters, when the kernel allows them */
+enum { NCOUNTERS = 4 };
+static const char *counter_names[NCOUNTERS] = {"cycles", "instructions",
+                                               "branch_misses", "cache_misses"};
+static const uint64_t counter_configs[NCOUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+
+struct counters {
+  int fds[NCOUNTERS];
+  int ok;
+  uint64_t values[NCOUNTERS];
+};
+
+static void counters_open(struct counters *c) {
+  c->ok = 1;
+  for (int i = 0; i < NCOUNTERS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = counter_configs[i];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    c->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (c->fds[i] < 0)
+      c->ok = 0;
+  }
+}
+
+static void counters_start(struct counters *c) {
+  for (int i = 0; c->ok && i < NCOUNTERS; i++) {
+    ioctl(c->fds[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(c->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+static void counters_stop(struct counters *c) {
+  for (int i = 0; c->ok && i < NCOUNTERS; i++) {
+    ioctl(c->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    if (read(c->fds[i], &c->values[i], sizeof(uint64_t)) != sizeof(uint64_t))
+      c->ok = 0;
+  }
+}
+
+static void counters_close(struct counters *c) {
+  for (int i = 0; i < NCOUNTERS; i++)
+    if (c->fds[i] >= 0)
+      close(c->fds[i]);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, int n, double p) {
+  int i = (int)(p * (n - 1) + 0.5);
+  return sorted[i];
+}
+
+static void run_set(struct pfa_context *ctx, struct set *s, int reps) {
+  if (s->ntexts == 0)
+    return;
+  double *lat = (double *)malloc(sizeof(double) * s->ntexts * reps);
+  double best = 1e30;
+  struct counters ctr;
+  counters_open(&ctr);
+  uint64_t bestctr[NCOUNTERS] = {0};
+  size_t outbytes = 0;
+  /* one untimed pass, so buffers are grown and pages touched */
+  for (int i = 0; i < s->ntexts; i++) {
+    const char *out;
+    size_t outlen;
+    pfa_format(ctx, s->texts[i].data, s->texts[i].len, &out, &outlen);
+    outbytes += outlen;
+  }
+  for (int r = 0; r < reps; r++) {
+    counters_start(&ctr);
+    double t0 = now();
+    for (int i = 0; i < s->ntexts; i++) {
+      const char *out;
+      size_t outlen;
+      double f0 = now();
+      pfa_format(ctx, s->texts[i].data, s->texts[i].len, &out, &outlen);
+      lat[r * s->ntexts + i] = now() - f0;
+    }
+    double t = now() - t0;
+    counters_stop(&ctr);
+    if (t < best) {
+      best = t;
+      memcpy(bestctr, ctr.values, sizeof(bestctr));
+    }
+  }
+  counters_close(&ctr);
+  int nlat = s->ntexts * reps;
+  qsort(lat, nlat, sizeof(double), cmp_double);
+
+  double mbps = s->bytes / best / 1e6;
+  double nspb = best * 1e9 / (s->bytes ? s->bytes : 1);
+  printf("{\"set\": \"%s\", \"files\": %d, \"bytes\": %zu, "
+         "\"output_bytes\": %zu, \"reps\": %d, \"seconds\": %.6f, "
+         "\"mb_per_s\": %.2f, \"ns_per_byte\": %.3f, "
+         "\"latency_us\": {\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, "
+         "\"max\": %.2f}, \"perf\": ",
+         s->name, s->ntexts, s->bytes, outbytes, reps, best, mbps, nspb,
+         1e6 * percentile(lat, nlat, 0.5), 1e6 * percentile(lat, nlat, 0.9),
+         1e6 * percentile(lat, nlat, 0.99), 1e6 * lat[nlat - 1]);
+  if (ctr.ok) {
+    printf("{");
+    for (int i = 0; i < NCOUNTERS; i++)
+      printf("%s\"%s\": %llu", i ? ", " : "", counter_names[i],
+             (unsigned long long)bestctr[i]);
+    printf("}}\n");
+  } else {
+    printf("null}\n");
+  }
+  fflush(stdout);
+  fprintf(stderr, "%-14s %7d %10.2f %9.1f %8.3f %9.1f %9.1f %9.1f\n", s->name,
+          s->ntexts, s->bytes / 1e6, mbps, nspb,
+          1e6 * percentile(lat, nlat, 0.5), 1e6 * percentile(lat, nlat, 0.99),
+          1e6 * lat[nlat - 1]);
+  free(lat);
+}
+
+int main(int argc, char **argv) {
+  int reps = 5;
+  double scale = 4;
+  int generated = 1;
+  int wrap = WRAP_GREEDY;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:s:nw:")) != -1) {
+    switch (opt) {
+    case 'r':
+      reps = atoi(optarg);
+      break;
+    case 's':
+      scale = atof(optarg);
+      break;
+    case 'n':
+      generated = 0;
+      break;
+    case 'w':
+      if (strcmp(optarg, "greedy") == 0 || strcmp(optarg, "optimal") == 0) {
+        wrap = optarg[0] == 'o' ? WRAP_OPTIMAL : WRAP_GREEDY;
+        break;
+      }
+      /* fall through */
+    default:
+      fprintf(stderr,
+              "Usage: bench [-r REPS] [-s MB] [-n] [-w greedy|optimal] "
+              "[paths...]\n");
+      return 1;
+    }
+  }
+  if (reps < 1)
+    reps = 1;
+  size_t size = (size_t)(scale * (1 << 20));
+
+  struct set sets[6];
+  memset(sets, 0, sizeof(sets));
+  int nsets = 0;
+  if (generated) {
+    sets[nsets].name = "long_lines";
+    make_long_lines(&sets[nsets++], size);
+    sets[nsets].name = "deep_nesting";
+    make_deep_nesting(&sets[nsets++], size);
+    sets[nsets].name = "huge_tristr";
+    make_huge_tristr(&sets[nsets++], size);
+    sets[nsets].name = "tiny_files";
+    make_tiny_files(&sets[nsets++], size);
+    sets[nsets].name = "long_comments";
+    make_long_comments(&sets[nsets++], size);
+  }
+  if (optind < argc) {
+    sets[nsets].name = "corpus";
+    corpus_set = &sets[nsets++];
+    for (int i = optind; i < argc; i++) {
+      if (nftw(argv[i], add_corpus_file, 32, FTW_PHYS) != 0)
+        fprintf(stderr, "Could not read %s\n", argv[i]);
+    }
+  }
+
+  /* set up the scan kernels before any timing */
+  struct pfa_context *ctx = pfa_context_new();
+  ctx->wrap = wrap;
+  const char *out;
+  size_t outlen;
+  pfa_format(ctx, "", 0, &out, &outlen);
+  printf("{\"pfa_format_version\": %d, \"scan\": \"%s\", \"wrap\": \"%s\"}\n",
+         PFA_FORMAT_VERSION, scan_name(),
+         wrap == WRAP_OPTIMAL ? "optimal" : "greedy");
+  fprintf(stderr, "%-14s %7s %10s %9s %8s %9s %9s %9s\n", "set", "files", "MB",
+          "MB/s", "ns/byte", "p50 us", "p99 us", "max us");
+  for (int i = 0; i < nsets; i++) {
+    run_set(ctx, &sets[i], reps);
+  }
+  pfa_context_free(ctx);
+  for (int i = 0; i < nsets; i++) {
+    for (int k = 0; k < sets[i].ntexts; k++)
+      free(sets[i].texts[k].data);
+    free(sets[i].texts);
+  }
+  return 0;
+}
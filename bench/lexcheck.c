@@ -0,0 +1,128 @@
+/* Prints the token stream the formatter reads from each input, so that
+ * the table-driven tokenizer can be compared with the hand-written one
+ * it replaced. Built twice by `make lexcheck`, once with PFA_LEXREF, and
+ * the two outputs must match. Each input gives one line, with its token
+ * count and a hash of the tokens' types and text; with -v, every token
+ * is printed instead. Besides the Python files given, a fixed sequence of
+ * random inputs, made of the bytes the tokenizer cares about, is read.
+ *
+ * Usage: lexcheck [-n N] [-v] [files or directories...]
+ *   -n  number of random inputs (default 4000)
+ *   -v  print each token, as its type name and text */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../pfa/format.h"
+#include "../pfa/pfa.h"
+
+static int verbose = 0;
+static uint64_t hash;
+static size_t ntokens;
+
+void lex_trace(int tok, const char *text, size_t len) {
+  if (verbose) {
+    printf("%s %.*s\n", tok_to_string(tok), (int)len, text);
+    return;
+  }
+  /* FNV-1a, over the type, length and text of each token */
+  unsigned char head[1 + sizeof(size_t)];
+  head[0] = (unsigned char)tok;
+  memcpy(&head[1], &len, sizeof(size_t));
+  for (size_t i = 0; i < sizeof(head); i++)
+    hash = (hash ^ head[i]) * 0x100000001b3ull;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)text[i]) * 0x100000001b3ull;
+  ntokens++;
+}
+
+static struct pfa_context *ctx;
+
+static void check(const char *name, const char *data, size_t len) {
+  hash = 0xcbf29ce484222325ull;
+  ntokens = 0;
+  if (verbose)
+    printf("== %s\n", name);
+  const char *out;
+  size_t outlen;
+  pfa_format(ctx, data, len, &out, &outlen);
+  if (!verbose)
+    printf("%s %zu %016llx\n", name, ntokens, (unsigned long long)hash);
+}
+
+static int check_file(const char *path, const struct stat *st, int type,
+                      struct FTW *ftw) {
+  (void)ftw;
+  size_t l = strlen(path);
+  if (type != FTW_F || !S_ISREG(st->st_mode) ||
+      !((l > 3 && strcmp(&path[l - 3], ".py") == 0) ||
+        (l > 4 && strcmp(&path[l - 4], ".pyi") == 0)))
+    return 0;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  char *data = (char *)malloc(st->st_size + 1);
+  ssize_t got = 0;
+  while (got < st->st_size) {
+    ssize_t r = read(fd, data + got, st->st_size - got);
+    if (r <= 0)
+      break;
+    got += r;
+  }
+  close(fd);
+  check(path, data, got);
+  free(data);
+  return 0;
+}
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+static unsigned rng(unsigned n) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state % n;
+}
+
+/* Every byte class of lexer.def, and the letters numbers are made of */
+static const char alphabet[] = "aexjZ_019.'\"=+-*/<>!~%@|^&,:([{)]}\\# \t\n";
+
+int main(int argc, char **argv) {
+  int nrandom = 4000;
+  int c;
+  while ((c = getopt(argc, argv, "n:v")) != -1) {
+    switch (c) {
+    case 'n':
+      nrandom = atoi(optarg);
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      fprintf(stderr, "Usage: lexcheck [-n N] [-v] [files or directories...]\n");
+      return 1;
+    }
+  }
+  ctx = pfa_context_new();
+  for (int i = optind; i < argc; i++)
+    nftw(argv[i], check_file, 16, FTW_PHYS);
+
+  char buf[512];
+  for (int k = 0; k < nrandom; k++) {
+    size_t len = 1 + rng(sizeof(buf));
+    for (size_t i = 0; i < len; i++)
+      buf[i] = rng(16) ? alphabet[rng(sizeof(alphabet) - 1)]
+                       : (char)(0x80 + rng(0x80));
+    char name[32];
+    snprintf(name, sizeof(name), "random:%d", k);
+    check(name, buf, len);
+  }
+  pfa_context_free(ctx);
+  return 0;
+}
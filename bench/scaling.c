@@ -0,0 +1,247 @@
+/* Checks that formatting time and memory grow linearly with input size.
+ * Each adversarial input is generated at 1x, 2x, ... 64x a base size and
+ * formatted in a fresh process, so that its peak RSS can be read; the
+ * growth exponent is then fit, by least squares on a log-log scale, over
+ * the sizes from 4x up, where fixed costs no longer dominate. Exits with
+ * status 1 if any exponent exceeds the limit.
+ *
+ * Usage: scaling [-b KB] [-r REPS] [-l LIMIT] [-w WRAP]
+ *   -b  base size, in KB (default 160, so the largest input is 10 MB)
+ *   -r  timed repetitions per size; the best is used (default 3)
+ *   -l  largest acceptable exponent (default 1.25)
+ *   -w  line wrapping, greedy (default) or optimal */
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../pfa/format.h"
+#include "../pfa/pfa.h"
+
+struct gen {
+  char *d;
+  size_t len, cap;
+};
+
+static void gen_put(struct gen *g, const char *s, size_t n) {
+  if (g->len + n + 1 > g->cap) {
+    g->cap = 2 * (g->len + n + 1);
+    g->d = (char *)realloc(g->d, g->cap);
+  }
+  memcpy(&g->d[g->len], s, n);
+  g->len += n;
+  g->d[g->len] = '\0';
+}
+
+static void gen_str(struct gen *g, const char *s) { gen_put(g, s, strlen(s)); }
+
+/* Thousands of commas in one bracket, on one line */
+static void make_commas(struct gen *g, size_t size) {
+  gen_str(g, "x = f(");
+  while (g->len < size)
+    gen_str(g, "a,b , c,");
+  gen_str(g, "z)\n");
+}
+
+/* One bracket, whose items span many continuation lines */
+static void make_bracket_lines(struct gen *g, size_t size) {
+  gen_str(g, "x = [\n");
+  while (g->len < size)
+    gen_str(g, "    alpha, beta,  # note\n");
+  gen_str(g, "]\n");
+}
+
+/* A single logical line joined by backslashes */
+static void make_backslashes(struct gen *g, size_t size) {
+  gen_str(g, "x = a");
+  while (g->len < size)
+    gen_str(g, " + \\\n    b*c");
+  gen_str(g, "\n");
+}
+
+/* Strings left open at the end of each line, and a final triple-quoted
+ * string left open until the end of the file */
+static void make_unterminated(struct gen *g, size_t size) {
+  while (g->len < size / 2)
+    gen_str(g, "s = 'abc  def\nt = \"x\\\n");
+  gen_str(g, "u = '''");
+  while (g->len < size)
+    gen_str(g, "never ' closed \" \\\n");
+}
+
+/* One enormous line, with nothing to split at but operators */
+static void make_single_line(struct gen *g, size_t size) {
+  gen_str(g, "x = a");
+  while (g->len < size)
+    gen_str(g, " + b.c*d - e");
+  gen_str(g, "\n");
+}
+
+/* Brackets nested as deep as the input is long */
+static void make_nesting(struct gen *g, size_t size) {
+  size_t depth = size / 4;
+  gen_str(g, "x = ");
+  for (size_t i = 0; i < depth; i++)
+    gen_str(g, "f(");
+  gen_str(g, "1");
+  for (size_t i = 0; i < depth; i++)
+    gen_str(g, ")");
+  gen_str(g, "\n");
+}
+
+struct input {
+  const char *name;
+  void (*make)(struct gen *, size_t);
+};
+
+static const struct input inputs[] = {
+    {"commas", make_commas},           {"bracket_lines", make_bracket_lines},
+    {"backslashes", make_backslashes}, {"unterminated", make_unterminated},
+    {"single_line", make_single_line}, {"nesting", make_nesting},
+};
+
+enum { NSIZES = 7, FIT_FROM = 2 };
+
+static int wrap = WRAP_GREEDY;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Formats the input at `size` in a child process; returns the best time,
+ * and the child's peak RSS in KB, or -1 on failure */
+static double measure(const struct input *in, size_t size, int reps,
+                      long *maxrss) {
+  int fds[2];
+  if (pipe(fds) < 0)
+    return -1;
+  pid_t pid = fork();
+  if (pid < 0)
+    return -1;
+  if (pid == 0) {
+    close(fds[0]);
+    struct gen g = {0};
+    gen_put(&g, "", 0);
+    if (size > 0)
+      in->make(&g, size);
+    struct pfa_context *ctx = pfa_context_new();
+    ctx->wrap = wrap;
+    double best = 1e30;
+    for (int r = 0; r < reps; r++) {
+      const char *out;
+      size_t outlen;
+      double t0 = now();
+      pfa_format(ctx, g.d, g.len, &out, &outlen);
+      double t = now() - t0;
+      if (t < best)
+        best = t;
+    }
+    ssize_t w = write(fds[1], &best, sizeof(best));
+    _exit(w == sizeof(best) ? 0 : 1);
+  }
+  close(fds[1]);
+  double t = -1;
+  if (read(fds[0], &t, sizeof(t)) != sizeof(t))
+    t = -1;
+  close(fds[0]);
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0)
+    return -1;
+  *maxrss = ru.ru_maxrss;
+  return t;
+}
+
+/* Slope of log(y) against log(x) */
+static double fit_exponent(const double *x, const double *y, int n) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (int i = 0; i < n; i++) {
+    double lx = log(x[i]), ly = log(y[i] > 1e-9 ? y[i] : 1e-9);
+    sx += lx;
+    sy += ly;
+    sxx += lx * lx;
+    sxy += lx * ly;
+  }
+  return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+int main(int argc, char **argv) {
+  size_t base = 160 << 10;
+  int reps = 3;
+  double limit = 1.25;
+  int opt;
+  while ((opt = getopt(argc, argv, "b:r:l:w:")) != -1) {
+    switch (opt) {
+    case 'b':
+      base = (size_t)(atof(optarg) * 1024);
+      break;
+    case 'r':
+      reps = atoi(optarg);
+      break;
+    case 'l':
+      limit = atof(optarg);
+      break;
+    case 'w':
+      if (strcmp(optarg, "greedy") == 0 || strcmp(optarg, "optimal") == 0) {
+        wrap = optarg[0] == 'o' ? WRAP_OPTIMAL : WRAP_GREEDY;
+        break;
+      }
+      /* fall through */
+    default:
+      fprintf(stderr, "Usage: scaling [-b KB] [-r REPS] [-l LIMIT] "
+                      "[-w greedy|optimal]\n");
+      return 2;
+    }
+  }
+  if (reps < 1)
+    reps = 1;
+
+  int failed = 0;
+  for (size_t k = 0; k < sizeof(inputs) / sizeof(inputs[0]); k++) {
+    const struct input *in = &inputs[k];
+    long rss0;
+    if (measure(in, 0, 1, &rss0) < 0) {
+      fprintf(stderr, "%s: could not run the empty input\n", in->name);
+      return 2;
+    }
+    double sizes[NSIZES], times[NSIZES], mems[NSIZES];
+    for (int i = 0; i < NSIZES; i++) {
+      long rss;
+      sizes[i] = (double)(base << i);
+      times[i] = measure(in, base << i, reps, &rss);
+      if (times[i] < 0) {
+        fprintf(stderr, "%s: formatting %zu bytes failed\n", in->name,
+                base << i);
+        return 2;
+      }
+      /* memory beyond that of formatting nothing */
+      mems[i] = rss > rss0 ? (double)(rss - rss0) : 1;
+      fprintf(stderr, "%-14s %3dx %9.0f KB %10.4f s %9.0f KB\n", in->name,
+              1 << i, sizes[i] / 1024, times[i], mems[i]);
+    }
+    double texp = fit_exponent(&sizes[FIT_FROM], &times[FIT_FROM],
+                               NSIZES - FIT_FROM);
+    double mexp =
+        fit_exponent(&sizes[FIT_FROM], &mems[FIT_FROM], NSIZES - FIT_FROM);
+    int ok = texp <= limit && mexp <= limit;
+    printf("{\"input\": \"%s\", \"time_exponent\": %.3f, "
+           "\"memory_exponent\": %.3f, \"limit\": %.2f, \"ok\": %s}\n",
+           in->name, texp, mexp, limit, ok ? "true" : "false");
+    fflush(stdout);
+    if (!ok)
+      failed = 1;
+  }
+  if (failed)
+    fprintf(stderr, "superlinear growth detected\n");
+  return failed;
+}
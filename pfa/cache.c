@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+/* On disk: a header, then fixed-size records. Each record carries its
+ * own check value, so torn or damaged records are simply skipped. */
+static const char cache_magic[8] = {'p', 'f', 'a', 'c', 'a', 'c', 'h', 'e'};
+
+struct cache_header {
+  char magic[8];
+  uint32_t layout;
+  uint32_t version;
+  uint32_t recsize;
+  uint32_t pad[3];
+};
+
+struct cache_record {
+  uint64_t hash;
+  uint64_t size;
+  uint64_t check;
+};
+
+enum { CACHE_LAYOUT = 1 };
+/* Past this size, the cache is cleared rather than appended to */
+#define CACHE_MAX_BYTES (64 << 20)
+
+struct cache {
+  int fd;
+  uint32_t version;
+  /* open addressing; a zero check marks an empty slot */
+  struct cache_record *slots;
+  size_t mask;
+  /* set if the file must be rewritten from the valid records */
+  int damaged;
+  pthread_mutex_t lock;
+  /* every record added since opening, laid out as `slots` is, so that
+   * none is written twice */
+  struct cache_record *added;
+  size_t addmask;
+  size_t nadded;
+  /* added records not yet written */
+  struct cache_record *pending;
+  size_t npending;
+  size_t maxpending;
+};
+
+static uint64_t mix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint64_t read64(const char *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+/* Multiply-mix hash, 16 bytes per step */
+uint64_t cache_hash(const char *data, size_t len) {
+  const uint64_t k0 = 0xa0761d6478bd642full, k1 = 0xe7037ed1a0b428dbull,
+                 k2 = 0x8ebc6af09c88c6e3ull;
+  uint64_t seed = mix(len ^ k0, k1);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    seed = mix(read64(data + i) ^ k1, read64(data + i + 8) ^ seed);
+  }
+  char tail[16] = {0};
+  memcpy(tail, data + i, len - i);
+  seed = mix(read64(tail) ^ k2, read64(tail + 8) ^ seed);
+  return mix(seed ^ k0, len ^ k2);
+}
+
+static uint64_t record_check(uint64_t hash, uint64_t size, uint32_t version) {
+  /* never zero, so it can also mark used slots */
+  return mix(hash ^ 0x5bd1e995ull, size ^ ((uint64_t)version << 32)) | 1;
+}
+
+/* Returns 0 if `r` was already in the table */
+static int table_insert(struct cache_record *slots, size_t mask,
+                        const struct cache_record *r) {
+  size_t i = r->hash & mask;
+  while (slots[i].check) {
+    if (slots[i].hash == r->hash && slots[i].size == r->size)
+      return 0;
+    i = (i + 1) & mask;
+  }
+  slots[i] = *r;
+  return 1;
+}
+
+static void set_insert(struct cache *c, const struct cache_record *r) {
+  table_insert(c->slots, c->mask, r);
+}
+
+int cache_has(const struct cache *c, uint64_t hash, uint64_t size) {
+  size_t i = hash & c->mask;
+  while (c->slots[i].check) {
+    if (c->slots[i].hash == hash && c->slots[i].size == size)
+      return 1;
+    i = (i + 1) & c->mask;
+  }
+  return 0;
+}
+
+static int header_ok(const struct cache_header *h, uint32_t version) {
+  return memcmp(h->magic, cache_magic, 8) == 0 && h->layout == CACHE_LAYOUT &&
+         h->version == version && h->recsize == sizeof(struct cache_record);
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+  const char *p = (const char *)data;
+  while (len > 0) {
+    ssize_t w = write(fd, p, len);
+    if (w <= 0)
+      return -1;
+    p += w;
+    len -= w;
+  }
+  return 0;
+}
+
+/* Reset the file to an empty cache; call with the exclusive lock held */
+static void cache_reset(struct cache *c) {
+  struct cache_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, cache_magic, 8);
+  h.layout = CACHE_LAYOUT;
+  h.version = c->version;
+  h.recsize = sizeof(struct cache_record);
+  if (ftruncate(c->fd, 0) == 0) {
+    lseek(c->fd, 0, SEEK_SET);
+    write_all(c->fd, &h, sizeof(h));
+  }
+}
+
+struct cache *cache_open(const char *path, uint32_t version) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return NULL;
+  }
+  flock(fd, LOCK_SH);
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+  struct cache *c = (struct cache *)calloc(1, sizeof(struct cache));
+  c->fd = fd;
+  c->version = version;
+  pthread_mutex_init(&c->lock, NULL);
+
+  size_t nrecs = 0;
+  const char *map = NULL;
+  if (st.st_size >= (off_t)sizeof(struct cache_header)) {
+    map = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      map = NULL;
+    } else if (!header_ok((const struct cache_header *)map, version)) {
+      /* another version, or garbage: start over */
+      munmap((void *)map, st.st_size);
+      map = NULL;
+      c->damaged = 1;
+    } else {
+      nrecs = (st.st_size - sizeof(struct cache_header)) /
+              sizeof(struct cache_record);
+    }
+  } else if (st.st_size > 0) {
+    c->damaged = 1;
+  }
+
+  size_t nslots = 16;
+  while (nslots < 2 * nrecs)
+    nslots *= 2;
+  c->slots = (struct cache_record *)calloc(nslots, sizeof(struct cache_record));
+  c->mask = nslots - 1;
+  if (map) {
+    const struct cache_record *recs =
+        (const struct cache_record *)(map + sizeof(struct cache_header));
+    for (size_t i = 0; i < nrecs; i++) {
+      struct cache_record r;
+      memcpy(&r, &recs[i], sizeof(r));
+      if (r.check != record_check(r.hash, r.size, version)) {
+        c->damaged = 1;
+        continue;
+      }
+      set_insert(c, &r);
+    }
+    munmap((void *)map, st.st_size);
+  }
+  flock(fd, LOCK_UN);
+  return c;
+}
+
+void cache_add(struct cache *c, uint64_t hash, uint64_t size) {
+  if (cache_has(c, hash, size))
+    return;
+  struct cache_record r = {hash, size, record_check(hash, size, c->version)};
+  pthread_mutex_lock(&c->lock);
+  if (2 * (c->nadded + 1) > c->addmask + 1) {
+    /* keep the table at most half full */
+    size_t nslots = c->added ? 2 * (c->addmask + 1) : 64;
+    struct cache_record *grown =
+        (struct cache_record *)calloc(nslots, sizeof(struct cache_record));
+    for (size_t i = 0; c->added && i <= c->addmask; i++) {
+      if (c->added[i].check)
+        table_insert(grown, nslots - 1, &c->added[i]);
+    }
+    free(c->added);
+    c->added = grown;
+    c->addmask = nslots - 1;
+  }
+  if (!table_insert(c->added, c->addmask, &r)) {
+    pthread_mutex_unlock(&c->lock);
+    return;
+  }
+  c->nadded++;
+  if (c->npending == c->maxpending) {
+    c->maxpending = c->maxpending ? 2 * c->maxpending : 64;
+    c->pending = (struct cache_record *)realloc(
+        c->pending, sizeof(struct cache_record) * c->maxpending);
+  }
+  c->pending[c->npending++] = r;
+  pthread_mutex_unlock(&c->lock);
+}
+
+void cache_flush(struct cache *c) {
+  pthread_mutex_lock(&c->lock);
+  if (c->npending > 0 || c->damaged) {
+    flock(c->fd, LOCK_EX);
+    struct cache_header h;
+    struct stat st;
+    int valid = fstat(c->fd, &st) == 0 &&
+                pread(c->fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+                header_ok(&h, c->version);
+    if (!valid || c->damaged || st.st_size > CACHE_MAX_BYTES) {
+      cache_reset(c);
+      if (c->damaged && st.st_size <= CACHE_MAX_BYTES) {
+        /* keep what was still readable */
+        for (size_t i = 0; i <= c->mask; i++) {
+          if (c->slots[i].check)
+            write_all(c->fd, &c->slots[i], sizeof(struct cache_record));
+        }
+      }
+    } else {
+      /* cut off a record torn by a crashed writer */
+      off_t body = st.st_size - sizeof(struct cache_header);
+      off_t whole = body / sizeof(struct cache_record) *
+                    sizeof(struct cache_record);
+      if (whole != body) {
+        ftruncate(c->fd, sizeof(struct cache_header) + whole);
+      }
+    }
+    lseek(c->fd, 0, SEEK_END);
+    write_all(c->fd, c->pending, sizeof(struct cache_record) * c->npending);
+    flock(c->fd, LOCK_UN);
+    c->npending = 0;
+    c->damaged = 0;
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+void cache_close(struct cache *c) {
+  cache_flush(c);
+  close(c->fd);
+  free(c->slots);
+  free(c->added);
+  free(c->pending);
+  pthread_mutex_destroy(&c->lock);
+  free(c);
+}
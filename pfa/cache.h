@@ -0,0 +1,24 @@
+#ifndef PFA_CACHE_H
+#define PFA_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Persistent set of (content hash, size) pairs for files that are known
+ * to be formatted already, valid for one formatter version. The file is
+ * append-only and may be shared by concurrent processes. */
+struct cache;
+
+/* Returns NULL if the cache file can not be opened or created */
+struct cache *cache_open(const char *path, uint32_t version);
+/* Safe to call from several threads, as is cache_add */
+int cache_has(const struct cache *c, uint64_t hash, uint64_t size);
+void cache_add(struct cache *c, uint64_t hash, uint64_t size);
+/* Appends everything added and not yet written; for long-lived users */
+void cache_flush(struct cache *c);
+/* Flushes, then releases the cache */
+void cache_close(struct cache *c);
+
+uint64_t cache_hash(const char *data, size_t len);
+
+#endif
@@ -0,0 +1,471 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "diff.h"
+
+/* Diffs are found with Myers' O(ND) algorithm in its linear space form:
+ * the middle of a shortest edit script is found by searching from both
+ * ends at once, then each half is diffed in turn. pfa tends to change few
+ * lines of a file, so the common head and tail are set aside first by
+ * plain comparison, and only the lines between are hashed, to give each
+ * distinct line a small integer. */
+
+enum { CONTEXT = 3 };
+/* After this many edit steps in one search, a good split is taken instead
+ * of the best one, as GNU diff does; otherwise texts that share little
+ * would take quadratic time */
+enum { MIN_EXPENSIVE = 4096 };
+
+struct line_slot {
+  const char *text;
+  size_t len;
+  uint64_t hash;
+  int id;
+};
+
+struct seq {
+  const int *a;
+  const int *b;
+  char *achanged;
+  char *bchanged;
+  /* furthest x reached on each diagonal x - y, forwards and backwards */
+  int *fd;
+  int *bd;
+  int too_expensive;
+};
+
+/* A split point, and whether each side of it must be diffed minimally */
+struct part {
+  int x;
+  int y;
+  int lo_minimal;
+  int hi_minimal;
+};
+
+void differ_init(struct differ *df) {
+  df->astarts = vlbuf_make(sizeof(size_t));
+  df->bstarts = vlbuf_make(sizeof(size_t));
+  df->aids = vlbuf_make(sizeof(int));
+  df->bids = vlbuf_make(sizeof(int));
+  df->achanged = vlbuf_make(sizeof(char));
+  df->bchanged = vlbuf_make(sizeof(char));
+  df->diags = vlbuf_make(sizeof(int));
+  df->slots = vlbuf_make(sizeof(struct line_slot));
+}
+
+void differ_free(struct differ *df) {
+  vlbuf_free(&df->astarts);
+  vlbuf_free(&df->bstarts);
+  vlbuf_free(&df->aids);
+  vlbuf_free(&df->bids);
+  vlbuf_free(&df->achanged);
+  vlbuf_free(&df->bchanged);
+  vlbuf_free(&df->diags);
+  vlbuf_free(&df->slots);
+}
+
+static void reserve(struct vlbuf *b, size_t n) {
+  if (b->len <= n) {
+    vlbuf_expand(b, n);
+  }
+}
+
+/* Record where each line starts, and the end of the text after the last;
+ * a final line without a newline still counts. Returns the line count. */
+static int split_lines(const char *text, size_t len, struct vlbuf *starts) {
+  int n = 0;
+  size_t pos = 0;
+  while (pos < len) {
+    reserve(starts, n + 1);
+    ((size_t *)starts->d.vd)[n++] = pos;
+    const char *nl = (const char *)memchr(text + pos, '\n', len - pos);
+    pos = nl ? (size_t)(nl + 1 - text) : len;
+  }
+  reserve(starts, n + 1);
+  ((size_t *)starts->d.vd)[n] = len;
+  return n;
+}
+
+static int same_line(const char *a, const size_t *as, int i, const char *b,
+                     const size_t *bs, int j) {
+  size_t len = as[i + 1] - as[i];
+  return len == bs[j + 1] - bs[j] && memcmp(a + as[i], b + bs[j], len) == 0;
+}
+
+/* Give lines [from, to) of a text the ids of equal lines seen before, or
+ * new ones */
+static void number_lines(struct line_slot *slots, size_t mask, int *nids,
+                         const char *text, const size_t *starts, int from,
+                         int to, int *ids) {
+  for (int i = from; i < to; i++) {
+    const char *line = text + starts[i];
+    size_t len = starts[i + 1] - starts[i];
+    uint64_t hash = cache_hash(line, len);
+    size_t k = hash & mask;
+    while (slots[k].text &&
+           (slots[k].hash != hash || slots[k].len != len ||
+            memcmp(slots[k].text, line, len) != 0)) {
+      k = (k + 1) & mask;
+    }
+    if (!slots[k].text) {
+      slots[k].text = line;
+      slots[k].len = len;
+      slots[k].hash = hash;
+      slots[k].id = (*nids)++;
+    }
+    ids[i - from] = slots[k].id;
+  }
+}
+
+/* Find where a shortest edit script from (xoff, yoff) to (xlim, ylim)
+ * crosses its middle, or, when that is too costly and `minimal` is not
+ * set, a point that some short script passes through */
+static void split(const struct seq *s, int xoff, int xlim, int yoff,
+                  int ylim, int minimal, struct part *pt) {
+  const int *a = s->a, *b = s->b;
+  int *fd = s->fd, *bd = s->bd;
+  int dmin = xoff - ylim, dmax = xlim - yoff;
+  int fmid = xoff - yoff, bmid = xlim - ylim;
+  int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+  int odd = (fmid - bmid) & 1;
+  fd[fmid] = xoff;
+  bd[bmid] = xlim;
+  pt->lo_minimal = pt->hi_minimal = 1;
+  for (int c = 1;; c++) {
+    /* one more edit forwards, on every diagonal in reach */
+    if (fmin > dmin) {
+      fd[--fmin - 1] = -1;
+    } else {
+      fmin++;
+    }
+    if (fmax < dmax) {
+      fd[++fmax + 1] = -1;
+    } else {
+      fmax--;
+    }
+    for (int d = fmax; d >= fmin; d -= 2) {
+      int lo = fd[d - 1], hi = fd[d + 1];
+      int x = lo < hi ? hi : lo + 1;
+      int y = x - d;
+      while (x < xlim && y < ylim && a[x] == b[y]) {
+        x++;
+        y++;
+      }
+      fd[d] = x;
+      if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+        pt->x = x;
+        pt->y = y;
+        return;
+      }
+    }
+    /* and backwards */
+    if (bmin > dmin) {
+      bd[--bmin - 1] = INT_MAX;
+    } else {
+      bmin++;
+    }
+    if (bmax < dmax) {
+      bd[++bmax + 1] = INT_MAX;
+    } else {
+      bmax--;
+    }
+    for (int d = bmax; d >= bmin; d -= 2) {
+      int lo = bd[d - 1], hi = bd[d + 1];
+      int x = lo < hi ? lo : hi - 1;
+      int y = x - d;
+      while (xoff < x && yoff < y && a[x - 1] == b[y - 1]) {
+        x--;
+        y--;
+      }
+      bd[d] = x;
+      if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+        pt->x = x;
+        pt->y = y;
+        return;
+      }
+    }
+    if (minimal || c < s->too_expensive) {
+      continue;
+    }
+    /* Give up on the middle: take whichever search got furthest, and
+     * keep the part it covered minimal */
+    int fbest = -1, fxbest = 0;
+    for (int d = fmax; d >= fmin; d -= 2) {
+      int x = fd[d] < xlim ? fd[d] : xlim;
+      int y = x - d;
+      if (ylim < y) {
+        x = ylim + d;
+        y = ylim;
+      }
+      if (fbest < x + y) {
+        fbest = x + y;
+        fxbest = x;
+      }
+    }
+    int bbest = INT_MAX, bxbest = 0;
+    for (int d = bmax; d >= bmin; d -= 2) {
+      int x = xoff > bd[d] ? xoff : bd[d];
+      int y = x - d;
+      if (y < yoff) {
+        x = yoff + d;
+        y = yoff;
+      }
+      if (x + y < bbest) {
+        bbest = x + y;
+        bxbest = x;
+      }
+    }
+    if ((xlim + ylim) - bbest < fbest - (xoff + yoff)) {
+      pt->x = fxbest;
+      pt->y = fbest - fxbest;
+      pt->hi_minimal = 0;
+    } else {
+      pt->x = bxbest;
+      pt->y = bbest - bxbest;
+      pt->lo_minimal = 0;
+    }
+    return;
+  }
+}
+
+/* Mark the lines of a[xoff, xlim) and b[yoff, ylim) that a short edit
+ * script deletes or inserts */
+static void compare(const struct seq *s, int xoff, int xlim, int yoff,
+                    int ylim, int minimal) {
+  while (xoff < xlim && yoff < ylim && s->a[xoff] == s->b[yoff]) {
+    xoff++;
+    yoff++;
+  }
+  while (xoff < xlim && yoff < ylim && s->a[xlim - 1] == s->b[ylim - 1]) {
+    xlim--;
+    ylim--;
+  }
+  if (xoff == xlim) {
+    memset(&s->bchanged[yoff], 1, ylim - yoff);
+  } else if (yoff == ylim) {
+    memset(&s->achanged[xoff], 1, xlim - xoff);
+  } else {
+    struct part pt;
+    split(s, xoff, xlim, yoff, ylim, minimal, &pt);
+    compare(s, xoff, pt.x, yoff, pt.y, pt.lo_minimal);
+    compare(s, pt.x, xlim, pt.y, ylim, pt.hi_minimal);
+  }
+}
+
+/* Where a run of changes could as well be placed elsewhere (say, which of
+ * two blank lines was deleted), slide it down as far as it goes, then
+ * back up to meet a run of changes in the other text, as GNU diff does.
+ * Both `changed` arrays have a zero before and after their `n` lines. */
+static void shift_runs(char *changed, const char *other, int n,
+                       const char *text, const size_t *starts) {
+  int i = 0, j = 0;
+  while (1) {
+    while (i < n && !changed[i]) {
+      while (other[j++]) {
+      }
+      i++;
+    }
+    if (i == n) {
+      break;
+    }
+    int start = i;
+    while (changed[++i]) {
+    }
+    while (other[j]) {
+      j++;
+    }
+    int runlength, corresponding;
+    do {
+      runlength = i - start;
+      /* back, merging with runs before */
+      while (start && same_line(text, starts, start - 1, text, starts, i - 1)) {
+        changed[--start] = 1;
+        changed[--i] = 0;
+        while (changed[start - 1]) {
+          start--;
+        }
+        while (other[--j]) {
+        }
+      }
+      /* the last point at which the run meets one in the other text */
+      corresponding = other[j - 1] ? i : n;
+      /* then forward, merging with runs after */
+      while (i != n && same_line(text, starts, start, text, starts, i)) {
+        changed[start++] = 0;
+        changed[i++] = 1;
+        while (changed[i]) {
+          i++;
+        }
+        while (other[++j]) {
+          corresponding = i;
+        }
+      }
+    } while (runlength != i - start);
+    while (corresponding < i) {
+      changed[--start] = 1;
+      changed[--i] = 0;
+      while (other[--j]) {
+      }
+    }
+  }
+}
+
+static size_t put_line(struct vlbuf *out, size_t outlen, char mark,
+                       const char *text, const size_t *starts, int i) {
+  const char *line = text + starts[i];
+  size_t len = starts[i + 1] - starts[i];
+  outlen = vlbuf_append(out, &mark, 1, outlen);
+  outlen = vlbuf_append(out, line, len, outlen);
+  if (len == 0 || line[len - 1] != '\n') {
+    static const char nonl[] = "\n\\ No newline at end of file\n";
+    outlen = vlbuf_append(out, nonl, sizeof(nonl) - 1, outlen);
+  }
+  return outlen;
+}
+
+/* A range in a hunk header: lines [from, to), counting from 0 */
+static int put_range(char *buf, size_t size, int from, int to) {
+  if (to - from == 1) {
+    return snprintf(buf, size, "%d", from + 1);
+  }
+  /* an empty range names the line before it */
+  return snprintf(buf, size, "%d,%d", to > from ? from + 1 : from,
+                  to - from);
+}
+
+size_t diff_unified(struct differ *df, const char *name, const char *a,
+                    size_t alen, const char *b, size_t blen,
+                    struct vlbuf *out, size_t outlen) {
+  int na = split_lines(a, alen, &df->astarts);
+  int nb = split_lines(b, blen, &df->bstarts);
+  const size_t *as = (const size_t *)df->astarts.d.vd;
+  const size_t *bs = (const size_t *)df->bstarts.d.vd;
+
+  /* lines outside [head, na - tail) and [head, nb - tail) are the same */
+  int head = 0;
+  while (head < na && head < nb && same_line(a, as, head, b, bs, head)) {
+    head++;
+  }
+  if (head == na && head == nb) {
+    return outlen;
+  }
+  int tail = 0;
+  while (tail < na - head && tail < nb - head &&
+         same_line(a, as, na - 1 - tail, b, bs, nb - 1 - tail)) {
+    tail++;
+  }
+  int ma = na - head - tail, mb = nb - head - tail;
+
+  size_t nslots = 16;
+  while (nslots < 2 * (size_t)(ma + mb)) {
+    nslots *= 2;
+  }
+  reserve(&df->slots, nslots);
+  struct line_slot *slots = (struct line_slot *)df->slots.d.vd;
+  memset(slots, 0, nslots * sizeof(struct line_slot));
+  reserve(&df->aids, ma);
+  reserve(&df->bids, mb);
+  int nids = 0;
+  number_lines(slots, nslots - 1, &nids, a, as, head, head + ma,
+               df->aids.d.in);
+  number_lines(slots, nslots - 1, &nids, b, bs, head, head + mb,
+               df->bids.d.in);
+
+  reserve(&df->achanged, na + 2);
+  reserve(&df->bchanged, nb + 2);
+  memset(df->achanged.d.ch, 0, na + 2);
+  memset(df->bchanged.d.ch, 0, nb + 2);
+  char *ach = df->achanged.d.ch + 1, *bch = df->bchanged.d.ch + 1;
+  size_t ndiags = (size_t)ma + mb + 3;
+  reserve(&df->diags, 2 * ndiags);
+  struct seq s;
+  s.a = df->aids.d.in;
+  s.b = df->bids.d.in;
+  s.achanged = &ach[head];
+  s.bchanged = &bch[head];
+  s.fd = df->diags.d.in + mb + 1;
+  s.bd = df->diags.d.in + ndiags + mb + 1;
+  s.too_expensive = 1;
+  for (size_t d = ndiags; d != 0; d >>= 2) {
+    s.too_expensive <<= 1;
+  }
+  if (s.too_expensive < MIN_EXPENSIVE) {
+    s.too_expensive = MIN_EXPENSIVE;
+  }
+  compare(&s, 0, ma, 0, mb, 0);
+  shift_runs(ach, bch, na, a, as);
+  shift_runs(bch, ach, nb, b, bs);
+
+  char hdr[64];
+  outlen = vlbuf_append(out, "--- ", 4, outlen);
+  outlen = vlbuf_append(out, name, strlen(name), outlen);
+  outlen = vlbuf_append(out, "\n+++ ", 5, outlen);
+  outlen = vlbuf_append(out, name, strlen(name), outlen);
+  outlen = vlbuf_append(out, "\n", 1, outlen);
+  /* Walk both texts in step; each hunk runs from CONTEXT lines before a
+   * change to CONTEXT lines after the last change that follows within
+   * 2 * CONTEXT unchanged lines */
+  int i = head, j = head;
+  while (i < na || j < nb) {
+    if (i < na && j < nb && !ach[i] && !bch[j]) {
+      i++;
+      j++;
+      continue;
+    }
+    /* the lines before a change are unchanged in both texts, and more
+     * than CONTEXT of them separate it from any hunk before */
+    int before = i < CONTEXT ? i : CONTEXT;
+    int hi = i - before, hj = j - before;
+    /* find the end of the hunk */
+    int ei = i, ej = j;
+    while (1) {
+      while (ei < na && ach[ei]) {
+        ei++;
+      }
+      while (ej < nb && bch[ej]) {
+        ej++;
+      }
+      int run = 0;
+      while (ei + run < na && ej + run < nb && !ach[ei + run] &&
+             !bch[ej + run] && run <= 2 * CONTEXT) {
+        run++;
+      }
+      if (run <= 2 * CONTEXT && (ei + run < na || ej + run < nb)) {
+        ei += run;
+        ej += run;
+        continue;
+      }
+      int after = run < CONTEXT ? run : CONTEXT;
+      ei += after;
+      ej += after;
+      break;
+    }
+    int n = snprintf(hdr, sizeof(hdr), "@@ -");
+    n += put_range(hdr + n, sizeof(hdr) - n, hi, ei);
+    n += snprintf(hdr + n, sizeof(hdr) - n, " +");
+    n += put_range(hdr + n, sizeof(hdr) - n, hj, ej);
+    n += snprintf(hdr + n, sizeof(hdr) - n, " @@\n");
+    outlen = vlbuf_append(out, hdr, n, outlen);
+    int x = hi, y = hj;
+    while (x < ei || y < ej) {
+      if (x < ei && y < ej && !ach[x] && !bch[y]) {
+        outlen = put_line(out, outlen, ' ', a, as, x++);
+        y++;
+        continue;
+      }
+      while (x < ei && ach[x]) {
+        outlen = put_line(out, outlen, '-', a, as, x++);
+      }
+      while (y < ej && bch[y]) {
+        outlen = put_line(out, outlen, '+', b, bs, y++);
+      }
+    }
+    i = ei;
+    j = ej;
+  }
+  return outlen;
+}
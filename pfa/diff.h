@@ -0,0 +1,31 @@
+#ifndef PFA_DIFF_H
+#define PFA_DIFF_H
+
+#include <stddef.h>
+
+#include "format.h"
+
+/* Scratch space for diffs, kept from one file to the next */
+struct differ {
+  struct vlbuf astarts;
+  struct vlbuf bstarts;
+  struct vlbuf aids;
+  struct vlbuf bids;
+  struct vlbuf achanged;
+  struct vlbuf bchanged;
+  struct vlbuf diags;
+  struct vlbuf slots;
+};
+
+void differ_init(struct differ *df);
+void differ_free(struct differ *df);
+
+/* Append to `out`, at `outlen`, a unified diff that turns the `alen`
+ * bytes at `a` into the `blen` bytes at `b`, both labelled `name`.
+ * Returns the new length of `out`, which is `outlen` if the texts are
+ * the same. */
+size_t diff_unified(struct differ *df, const char *name, const char *a,
+                    size_t alen, const char *b, size_t blen,
+                    struct vlbuf *out, size_t outlen);
+
+#endif
@@ -0,0 +1,665 @@
+#include <string.h>
+#include <strings.h>
+
+#include "embed.h"
+#include "pfa.h"
+
+/* Notebooks are read in one pass, front to back, without building a tree:
+ * only the members on the way to cell sources and to the kernel's
+ * language are looked at, and every other value is skipped over. The
+ * output is the input, copied up to each piece of code that formats
+ * differently, which is then re-encoded in the layout it had. Markdown is
+ * handled the same way, a line at a time. */
+
+int embed_kind(const char *name) {
+  size_t n = strlen(name);
+  if (n > 6 && strcmp(&name[n - 6], ".ipynb") == 0) {
+    return EMBED_NOTEBOOK;
+  }
+  if ((n > 3 && strcmp(&name[n - 3], ".md") == 0) ||
+      (n > 9 && strcmp(&name[n - 9], ".markdown") == 0)) {
+    return EMBED_MARKDOWN;
+  }
+  return EMBED_NONE;
+}
+
+void embedder_init(struct embedder *em) {
+  em->code = vlbuf_make(sizeof(char));
+  em->encoded = vlbuf_make(sizeof(char));
+}
+
+void embedder_free(struct embedder *em) {
+  vlbuf_free(&em->code);
+  vlbuf_free(&em->encoded);
+}
+
+/* The output so far: the input up to `from`, with some spans replaced */
+struct emit {
+  struct vlbuf *out;
+  size_t len;
+  const char *from;
+};
+
+static void put(struct emit *e, const char *s, size_t n) {
+  e->len = vlbuf_append(e->out, s, n, e->len);
+}
+
+/* Copy the input up to `a`, then put the `n` bytes at `s` for [a, b) */
+static void replace(struct emit *e, const char *a, const char *b,
+                    const char *s, size_t n) {
+  put(e, e->from, a - e->from);
+  put(e, s, n);
+  e->from = b;
+}
+
+/* IPython magics, shell escapes, help queries and doctest prompts would be
+ * mangled if formatted as Python */
+static int plain_python(const char *code, size_t len) {
+  const char *end = code + len;
+  for (const char *line = code; line < end;) {
+    const char *eol = (const char *)memchr(line, '\n', end - line);
+    if (!eol) {
+      eol = end;
+    }
+    const char *p = line;
+    while (p < eol && (*p == ' ' || *p == '\t')) {
+      p++;
+    }
+    if (p < eol && (*p == '%' || *p == '!')) {
+      return 0;
+    }
+    if (eol - p >= 3 && memcmp(p, ">>>", 3) == 0) {
+      return 0;
+    }
+    const char *q = eol;
+    while (q > p && (q[-1] == ' ' || q[-1] == '\t' || q[-1] == '\r')) {
+      q--;
+    }
+    if (q > p && q[-1] == '?' && !memchr(p, '#', q - p)) {
+      return 0;
+    }
+    line = eol + 1;
+  }
+  return 1;
+}
+
+/* Format the `len` bytes of `code`; returns 1, with the result in `*out`,
+ * only if that differs from the original. Cells do not end in a newline,
+ * so none is added. */
+static int format_code(struct pfa_context *ctx, const char *code, size_t len,
+                       const char **out, size_t *outlen) {
+  if (len == 0 || !plain_python(code, len)) {
+    return 0;
+  }
+  pfa_format(ctx, code, len, out, outlen);
+  if (code[len - 1] != '\n' && *outlen > 0 && (*out)[*outlen - 1] == '\n') {
+    --*outlen;
+  }
+  return *outlen != len || memcmp(*out, code, len) != 0;
+}
+
+static const char *skip_ws(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t')) {
+    p++;
+  }
+  return p;
+}
+
+/* `p` is at a '"'; returns the end of the string, or NULL. Outputs hold
+ * long strings, such as images, so quotes are searched for directly. */
+static const char *skip_string(const char *p, const char *end) {
+  for (p++; (p = (const char *)memchr(p, '"', end - p)) != NULL; p++) {
+    /* the opening quote stops this */
+    const char *q = p;
+    while (q[-1] == '\\') {
+      q--;
+    }
+    if ((p - q) % 2 == 0) {
+      return p + 1;
+    }
+  }
+  return NULL;
+}
+
+/* Returns the end of the value at `p`, or NULL if there is none */
+static const char *skip_value(const char *p, const char *end) {
+  if (p >= end) {
+    return NULL;
+  }
+  if (*p == '"') {
+    return skip_string(p, end);
+  }
+  if (*p != '{' && *p != '[') {
+    const char *q = p;
+    while (q < end && !memchr(",]} \t\r\n", *q, 7)) {
+      q++;
+    }
+    return q > p ? q : NULL;
+  }
+  int depth = 0;
+  while (p < end) {
+    if (*p == '"') {
+      p = skip_string(p, end);
+      if (!p) {
+        return NULL;
+      }
+      continue;
+    }
+    if (*p == '{' || *p == '[') {
+      depth++;
+    } else if (*p == '}' || *p == ']') {
+      if (--depth == 0) {
+        return p + 1;
+      }
+    }
+    p++;
+  }
+  return NULL;
+}
+
+/* Step to the next member of an object, just inside its '{' or after the
+ * last value. Returns 1 with `*pp` at the value and [*key, *keyend) its
+ * quoted name, 0 with `*pp` after the closing '}', or -1 if malformed. */
+static int next_member(const char **pp, const char *end, const char **key,
+                       const char **keyend) {
+  const char *p = skip_ws(*pp, end);
+  if (p < end && *p == ',') {
+    p = skip_ws(p + 1, end);
+  }
+  if (p < end && *p == '}') {
+    *pp = p + 1;
+    return 0;
+  }
+  if (p >= end || *p != '"') {
+    return -1;
+  }
+  *key = p;
+  p = skip_string(p, end);
+  if (!p) {
+    return -1;
+  }
+  *keyend = p;
+  p = skip_ws(p, end);
+  if (p >= end || *p != ':') {
+    return -1;
+  }
+  *pp = skip_ws(p + 1, end);
+  return 1;
+}
+
+/* As next_member, for the elements of an array */
+static int next_element(const char **pp, const char *end) {
+  const char *p = skip_ws(*pp, end);
+  if (p < end && *p == ',') {
+    p = skip_ws(p + 1, end);
+  }
+  if (p < end && *p == ']') {
+    *pp = p + 1;
+    return 0;
+  }
+  if (p >= end) {
+    return -1;
+  }
+  *pp = p;
+  return 1;
+}
+
+/* Whether the quoted string [s, send) is `name`, without escapes */
+static int is_string(const char *s, const char *send, const char *name) {
+  size_t n = strlen(name);
+  return (size_t)(send - s) == n + 2 && memcmp(s + 1, name, n) == 0;
+}
+
+static long hex4(const char *p, const char *end) {
+  if (end - p < 4) {
+    return -1;
+  }
+  long v = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = p[i];
+    int d = c >= '0' && c <= '9'   ? c - '0'
+            : c >= 'a' && c <= 'f' ? c - 'a' + 10
+            : c >= 'A' && c <= 'F' ? c - 'A' + 10
+                                   : -1;
+    if (d < 0) {
+      return -1;
+    }
+    v = v * 16 + d;
+  }
+  return v;
+}
+
+static char *put_utf8(char *o, long cp) {
+  if (cp < 0x80) {
+    *o++ = cp;
+  } else if (cp < 0x800) {
+    *o++ = 0xc0 | cp >> 6;
+    *o++ = 0x80 | (cp & 0x3f);
+  } else if (cp < 0x10000) {
+    *o++ = 0xe0 | cp >> 12;
+    *o++ = 0x80 | (cp >> 6 & 0x3f);
+    *o++ = 0x80 | (cp & 0x3f);
+  } else {
+    *o++ = 0xf0 | cp >> 18;
+    *o++ = 0x80 | (cp >> 12 & 0x3f);
+    *o++ = 0x80 | (cp >> 6 & 0x3f);
+    *o++ = 0x80 | (cp & 0x3f);
+  }
+  return o;
+}
+
+/* Append the text of the JSON string [s, send) to `buf`, at `*len`.
+ * Returns -1 for an invalid escape. Escapes are never shorter than what
+ * they stand for, so the string's length is enough room. */
+static int decode_string(const char *s, const char *send, struct vlbuf *buf,
+                         size_t *len) {
+  const char *p = s + 1, *end = send - 1;
+  if (buf->len <= *len + (end - p) + 1) {
+    vlbuf_expand(buf, *len + (end - p) + 1);
+  }
+  char *o = &buf->d.ch[*len];
+  while (p < end) {
+    const char *bs = (const char *)memchr(p, '\\', end - p);
+    size_t plain = (bs ? bs : end) - p;
+    memcpy(o, p, plain);
+    o += plain;
+    p += plain;
+    if (!bs) {
+      break;
+    }
+    char c = p[1];
+    p += 2;
+    switch (c) {
+    case 'n':
+      *o++ = '\n';
+      break;
+    case 't':
+      *o++ = '\t';
+      break;
+    case 'r':
+      *o++ = '\r';
+      break;
+    case 'b':
+      *o++ = '\b';
+      break;
+    case 'f':
+      *o++ = '\f';
+      break;
+    case '"':
+    case '\\':
+    case '/':
+      *o++ = c;
+      break;
+    case 'u': {
+      long cp = hex4(p, end);
+      p += 4;
+      if (cp >= 0xd800 && cp < 0xdc00) {
+        /* the first half of a surrogate pair */
+        long lo = end - p >= 6 && p[0] == '\\' && p[1] == 'u'
+                      ? hex4(p + 2, end)
+                      : -1;
+        if (lo < 0xdc00 || lo >= 0xe000) {
+          return -1;
+        }
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+        p += 6;
+      } else if (cp < 0 || (cp >= 0xdc00 && cp < 0xe000)) {
+        return -1;
+      }
+      o = put_utf8(o, cp);
+    } break;
+    default:
+      return -1;
+    }
+  }
+  *len = o - buf->d.ch;
+  *o = '\0';
+  return 0;
+}
+
+/* Append the `n` bytes at `s` to `buf`, at `len`, as a JSON string,
+ * escaped as Jupyter writes it; returns the new length */
+static size_t encode_string(struct vlbuf *buf, size_t len, const char *s,
+                            size_t n) {
+  if (buf->len <= len + 6 * n + 2) {
+    vlbuf_expand(buf, len + 6 * n + 2);
+  }
+  static const char hex[] = "0123456789abcdef";
+  char *o = &buf->d.ch[len];
+  *o++ = '"';
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = s[i];
+    const char *esc = c == '"'    ? "\\\""
+                      : c == '\\' ? "\\\\"
+                      : c == '\n' ? "\\n"
+                      : c == '\t' ? "\\t"
+                      : c == '\r' ? "\\r"
+                      : c == '\b' ? "\\b"
+                      : c == '\f' ? "\\f"
+                                  : NULL;
+    if (esc) {
+      *o++ = esc[0];
+      *o++ = esc[1];
+    } else if (c < 0x20) {
+      memcpy(o, "\\u00", 4);
+      o[4] = hex[c >> 4];
+      o[5] = hex[c & 15];
+      o += 6;
+    } else {
+      *o++ = c;
+    }
+  }
+  *o++ = '"';
+  return o - buf->d.ch;
+}
+
+/* Replace the source [v, vend) of a code cell, either one string or an
+ * array of lines, if it formats differently. Lines are written out with
+ * the spacing found around and between the original ones. */
+static void format_source(struct embedder *em, struct pfa_context *ctx,
+                          struct emit *e, const char *v, const char *vend) {
+  size_t len = 0;
+  const char *first = NULL, *lastend = NULL, *sep = NULL, *sepend = NULL;
+  if (*v == '"') {
+    if (decode_string(v, vend, &em->code, &len)) {
+      return;
+    }
+  } else {
+    const char *p = v + 1;
+    int r, n = 0;
+    while ((r = next_element(&p, vend)) == 1) {
+      const char *q = *p == '"' ? skip_string(p, vend) : NULL;
+      if (!q || decode_string(p, q, &em->code, &len)) {
+        return;
+      }
+      if (n == 0) {
+        first = p;
+      } else if (n == 1) {
+        sep = lastend;
+        sepend = p;
+      }
+      lastend = q;
+      n++;
+      p = q;
+    }
+    if (r < 0) {
+      return;
+    }
+  }
+  const char *f;
+  size_t flen;
+  if (!format_code(ctx, em->code.d.ch, len, &f, &flen)) {
+    return;
+  }
+
+  size_t o;
+  if (*v == '"') {
+    o = encode_string(&em->encoded, 0, f, flen);
+  } else if (flen == 0) {
+    o = vlbuf_append(&em->encoded, "[]", 2, 0);
+  } else {
+    o = vlbuf_append(&em->encoded, v, first - v, 0);
+    for (const char *line = f, *fend = f + flen; line < fend;) {
+      const char *eol = (const char *)memchr(line, '\n', fend - line);
+      size_t llen = eol ? (size_t)(eol + 1 - line) : (size_t)(fend - line);
+      if (line > f && sep) {
+        o = vlbuf_append(&em->encoded, sep, sepend - sep, o);
+      } else if (line > f) {
+        /* a single line had no separator; space as before the first */
+        o = vlbuf_append(&em->encoded, ",", 1, o);
+        o = vlbuf_append(&em->encoded, v + 1, first - (v + 1), o);
+      }
+      o = encode_string(&em->encoded, o, line, llen);
+      line += llen;
+    }
+    o = vlbuf_append(&em->encoded, lastend, vend - lastend, o);
+  }
+  replace(e, v, vend, em->encoded.d.ch, o);
+}
+
+/* Format the cell whose members start at `p`; returns the end of the cell,
+ * or NULL if it is malformed */
+static const char *format_cell(struct embedder *em, struct pfa_context *ctx,
+                               struct emit *e, const char *p,
+                               const char *end) {
+  const char *key, *keyend, *source = NULL, *sourceend = NULL;
+  int code = 0, r;
+  while ((r = next_member(&p, end, &key, &keyend)) == 1) {
+    const char *v = p;
+    p = skip_value(p, end);
+    if (!p) {
+      return NULL;
+    }
+    if (is_string(key, keyend, "cell_type")) {
+      code = is_string(v, p, "code");
+    } else if (is_string(key, keyend, "source") && (*v == '"' || *v == '[')) {
+      source = v;
+      sourceend = p;
+    }
+  }
+  if (r < 0) {
+    return NULL;
+  }
+  if (code && source) {
+    format_source(em, ctx, e, source, sourceend);
+  }
+  return p;
+}
+
+/* Read the notebook metadata, whose members start at `p`, clearing
+ * `*python` if the kernel is for another language */
+static const char *read_language(const char *p, const char *end,
+                                 int *python) {
+  const char *key, *keyend;
+  int r;
+  while ((r = next_member(&p, end, &key, &keyend)) == 1) {
+    const char *field = is_string(key, keyend, "kernelspec")      ? "language"
+                        : is_string(key, keyend, "language_info") ? "name"
+                                                                  : NULL;
+    if (field && p < end && *p == '{') {
+      p++;
+      while ((r = next_member(&p, end, &key, &keyend)) == 1) {
+        const char *v = p;
+        p = skip_value(p, end);
+        if (!p) {
+          return NULL;
+        }
+        if (is_string(key, keyend, field) && *v == '"') {
+          *python = p - v >= 8 && memcmp(v + 1, "python", 6) == 0;
+        }
+      }
+    } else {
+      p = skip_value(p, end);
+    }
+    if (!p || r < 0) {
+      return NULL;
+    }
+  }
+  return r < 0 ? NULL : p;
+}
+
+/* Returns 0 if the notebook is malformed, or not for Python; whatever
+ * was put in `e` is then to be discarded */
+static int format_notebook(struct embedder *em, struct pfa_context *ctx,
+                           struct emit *e, const char *text, size_t len) {
+  const char *end = text + len;
+  const char *p = skip_ws(text, end), *key, *keyend;
+  int python = 1, r;
+  if (p >= end || *p != '{') {
+    return 0;
+  }
+  p++;
+  while ((r = next_member(&p, end, &key, &keyend)) == 1) {
+    if (is_string(key, keyend, "cells") && p < end && *p == '[') {
+      p++;
+      while ((r = next_element(&p, end)) == 1) {
+        p = *p == '{' ? format_cell(em, ctx, e, p + 1, end)
+                      : skip_value(p, end);
+        if (!p) {
+          return 0;
+        }
+      }
+      if (r < 0) {
+        return 0;
+      }
+    } else if (is_string(key, keyend, "metadata") && p < end && *p == '{') {
+      p = read_language(p + 1, end, &python);
+    } else {
+      p = skip_value(p, end);
+    }
+    if (!p) {
+      return 0;
+    }
+  }
+  return r == 0 && python;
+}
+
+/* If [line, eol) opens or closes a fence, of at least three '`' or '~'
+ * after at most three spaces, returns how many, and sets `*indent` */
+static size_t fence(const char *line, const char *eol, size_t *indent) {
+  const char *p = line;
+  while (p < eol && p - line < 3 && *p == ' ') {
+    p++;
+  }
+  if (p >= eol || (*p != '`' && *p != '~')) {
+    return 0;
+  }
+  const char *q = p;
+  while (q < eol && *q == *p) {
+    q++;
+  }
+  if (q - p < 3) {
+    return 0;
+  }
+  *indent = p - line;
+  return q - p;
+}
+
+/* Whether a fence's info string [p, eol) names Python */
+static int python_info(const char *p, const char *eol) {
+  static const char *const names[] = {"python", "py", "python3"};
+  while (p < eol && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+  const char *q = p;
+  while (q < eol && *q != ' ' && *q != '\t' && *q != '\r' && *q != '{') {
+    q++;
+  }
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if ((size_t)(q - p) == strlen(names[i]) &&
+        strncasecmp(p, names[i], q - p) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Format the block [body, bend) of a fence indented by `indent` spaces,
+ * which its lines share; lines with less are left as they are */
+static void format_block(struct embedder *em, struct pfa_context *ctx,
+                         struct emit *e, const char *body, const char *bend,
+                         size_t indent) {
+  const char *code = body;
+  size_t len = bend - body;
+  if (indent > 0) {
+    len = 0;
+    for (const char *line = body; line < bend;) {
+      const char *eol = (const char *)memchr(line, '\n', bend - line);
+      size_t k = 0;
+      while (k < indent && line + k < eol && line[k] == ' ') {
+        k++;
+      }
+      if (k < indent && line + k < eol) {
+        return;
+      }
+      len = vlbuf_append(&em->code, line + k, eol + 1 - (line + k), len);
+      line = eol + 1;
+    }
+    code = em->code.d.ch;
+  }
+  const char *f;
+  size_t flen;
+  if (!format_code(ctx, code, len, &f, &flen)) {
+    return;
+  }
+  if (indent == 0) {
+    replace(e, body, bend, f, flen);
+    return;
+  }
+  static const char spaces[3] = {' ', ' ', ' '};
+  size_t o = 0;
+  for (const char *line = f, *fend = f + flen; line < fend;) {
+    const char *eol = (const char *)memchr(line, '\n', fend - line);
+    size_t llen = eol ? (size_t)(eol + 1 - line) : (size_t)(fend - line);
+    if (line[0] != '\n') {
+      o = vlbuf_append(&em->encoded, spaces, indent, o);
+    }
+    o = vlbuf_append(&em->encoded, line, llen, o);
+    line += llen;
+  }
+  replace(e, body, bend, em->encoded.d.ch, o);
+}
+
+static void format_markdown(struct embedder *em, struct pfa_context *ctx,
+                            struct emit *e, const char *text, size_t len) {
+  const char *end = text + len;
+  for (const char *line = text; line < end;) {
+    const char *eol = (const char *)memchr(line, '\n', end - line);
+    if (!eol) {
+      return;
+    }
+    size_t indent, n = fence(line, eol, &indent);
+    const char *open = line;
+    line = eol + 1;
+    if (!n) {
+      continue;
+    }
+    /* `indent` is only set for a fence */
+    char c = open[indent];
+    const char *info = open + indent + n;
+    if (c == '`' && memchr(info, '`', eol - info)) {
+      continue;
+    }
+    /* the block runs to a fence as long, or to the end of the text */
+    const char *body = line;
+    while (line < end) {
+      const char *leol = (const char *)memchr(line, '\n', end - line);
+      if (!leol) {
+        leol = end;
+      }
+      size_t cindent, cn = fence(line, leol, &cindent);
+      const char *close = line;
+      line = leol < end ? leol + 1 : end;
+      if (cn >= n && close[cindent] == c) {
+        const char *rest = close + cindent + cn;
+        while (rest < leol && (*rest == ' ' || *rest == '\t' || *rest == '\r')) {
+          rest++;
+        }
+        if (rest == leol) {
+          if (python_info(info, eol)) {
+            format_block(em, ctx, e, body, close, indent);
+          }
+          break;
+        }
+      }
+    }
+  }
+}
+
+size_t embed_format(struct embedder *em, struct pfa_context *ctx, int kind,
+                    const char *text, size_t len, struct vlbuf *out) {
+  struct emit e = {out, 0, text};
+  if (out->len <= len + len / 8 + 64) {
+    vlbuf_expand(out, len + len / 8 + 64);
+  }
+  if (kind == EMBED_NOTEBOOK) {
+    if (!format_notebook(em, ctx, &e, text, len)) {
+      e.len = 0;
+      e.from = text;
+    }
+  } else if (kind == EMBED_MARKDOWN) {
+    format_markdown(em, ctx, &e, text, len);
+  }
+  put(&e, e.from, text + len - e.from);
+  return e.len;
+}
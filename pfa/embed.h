@@ -0,0 +1,31 @@
+#ifndef PFA_EMBED_H
+#define PFA_EMBED_H
+
+#include <stddef.h>
+
+#include "format.h"
+
+/* Files that hold Python code among other text, told apart by name */
+enum { EMBED_NONE, EMBED_NOTEBOOK, EMBED_MARKDOWN };
+
+int embed_kind(const char *name);
+
+/* Scratch space for embedded code, kept from one file to the next */
+struct embedder {
+  struct vlbuf code;
+  struct vlbuf encoded;
+};
+
+void embedder_init(struct embedder *em);
+void embedder_free(struct embedder *em);
+
+/* Write to `out` the `len` bytes at `text`, a file of the given kind,
+ * with the source of each code cell of a notebook, or each ```python
+ * block of Markdown, formatted as pfa would format it alone. All else is
+ * copied unchanged, as is code that does not look like plain Python
+ * (e.g. it uses IPython magics) and any notebook that is not valid JSON.
+ * Returns the length of `out`. */
+size_t embed_format(struct embedder *em, struct pfa_context *ctx, int kind,
+                    const char *text, size_t len, struct vlbuf *out);
+
+#endif
@@ -0,0 +1,1720 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "format.h"
+#include "lextab.h"
+#include "scan.h"
+
+/* Token states and byte classes are specified in lexer.def */
+
+enum {
+  LINE_IS_BLANK,
+  LINE_IS_CONTINUATION,
+  LINE_IS_TRISTR,
+  LINE_IS_NORMAL,
+};
+
+/* WRAP_OPTIMAL also scores each extra line, so that only deep nesting
+ * makes more lines worth having */
+enum { SSCORE_COMMENT = 10000, SSCORE_NESTING = -100, SSCORE_LINE = -1000 };
+/* streams are read this much at a time; output is written, and compared,
+ * this much at a time */
+enum { READ_BLOCK = 1 << 16, SINK_BLOCK = 1 << 18, CHECK_BLOCK = 1 << 12 };
+/* scratch is kept for logical lines at least this long, or as long as the
+ * whole text if that is shorter */
+enum { LINE_RESERVE = 1 << 12, ARENA_ALIGN = 16 };
+
+struct vlbuf vlbuf_make(size_t es) {
+  struct vlbuf ib;
+  ib.esize = es;
+  ib.len = 16;
+  ib.d.vd = malloc(ib.len * ib.esize);
+  ib.fixed = 0;
+  return ib;
+}
+
+size_t vlbuf_expand(struct vlbuf *ib, size_t minsize) {
+  size_t old = ib->len;
+  do {
+    ib->len *= 2;
+  } while (ib->len <= minsize);
+  if (ib->fixed) {
+    void *d = malloc(ib->len * ib->esize);
+    memcpy(d, ib->d.vd, old * ib->esize);
+    ib->d.vd = d;
+    ib->fixed = 0;
+  } else {
+    ib->d.vd = realloc(ib->d.vd, ib->len * ib->esize);
+  }
+  return ib->len;
+}
+
+/* Grow `ib` to at least `size` elements, if it is smaller; each growth
+ * counts as a regrowth in `st`, if set */
+static void vlbuf_reserve(struct vlbuf *ib, size_t size, struct pfa_stats *st) {
+  if (ib->len < size) {
+    vlbuf_expand(ib, size);
+    if (st) {
+      st->regrowths++;
+    }
+  }
+}
+
+size_t vlbuf_append(struct vlbuf *ib, const char *str, size_t lstr,
+                    size_t countedlen) {
+  if (ib->len <= countedlen + lstr + 1) {
+    vlbuf_expand(ib, lstr + countedlen + 1);
+  }
+  memcpy(&ib->d.ch[countedlen], str, lstr);
+  ib->d.ch[countedlen + lstr] = '\0';
+  return lstr + countedlen;
+}
+
+void vlbuf_free(struct vlbuf *ib) {
+  if (!ib->fixed) {
+    free(ib->d.vd);
+  }
+  ib->d.vd = 0;
+  ib->len = 0;
+}
+
+size_t strapp(char *target, const char *app) {
+  size_t delta = 0;
+  while (*app != '\0') {
+    target[delta] = *app;
+    delta++;
+    app++;
+  }
+  return delta;
+}
+_Static_assert((int)LEX_NTOKENS <= (int)STATS_TOKENS, "--stats cannot count tokens");
+
+const char *tok_to_string(int tok) {
+  if (tok < 0 || tok >= LEX_NTOKENS) {
+    return "???";
+  }
+  return lex_token_names[tok];
+}
+
+const char *ls_to_string(int ls) {
+  switch (ls) {
+  case LINE_IS_BLANK:
+    return "LINE_BLNK";
+  case LINE_IS_CONTINUATION:
+    return "LINE_CONT";
+  case LINE_IS_NORMAL:
+    return "LINE_NORM";
+  case LINE_IS_TRISTR:
+    return "LINE_TSTR";
+  default:
+    return "LINE_????";
+  }
+}
+
+#ifdef PFA_LEXREF
+/* The hand-written tokenizer that lexer.def replaced, kept so that
+ * `make lexcheck` can compare the two token by token */
+static int isalpha_lead(char c) {
+  if ((unsigned int)c > 127)
+    return 1;
+  if ('a' <= c && c <= 'z')
+    return 1;
+  if ('A' <= c && c <= 'Z')
+    return 1;
+  if ('_' == c)
+    return 1;
+  return 0;
+}
+static int isnumeric_lead(char c) {
+  if ('0' <= c && c <= '9')
+    return 1;
+  if ('.' == c)
+    return 1;
+  return 0;
+}
+
+static int isoptype(char c) {
+  if (c == '=' || c == '+' || c == '-' || c == '@' || c == '|' || c == '^' ||
+      c == '&' || c == '*' || c == '/' || c == '<' || c == '>' || c == '!' ||
+      c == '~' || c == '%')
+    return 1;
+  return 0;
+}
+
+/* import keyword; print(*keyword.kwlist) */
+static const char *specnames[] = {
+    "and",    "as",    "assert", "break",  "class",   "continue", "def",
+    "del",    "elif",  "else",   "except", "finally", "for",      "from",
+    "global", "if",    "import", "in",     "is",      "lambda",   "nonlocal",
+    "not",    "or",    "pass",   "raise",  "return",  "try",      "while",
+    "with",   "yield", NULL};
+
+static int is_special_name(const char *tst, size_t len) {
+  for (int i = 0; specnames[i]; i++) {
+    if (strlen(specnames[i]) == len && memcmp(specnames[i], tst, len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+#else
+static int isnumeric_lead(char c) {
+  return lex_flags[(unsigned char)c] & LEXF_NUMERIC;
+}
+
+static int isoptype(char c) {
+  return lex_flags[(unsigned char)c] & LEXF_OPTYPE;
+}
+
+static int is_special_name(const char *tst, size_t len) {
+  int fcode = 0;
+  for (size_t k = 0; k < len; k++) {
+    if (tst[k] < 'a' || tst[k] > 'z') {
+      return 0;
+    }
+    fcode = lex_kw_next[fcode][tst[k] - 'a'];
+    if (fcode == -1) {
+      return 0;
+    }
+  }
+  return lex_kw_final[fcode];
+}
+#endif
+
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+/* Write [str, str + n) to `fd`, halting if it can take no more */
+static void sink_put(struct sink *sk, const char *str, size_t n) {
+  while (n > 0 && !sk->halted) {
+    ssize_t w = write(sk->fd, str, n);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      sk->halted = 1;
+      break;
+    }
+    str += w;
+    n -= w;
+  }
+}
+
+/* For SINK_FD with `expect`: note whether [str, str + n), about to be
+ * passed on, still matches */
+static void sink_match(struct sink *sk, const char *str, size_t n) {
+  if (sk->expect && !sk->differs &&
+      (sk->len + n > sk->expectlen ||
+       memcmp(&sk->expect[sk->len], str, n) != 0)) {
+    sk->differs = 1;
+  }
+}
+
+/* A rewrite has found its first difference: what came before it matched,
+ * so is written from `expect` */
+static void sink_diverge(struct sink *sk) {
+  sk->differs = 1;
+  sink_put(sk, sk->expect, sk->len);
+}
+
+/* Pass on [str, str + n), bypassing the stage */
+static void sink_emit(struct sink *sk, const char *str, size_t n) {
+  uint64_t t = sk->stats ? stats_clock() : 0;
+  if (sk->kind == SINK_FD) {
+    sink_match(sk, str, n);
+    sink_put(sk, str, n);
+  } else if (sk->kind == SINK_FN) {
+    if (!sk->halted && sk->fn(str, n, sk->arg) != 0) {
+      sk->halted = 1;
+    }
+  } else if (sk->differs) {
+    sink_put(sk, str, n);
+  } else if (sk->len + n > sk->expectlen ||
+             memcmp(&sk->expect[sk->len], str, n) != 0) {
+    if (sk->kind == SINK_EXPECT) {
+      sk->differs = sk->halted = 1;
+    } else {
+      sink_diverge(sk);
+      sink_put(sk, str, n);
+    }
+  }
+  sk->len += n;
+  if (sk->stats) {
+    sk->stats->ns_write += stats_clock() - t;
+  }
+}
+
+/* Hand a full stage of a pipe's output over to the pipe itself. Spliced
+ * pages stay referenced by the pipe until read, so they are never written
+ * again: the block is unmapped, and a fresh one takes its place. */
+static void sink_splice(struct sink *sk) {
+  uint64_t t = sk->stats ? stats_clock() : 0;
+  sink_match(sk, sk->stage, sk->fill);
+  struct iovec iov = {sk->stage, sk->fill};
+  while (iov.iov_len > 0) {
+    ssize_t w = vmsplice(sk->fd, &iov, 1, SPLICE_F_GIFT);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      break;
+    }
+    iov.iov_base = (char *)iov.iov_base + w;
+    iov.iov_len -= w;
+  }
+  if (sk->stats) {
+    sk->stats->ns_write += stats_clock() - t;
+  }
+  size_t done = sk->fill - iov.iov_len;
+  sk->len += done;
+  sk->fill = 0;
+  if (iov.iov_len > 0) {
+    /* the pipe would not take it; write() reports why, if it matters */
+    sk->pipe = 0;
+    sink_emit(sk, (const char *)iov.iov_base, iov.iov_len);
+  }
+  if (done > 0) {
+    munmap(sk->stage, SINK_BLOCK);
+    char *fresh = (char *)mmap(NULL, SINK_BLOCK, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    sk->stage = fresh == MAP_FAILED ? NULL : fresh;
+    if (!sk->stage) {
+      sk->cap = 0;
+      sk->pipe = 0;
+    }
+  }
+}
+
+static void sink_flush(struct sink *sk) {
+  if (sk->pipe && sk->fill == sk->cap) {
+    sink_splice(sk);
+  } else if (sk->fill > 0) {
+    sink_emit(sk, sk->stage, sk->fill);
+    sk->fill = 0;
+  }
+}
+
+/* The slow path of sink_write: the stage is full */
+static void sink_overflow(struct sink *sk, const char *str, size_t n) {
+  if (sk->kind == SINK_BUF) {
+    if (sk->stats) {
+      sk->stats->regrowths++;
+    }
+    vlbuf_expand(sk->buf, sk->fill + n + 1);
+    sk->stage = sk->buf->d.ch;
+    sk->cap = sk->buf->len - 1;
+  } else {
+    /* top up the stage, so that pipes are only given whole blocks */
+    size_t part = sk->cap - sk->fill;
+    memcpy(&sk->stage[sk->fill], str, part);
+    sk->fill = sk->cap;
+    str += part;
+    n -= part;
+    sink_flush(sk);
+    if (!sk->stage) {
+      sink_emit(sk, str, n);
+      return;
+    }
+    while (n > sk->cap && sk->pipe) {
+      memcpy(sk->stage, str, sk->cap);
+      sk->fill = sk->cap;
+      str += sk->cap;
+      n -= sk->cap;
+      sink_flush(sk);
+    }
+    if (n > sk->cap) {
+      sink_emit(sk, str, n);
+      return;
+    }
+  }
+  memcpy(&sk->stage[sk->fill], str, n);
+  sk->fill += n;
+}
+
+static inline void sink_write(struct sink *sk, const char *str, size_t n) {
+  if (sk->fill + n <= sk->cap) {
+    memcpy(&sk->stage[sk->fill], str, n);
+    sk->fill += n;
+    return;
+  }
+  sink_overflow(sk, str, n);
+}
+
+static inline void sink_spaces(struct sink *sk, size_t n) {
+  if (sk->fill + n <= sk->cap) {
+    memset(&sk->stage[sk->fill], ' ', n);
+    sk->fill += n;
+    return;
+  }
+  static const char spaces[64] = "                                "
+                                 "                                ";
+  for (; n > 64; n -= 64) {
+    sink_write(sk, spaces, 64);
+  }
+  sink_write(sk, spaces, n);
+}
+
+/* Set up the stage; checks are made in small blocks, so that formatting
+ * stops soon after the first difference. Formatted text is about as long
+ * as the `size` bytes of input, so buffers are grown to that up front. */
+static void sink_open(struct pfa_context *ctx, struct sink *sk, size_t size) {
+  sk->len = sk->fill = 0;
+  sk->differs = sk->halted = sk->pipe = 0;
+  if (sk->kind == SINK_BUF) {
+    size_t want = size + size / 8 + 64;
+    if (sk->buf->len < want) {
+      vlbuf_expand(sk->buf, want);
+    }
+    sk->stage = sk->buf->d.ch;
+    sk->cap = sk->buf->len - 1;
+    return;
+  }
+  if (!ctx->outblock) {
+    char *block = (char *)mmap(NULL, SINK_BLOCK, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ctx->outblock = block == MAP_FAILED ? NULL : block;
+  }
+  sk->stage = ctx->outblock;
+  sk->cap = sk->kind == SINK_EXPECT ? CHECK_BLOCK : SINK_BLOCK;
+  if (sk->kind == SINK_FD) {
+    struct stat st;
+    sk->pipe = fstat(sk->fd, &st) == 0 && S_ISFIFO(st.st_mode);
+  }
+  if (!sk->stage) {
+    /* unstaged, but still correct */
+    sk->cap = 0;
+    sk->pipe = 0;
+  }
+}
+
+static void sink_close(struct pfa_context *ctx, struct sink *sk) {
+  if (sk->kind == SINK_BUF) {
+    sk->stage[sk->fill] = '\0';
+    sk->len = sk->fill;
+    return;
+  }
+  if (!sk->halted) {
+    sink_flush(sk);
+  }
+  sk->len += sk->fill;
+  sk->fill = 0;
+  if (sk->kind == SINK_REWRITE && !sk->differs && sk->len != sk->expectlen) {
+    /* the output is a prefix of `expect` */
+    sink_diverge(sk);
+  }
+  if (sk->kind == SINK_FD && sk->expect &&
+      (sk->halted || sk->len != sk->expectlen)) {
+    /* a prefix, or not all of it compared */
+    sk->differs = 1;
+  }
+  /* splicing may have replaced the block */
+  ctx->outblock = sk->stage;
+}
+
+/* The carry is tracked without building tokens, so that line ranges and
+ * split files can find where it is safe to start and stop formatting. This
+ * must follow pyformat's rules exactly, quirks included. */
+
+/* Advance over the line [line, eolpos], where *eolpos is '\n' */
+static void carry_line(struct carry *c, const char *line,
+                       const char *eolpos) {
+  if (c->line_state == LINE_IS_NORMAL || c->line_state == LINE_IS_BLANK) {
+    c->nestings = 0;
+    c->lcont = 0;
+  }
+  /* indentation and the runs within strings are short in most code, so
+   * plain loops beat calls to the scan kernels here */
+  const char *cur = line;
+  if (c->line_state != LINE_IS_TRISTR) {
+    while (cur < eolpos && (*cur == ' ' || *cur == '\t')) {
+      cur++;
+    }
+    if (cur == eolpos) {
+      c->line_state = LINE_IS_BLANK;
+      return;
+    }
+  }
+  int proctok = c->line_state == LINE_IS_TRISTR ? TOK_TRISTR : TOK_INBETWEEN;
+  int nstrleads = 0, nstrescps = 0;
+  char starter = c->string_starter;
+  for (; cur <= eolpos; cur++) {
+    if (proctok == TOK_COMMENT) {
+      break;
+    }
+    if ((proctok == TOK_STRING && nstrleads != 2) || proctok == TOK_TRISTR) {
+      const char *stop = cur;
+      while (stop < eolpos && *stop != '\'' && *stop != '"' && *stop != '\\') {
+        stop++;
+      }
+      if (stop > cur) {
+        cur = stop;
+        nstrleads = 0;
+        nstrescps = 0;
+      }
+    }
+    char nxt = *cur == '\t' ? ' ' : *cur;
+    if (proctok == TOK_STRING) {
+      int ffin = 0;
+      if (nxt == starter) {
+        nstrleads++;
+      } else if (nstrleads == 2) {
+        ffin = 1;
+      } else {
+        nstrleads = 0;
+      }
+      if (nstrleads == 3) {
+        proctok = TOK_TRISTR;
+        nstrleads = 0;
+        nstrescps = 0;
+      } else if (!ffin && nstrleads == 2) {
+      } else if ((nxt != starter || nstrescps % 2 == 1) && !ffin) {
+        nstrescps = nxt == '\\' ? nstrescps + 1 : 0;
+      } else {
+        proctok = TOK_INBETWEEN;
+        if (ffin) {
+          cur--;
+        }
+      }
+      continue;
+    }
+    if (proctok == TOK_TRISTR) {
+      if (nxt == starter && nstrescps % 2 == 0) {
+        nstrleads++;
+      } else {
+        nstrleads = 0;
+      }
+      if (nxt != starter || nstrescps % 2 == 1) {
+        nstrescps = nxt == '\\' ? nstrescps + 1 : 0;
+      }
+      if (nstrleads == 3) {
+        proctok = TOK_INBETWEEN;
+      }
+      continue;
+    }
+    /* between or within tokens other than strings and comments, every
+     * byte not of the OTHER class belongs to some token, which ends any
+     * backslash continuation */
+    int seen = 0;
+    while (cur < eolpos && !(lex_flags[(unsigned char)*cur] & LEXF_CARRY)) {
+      seen |= lex_flags[(unsigned char)*cur];
+      cur++;
+    }
+    if (seen & LEXF_PLAIN) {
+      c->lcont = 0;
+    }
+    nxt = *cur;
+    switch (lex_class[(unsigned char)nxt]) {
+    case LEXC_OTHER:
+      break;
+    case LEXC_QUOTE:
+      proctok = TOK_STRING;
+      starter = nxt;
+      nstrleads = 1;
+      nstrescps = 0;
+      c->lcont = 0;
+      break;
+    case LEXC_HASH:
+      proctok = TOK_COMMENT;
+      c->lcont = 0;
+      break;
+    case LEXC_OPEN:
+      c->nestings++;
+      c->lcont = 0;
+      break;
+    case LEXC_CLOSE:
+      c->nestings--;
+      c->lcont = 0;
+      break;
+    case LEXC_BACKSLASH:
+      c->lcont = 1;
+      break;
+    }
+  }
+  c->string_starter = starter;
+  if (proctok == TOK_TRISTR) {
+    c->line_state = LINE_IS_TRISTR;
+  } else if (c->lcont || c->nestings > 0) {
+    c->line_state = LINE_IS_CONTINUATION;
+  } else {
+    c->line_state = LINE_IS_NORMAL;
+  }
+}
+
+struct carry carry_start(void) {
+  struct carry c = {LINE_IS_NORMAL, '\0', 0, 0};
+  return c;
+}
+
+int carry_clean(const struct carry *c) {
+  /* carry_line starts both the same way */
+  return c->line_state == LINE_IS_NORMAL || c->line_state == LINE_IS_BLANK;
+}
+
+/* At a line start after state `c`, where [line, eolpos] is the next line */
+static int can_cut(const struct carry *c, const char *line,
+                   const char *eolpos) {
+  /* a blank line after a blank line would be dropped, not printed */
+  return c->line_state == LINE_IS_NORMAL ||
+         (c->line_state == LINE_IS_BLANK && scan_blank(line, eolpos) < eolpos);
+}
+
+const char *scan_cuts(struct carry *c, const char *from, const char *to) {
+  pthread_once(&scan_once, scan_init);
+  const char *cut = NULL;
+  for (const char *line = from; line < to;) {
+    const char *eolpos = (const char *)memchr(line, '\n', to - line);
+    if (!cut && line > from && can_cut(c, line, eolpos)) {
+      cut = line;
+    }
+    carry_line(c, line, eolpos);
+    line = eolpos + 1;
+  }
+  return cut;
+}
+
+/* Find [*from, *to), the logical lines of [data, end) which overlap lines
+ * first..last, counting from 1. Both are line starts at which pyformat
+ * holds no state, so formatting just that part gives what formatting the
+ * whole would. Reading stops soon after `last`. */
+static void find_lines(const char *data, const char *end, int first,
+                       int last, const char **from, const char **to) {
+  struct carry c = carry_start();
+  int lineno = 1;
+  *from = data;
+  *to = end;
+  const char *line = data;
+  while (line < end) {
+    const char *eolpos = (const char *)memchr(line, '\n', end - line);
+    if (can_cut(&c, line, eolpos)) {
+      if (lineno <= first) {
+        *from = line;
+      } else if (lineno > last) {
+        *to = line;
+        return;
+      }
+    }
+    carry_line(&c, line, eolpos);
+    line = eolpos + 1;
+    lineno++;
+  }
+  if (lineno <= first) {
+    /* the range lies past the end */
+    *from = end;
+  }
+}
+
+/* Returns the next line of a stream, ending in '\n', and its length in
+ * `*llen`; or NULL at the end. Lines are handed out in place from `buf`,
+ * which holds only what follows `src->keep`, so it grows to no more than
+ * the longest logical line plus a block. What is read is also appended
+ * to `origfile`, if given. */
+static const char *read_line(struct source *src, struct vlbuf *buf,
+                             struct vlbuf *origfile, int *llen) {
+  while (1) {
+    char *nl = (char *)memchr(&buf->d.ch[src->rscan], '\n',
+                              src->rfill - src->rscan);
+    if (nl) {
+      const char *line = &buf->d.ch[src->rpos];
+      *llen = nl + 1 - line;
+      src->rpos += *llen;
+      src->rscan = src->rpos;
+      return line;
+    }
+    src->rscan = src->rfill;
+    if (src->at_eof) {
+      if (src->rpos == src->rfill) {
+        return NULL;
+      }
+      /* the text ends without a newline; preserve line invariants by
+       * adding one */
+      buf->d.ch[src->rfill++] = '\n';
+      continue;
+    }
+    /* keep the partial line, and make room for a whole block after it */
+    if (src->keep > 0) {
+      memmove(buf->d.ch, &buf->d.ch[src->keep], src->rfill - src->keep);
+      src->rfill -= src->keep;
+      src->rscan -= src->keep;
+      src->rpos -= src->keep;
+      src->keep = 0;
+    }
+    if (buf->len < src->rfill + READ_BLOCK + 1) {
+      vlbuf_expand(buf, src->rfill + READ_BLOCK + 1);
+    }
+    ssize_t r = read(src->fd, &buf->d.ch[src->rfill], READ_BLOCK);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      src->at_eof = 1;
+      src->failed = r < 0;
+      continue;
+    }
+    src->nread += r;
+    if (origfile) {
+      vlbuf_append(origfile, &buf->d.ch[src->rfill], r, src->origlen);
+      src->origlen += r;
+    }
+    src->rfill += r;
+  }
+}
+
+/* The per-line scratch buffers share one block. A buffer that outgrows
+ * its share during a call moves to the heap; the next call gathers them
+ * all into a block that is large enough again, so that a context in
+ * steady use stops allocating. The text is `size` bytes long, which
+ * bounds its longest line. Returns 1 if a new block was made. */
+static size_t arena_share(const struct vlbuf *b, size_t len) {
+  return (len * b->esize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static int arena_fit(struct pfa_context *ctx, size_t size) {
+  enum { NSCRATCH = 11, NTOKEN = 3, NWRAP = 3 };
+  struct vlbuf *bufs[NSCRATCH] = {
+      &ctx->linebuf,     &ctx->tokbuf,         &ctx->toks,
+      &ctx->toktypes,    &ctx->laccum,         &ctx->splitpoints,
+      &ctx->split_ratings, &ctx->split_nestings, &ctx->wrap_score,
+      &ctx->wrap_from,   &ctx->wrap_queue,
+  };
+  size_t line = size < LINE_RESERVE ? size : LINE_RESERVE;
+  size_t want[NSCRATCH];
+  size_t total = 0;
+  int refit = ctx->arena == NULL;
+  for (int i = 0; i < NSCRATCH; i++) {
+    struct vlbuf *b = bufs[i];
+    /* pyformat keeps room for twice a line in each, or a line's worth of
+     * tokens; linebuf only holds what is read from streams, so it keeps
+     * whatever size it reached */
+    want[i] = i == 0 ? 16 : i <= NTOKEN ? line + 2 : 2 * line + 1;
+    /* the last few are only used by WRAP_OPTIMAL */
+    if (i >= NSCRATCH - NWRAP && ctx->wrap != WRAP_OPTIMAL) {
+      want[i] = 1;
+    }
+    if (want[i] < b->len) {
+      want[i] = b->len;
+    }
+    refit |= !b->fixed || want[i] > b->len;
+    total += arena_share(b, want[i]);
+  }
+  if (!refit) {
+    return 0;
+  }
+  char *block = (char *)malloc(total);
+  char *p = block;
+  for (int i = 0; i < NSCRATCH; i++) {
+    struct vlbuf *b = bufs[i];
+    vlbuf_free(b);
+    b->d.vd = p;
+    b->len = want[i];
+    b->fixed = 1;
+    p += arena_share(b, want[i]);
+  }
+  free(ctx->arena);
+  ctx->arena = block;
+  return 1;
+}
+
+/* How much a stream holds, if that is known in advance */
+static size_t stream_size(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    off_t left = st.st_size - lseek(fd, 0, SEEK_CUR);
+    return left > 0 ? left : 0;
+  }
+  return 0;
+}
+
+/* Add to token `t` the `n` bytes read at `at` in the logical line at
+ * `base`, which are read as the bytes at `bytes`. While these are found
+ * unchanged and just after the token, it is only lengthened; otherwise
+ * it moves to `buf`, filled up to `*fill`. */
+static inline void tok_add(struct token *t, const char *base, const char *at,
+                           const char *bytes, size_t n, char *buf,
+                           size_t *fill) {
+  if (!(t->off & TOKEN_COPIED)) {
+    if (t->len == 0) {
+      t->off = at - base;
+    }
+    if (bytes == at && at == base + t->off + t->len) {
+      t->len += n;
+      return;
+    }
+    memcpy(&buf[*fill], base + t->off, t->len);
+    t->off = *fill | TOKEN_COPIED;
+    *fill += t->len;
+  }
+  memcpy(&buf[*fill], bytes, n);
+  *fill += n;
+  t->len += n;
+}
+
+static inline const char *tok_text(const struct token *t, const char *base,
+                                   const char *buf) {
+  return t->off & TOKEN_COPIED ? &buf[t->off & ~TOKEN_COPIED]
+                               : &base[t->off];
+}
+
+/* For WRAP_OPTIMAL: choose where to break a logical line of `n` split
+ * segments, the k-th of them being [ends[k - 1], ends[k]) of `text`,
+ * where ends[-1] is 0 and ends[n - 1] is taken to be `eoff`. The first
+ * line fits in `width` + 4, and the others in `width` after the space
+ * they start with is dropped, unless made of a single segment; breaks
+ * after comments are forced. Of all such choices, the one with the
+ * highest total score of its breaks is taken, scored as the greedy
+ * wrapping scores them plus SSCORE_LINE each. The breaks that may end a
+ * line starting at a segment are a range that only moves on, so the best
+ * start for each break is kept at the front of a queue, and the whole
+ * takes time linear in `n`. Sets brk[k] to whether segment k starts a
+ * line, with `brk` in place of the queue. */
+static void plan_breaks(const char *text, const int *ends, const int *ratings,
+                        const int *nestings, int n, int eoff, int width,
+                        long long *best, int *from, int *queue) {
+#define END(k) ((k) <= 0 ? 0 : (k) >= n ? eoff : ends[(k) - 1])
+  int head = 0, tail = 0;
+  /* lines may start at `lo` or later, or at 0 unless `floor` is set */
+  int lo = 1, floor = 0;
+  best[0] = 0;
+  for (int b = 1; b <= n; b++) {
+    if (b >= 2) {
+      int a = b - 1;
+      if (ratings[a - 1] == SSCORE_COMMENT) {
+        floor = a;
+      }
+      while (tail > head && best[queue[tail - 1]] <= best[a]) {
+        tail--;
+      }
+      queue[tail++] = a;
+    }
+    if (lo < floor) {
+      lo = floor;
+    }
+    while (lo < b - 1 && END(b) - END(lo) - (text[END(lo)] == ' ') >= width) {
+      lo++;
+    }
+    while (head < tail && queue[head] < lo) {
+      head++;
+    }
+    int a = -1;
+    if (head < tail) {
+      a = queue[head];
+    }
+    if (floor == 0 && (b == 1 || END(b) < width + 4) &&
+        (a < 0 || best[0] >= best[a])) {
+      a = 0;
+    }
+    from[b] = a;
+    best[b] = best[a];
+    if (b < n) {
+      int reduced_nestings = nestings[b - 1] > 0 ? nestings[b - 1] - 1 : 0;
+      best[b] += ratings[b - 1] + SSCORE_NESTING * reduced_nestings +
+                 SSCORE_LINE;
+    }
+  }
+#undef END
+  char *brk = (char *)queue;
+  memset(brk, 0, n);
+  for (int b = n; from[b] > 0; b = from[b]) {
+    brk[from[b]] = 1;
+  }
+}
+
+/* The body of pyformat and pyformat_stats. Each use of `st` is guarded,
+ * so that where it is a constant NULL the counting drops out entirely. */
+static inline __attribute__((always_inline)) void
+format_text(struct pfa_context *ctx, struct source *src,
+            struct vlbuf *origfile, struct sink *sink, struct pfa_stats *st) {
+  pthread_once(&scan_once, scan_init);
+  size_t size = src->fd >= 0 ? stream_size(src->fd) : src->end - src->data;
+  int refit = arena_fit(ctx, size);
+  uint64_t t = 0;
+  if (st) {
+    st->regrowths += refit;
+  }
+  /* scratch buffers are borrowed from the context, and returned with
+   * whatever size they grew to */
+  struct vlbuf linebuf = ctx->linebuf;
+  struct vlbuf tokbuf = ctx->tokbuf;
+  struct vlbuf toks = ctx->toks;
+  struct vlbuf toktypes = ctx->toktypes;
+  struct vlbuf laccum = ctx->laccum;
+  struct vlbuf splitpoints = ctx->splitpoints;
+  struct vlbuf split_ratings = ctx->split_ratings;
+  struct vlbuf split_nestings = ctx->split_nestings;
+  struct vlbuf wrap_score = ctx->wrap_score;
+  struct vlbuf wrap_from = ctx->wrap_from;
+  struct vlbuf wrap_queue = ctx->wrap_queue;
+
+  struct token *tk = toks.d.tk;
+  uint8_t *tt = toktypes.d.u8;
+  /* where the logical line starts, and how much of tokbuf is used */
+  const char *lbase = NULL;
+  size_t tokfill = 0;
+  int ntoks = 0;
+
+  char string_starter = '\0';
+  int line_state = LINE_IS_NORMAL;
+  int leading_spaces = 0;
+  int nestings = 0;
+  int netlen = 0;
+  int no_more_lines = 0;
+  /* buffers may be reused between files; never leave stale contents */
+  if (origfile)
+    origfile->d.ch[0] = '\0';
+  src->rpos = src->rfill = src->rscan = src->origlen = src->nread = 0;
+  src->keep = 0;
+  src->at_eof = src->failed = 0;
+  sink_open(ctx, sink, size);
+  /* with a line range, text outside [src->data, stop) is copied as is */
+  const char *stop = src->end;
+  const char *textend = src->end - src->added_newline;
+  if (src->first > 0 && src->fd < 0) {
+    const char *from;
+    find_lines(src->data, src->end, src->first, src->last, &from, &stop);
+    sink_write(sink, src->data, (from < src->end ? from : textend) - src->data);
+    src->data = from;
+  }
+  while (!sink->halted) {
+    const char *line;
+    int llen = 0;
+    if (st) {
+      t = stats_clock();
+    }
+    if (src->fd >= 0) {
+      size_t lb = linebuf.len, ob = origfile ? origfile->len : 0;
+      line = read_line(src, &linebuf, origfile, &llen);
+      if (st) {
+        st->regrowths += (linebuf.len != lb) + (origfile && origfile->len != ob);
+      }
+      if (!line) {
+        break;
+      }
+      /* the logical line so far may have moved */
+      lbase = &linebuf.d.ch[src->keep];
+      no_more_lines = src->at_eof && src->rpos == src->rfill;
+    } else {
+      if (src->data >= stop) {
+        break;
+      }
+      line = src->data;
+      const char *eol =
+          (const char *)memchr(line, '\n', src->end - line);
+      llen = eol + 1 - line;
+      src->data = eol + 1;
+      if (src->data >= src->end && src->added_newline) {
+        no_more_lines = 1;
+      }
+    }
+    if (st) {
+      uint64_t now = stats_clock();
+      st->ns_read += now - t;
+      t = now;
+      st->lines++;
+    }
+
+    if (line_state == LINE_IS_NORMAL || line_state == LINE_IS_BLANK) {
+      netlen = llen;
+      ntoks = 0;
+      tk[0] = (struct token){0, 0};
+      tt[0] = TOK_INBETWEEN;
+      tokfill = 0;
+      lbase = line;
+      if (src->fd >= 0) {
+        src->keep = line - linebuf.d.ch;
+      }
+      nestings = 0;
+    } else {
+      netlen += llen;
+    }
+    /* Ensure buffers can hold the worst case line: a token starts at
+     * each byte at most, and then the sentinel */
+    vlbuf_reserve(&tokbuf, netlen + 2, st);
+    vlbuf_reserve(&toks, netlen + 2, st);
+    vlbuf_reserve(&toktypes, netlen + 2, st);
+    tk = toks.d.tk;
+    tt = toktypes.d.u8;
+
+    /* Tokenizer state machine. The line is only read, never modified, so
+     * that it may point into a read-only mapping of the file. */
+    const char *cur = line;
+    const char *eolpos = &line[llen - 1];
+
+    /* the text after the indentation */
+    const char *text = scan_blank(line, eolpos);
+    int is_whitespace = text == eolpos;
+
+    int dumprest = 0;
+    if (line_state == LINE_IS_TRISTR) {
+      /* tristrings are unaffected by blank lines */
+    } else if (is_whitespace) {
+      if (line_state == LINE_IS_CONTINUATION) {
+        line_state = LINE_IS_BLANK;
+        dumprest = 1;
+      } else if (line_state == LINE_IS_BLANK) {
+        continue;
+      } else {
+        line_state = LINE_IS_BLANK;
+      }
+    } else if (line_state == LINE_IS_BLANK) {
+      line_state = LINE_IS_NORMAL;
+    }
+
+    if (line_state == LINE_IS_NORMAL) {
+      leading_spaces = text - line;
+      cur = text;
+    } else {
+    }
+
+    int proctok = TOK_INBETWEEN;
+    if (line_state == LINE_IS_TRISTR) {
+      proctok = TOK_TRISTR;
+      --ntoks;
+      if (st) {
+        /* the string will be counted again when it ends */
+        st->tokens[tt[ntoks]]--;
+      }
+    }
+
+    char lopchar = '\0';
+    int numlen = 0;
+    int nstrescps = 0;
+    int nstrleads = 0;
+    /* once in a comment, the terminating newline reads as a space */
+    int eol_is_space = 0;
+    for (; cur <= eolpos; cur++) {
+      /* Runs of plain text in strings and comments are copied whole;
+       * a plain byte leaves a string with no pending quotes or escapes */
+      if (proctok == TOK_COMMENT ||
+          (proctok == TOK_STRING && nstrleads != 2) ||
+          proctok == TOK_TRISTR) {
+        const char *stop = proctok == TOK_COMMENT ? scan_comment(cur, eolpos)
+                                                  : scan_string(cur, eolpos);
+        if (stop > cur) {
+          tok_add(&tk[ntoks], lbase, cur, cur, stop - cur, tokbuf.d.ch,
+                  &tokfill);
+          cur = stop;
+          if (proctok != TOK_COMMENT) {
+            nstrleads = 0;
+            nstrescps = 0;
+          }
+        }
+      }
+      /* main tokenizing loop; tabs read as spaces */
+      char nxt = (cur[0] == '\t' || (cur == eolpos && eol_is_space))
+                     ? ' '
+                     : cur[0];
+      int inside_string = proctok == TOK_STRING || proctok == TOK_TRISTR;
+      if (!inside_string && nxt == ' ' && cur < eolpos &&
+          (cur[1] == ' ' || (cur + 1 == eolpos && eol_is_space))) {
+        continue;
+      }
+      /* single space is a token boundary ... */
+      int ignore = 0;
+      int tokfin = 0;
+      int otok = proctok;
+      struct lex_step step = lex_trans[proctok][lex_class[(unsigned char)nxt]];
+#ifdef PFA_LEXREF
+      step.act = LEXA_CODE;
+#endif
+      if (!(step.act & LEXA_CODE)) {
+        proctok = step.next;
+        ignore = !(step.act & LEXA_STORE);
+        tokfin = (step.act & LEXA_FIN) != 0;
+        if (step.act & LEXA_BACK) {
+          cur--;
+        }
+        if (step.act & LEXA_QUOTE) {
+          string_starter = nxt;
+          nstrleads = 1;
+        }
+        if (step.act & LEXA_NOESC) {
+          nstrescps = 0;
+        }
+        if (step.act & LEXA_EOLSPACE) {
+          /* nix the terminating newline */
+          eol_is_space = 1;
+        }
+        if (step.act & LEXA_OPINIT) {
+          lopchar = '\0';
+        }
+        if (step.act & LEXA_NUMINIT) {
+          numlen = 0;
+        }
+      } else {
+        switch (proctok) {
+        case TOK_DOT:
+        case TOK_NUMBER: {
+          /* We don't care about the number itself, just that things stay
+           * numberish */
+          int isdot = (numlen == 1) && cur[-1] == '.' && !isnumeric_lead(nxt);
+          if (!isdot && isnumeric_lead(nxt)) {
+          } else if (cur[-1] == 'e' && (nxt == '-' || nxt == '+')) {
+          } else if (!isdot && (nxt == 'e' || nxt == 'x')) {
+          } else {
+            if (cur[-1] == '.' && numlen == 1)
+              otok = TOK_DOT;
+
+            tokfin = 1;
+            proctok = TOK_INBETWEEN;
+            ignore = 1;
+            cur--;
+          }
+          numlen++;
+        } break;
+        case TOK_STRING: {
+          /* The fun one */
+          int ffin = 0;
+          if (nxt == string_starter) {
+            nstrleads++;
+          } else {
+            if (nstrleads == 2) {
+              /* implicitly to the end */
+              ffin = 1;
+              cur--;
+              ignore = 1;
+            } else {
+              nstrleads = 0;
+            }
+          }
+          if (nstrleads == 3) {
+            proctok = TOK_TRISTR;
+            nstrleads = 0;
+            nstrescps = 0;
+          } else if (!ffin && nstrleads == 2) {
+            /* doubled */
+          } else if ((nxt != string_starter ||
+                      (nstrescps % 2 == 1 && nxt == string_starter)) &&
+                     !ffin) {
+            if (nxt == '\\') {
+              nstrescps++;
+            } else {
+              nstrescps = 0;
+            }
+          } else {
+            tokfin = 1;
+            proctok = TOK_INBETWEEN;
+          }
+        } break;
+        case TOK_TRISTR: {
+          /* Only entry this once we've been in TOK_STRING */
+          if (nxt == string_starter && nstrescps % 2 == 0) {
+            nstrleads++;
+          } else {
+            nstrleads = 0;
+          }
+          if ((nxt != string_starter ||
+               (nstrescps % 2 == 1 && nxt == string_starter))) {
+            if (nxt == '\\') {
+              nstrescps++;
+            } else {
+              nstrescps = 0;
+            }
+          }
+          if (nstrleads == 3) {
+            tokfin = 1;
+            proctok = TOK_INBETWEEN;
+          }
+        } break;
+        case TOK_EQUAL:
+        case TOK_EXP:
+        case TOK_UNARYOP:
+        case TOK_OPERATOR: {
+          /* Operator handles subtypes */
+          if (lopchar == '\0' && isoptype(nxt)) {
+          } else if (lopchar == '*' && nxt == '*') {
+            proctok = TOK_EXP;
+          } else if (lopchar == '/' && nxt == '/') {
+          } else if (lopchar == '>' && nxt == '>') {
+          } else if (lopchar == '<' && nxt == '<') {
+          } else if (nxt == '=') {
+            if (proctok == TOK_EXP) {
+              proctok = TOK_OPERATOR;
+            }
+          } else {
+            if (proctok != TOK_EXP) {
+              if (lopchar == '-' || lopchar == '+' || lopchar == '*') {
+                otok = TOK_UNARYOP;
+              }
+              if (lopchar == '=' && (cur - 2 < line || !isoptype(cur[-2]))) {
+                otok = TOK_EQUAL;
+              }
+            }
+            tokfin = 1;
+            proctok = TOK_INBETWEEN;
+            ignore = 1;
+            cur--;
+          }
+          lopchar = nxt;
+        } break;
+#ifdef PFA_LEXREF
+        case TOK_SPECIAL:
+        case TOK_LABEL: {
+          if (isalpha_lead(nxt) || ('0' <= nxt && nxt <= '9')) {
+          } else if (nxt == '\'' || nxt == '\"') {
+            /* String with prefix */
+            proctok = TOK_STRING;
+            nstrleads = 1;
+            string_starter = nxt;
+          } else {
+            tokfin = 1;
+            proctok = TOK_INBETWEEN;
+            ignore = 1;
+            cur--;
+          }
+        } break;
+        case TOK_OBRACE:
+        case TOK_CBRACE:
+        case TOK_COMMA:
+        case TOK_COLON:
+        case TOK_LCONT: {
+          /* Single character */
+          tokfin = 1;
+          proctok = TOK_INBETWEEN;
+        } break;
+        case TOK_COMMENT: {
+          /* do nothing because comment goes to EOL */
+        } break;
+        case TOK_INBETWEEN: {
+          ignore = 1;
+          if (nxt == '#') {
+            proctok = TOK_COMMENT;
+            /* nix the terminating newline */
+            eol_is_space = 1;
+          } else if (nxt == '"' || nxt == '\'') {
+            string_starter = nxt;
+            proctok = TOK_STRING;
+            ignore = 0;
+            nstrescps = 0;
+            nstrleads = 1;
+          } else if (isoptype(nxt)) {
+            lopchar = '\0';
+            proctok = TOK_OPERATOR;
+            cur--;
+          } else if (nxt == ',') {
+            proctok = TOK_COMMA;
+            cur--;
+          } else if (nxt == ':') {
+            proctok = TOK_COLON;
+            cur--;
+          } else if (nxt == '(' || nxt == '[' || nxt == '{') {
+            proctok = TOK_OBRACE;
+            cur--;
+          } else if (nxt == ')' || nxt == ']' || nxt == '}') {
+            proctok = TOK_CBRACE;
+            cur--;
+          } else if (nxt == '\\') {
+            proctok = TOK_LCONT;
+            cur--;
+          } else if (isalpha_lead(nxt)) {
+            proctok = TOK_LABEL;
+            cur--;
+          } else if (isnumeric_lead(nxt)) {
+            numlen = 0;
+            proctok = TOK_NUMBER;
+            cur--;
+          }
+        } break;
+#endif
+        }
+      }
+
+      if (!ignore) {
+        tok_add(&tk[ntoks], lbase, cur, nxt == cur[0] ? cur : &nxt, 1,
+                tokbuf.d.ch, &tokfill);
+      }
+
+      if (cur == eolpos && otok != TOK_INBETWEEN) {
+        tokfin = 1;
+      }
+
+      if (tokfin) {
+        struct token *t = &tk[ntoks];
+        /* convert label to special if it's a word in a list we have */
+        if (otok == TOK_LABEL &&
+            is_special_name(tok_text(t, lbase, tokbuf.d.ch), t->len)) {
+          otok = TOK_SPECIAL;
+        }
+        if (otok == TOK_OBRACE) {
+          nestings++;
+        } else if (otok == TOK_CBRACE) {
+          nestings--;
+        }
+        tt[ntoks] = otok;
+        if (st) {
+          st->tokens[otok]++;
+        }
+#ifdef PFA_LEXTRACE
+        lex_trace(otok, tok_text(t, lbase, tokbuf.d.ch), t->len);
+#endif
+        ntoks++;
+        tk[ntoks] = (struct token){0, 0};
+        tt[ntoks] = TOK_INBETWEEN;
+      }
+    }
+    if (st) {
+      uint64_t now = stats_clock();
+      st->ns_tokenize += now - t;
+      t = now;
+    }
+
+    /* determine if the next line shall continue this one */
+    if (line_state == LINE_IS_BLANK) {
+      line_state = LINE_IS_BLANK;
+    } else if (proctok == TOK_TRISTR) {
+      line_state = LINE_IS_TRISTR;
+    } else if ((ntoks > 0 && tt[ntoks - 1] == TOK_LCONT) ||
+               nestings > 0) {
+      line_state = LINE_IS_CONTINUATION;
+    } else {
+      line_state = LINE_IS_NORMAL;
+    }
+
+    if (line_state == LINE_IS_BLANK && !dumprest) {
+      sink_write(sink, "\n", 1);
+      if (st) {
+        st->logical_lines++;
+      }
+    } else if (line_state == LINE_IS_NORMAL || no_more_lines || dumprest) {
+      if (st) {
+        st->logical_lines++;
+      }
+      /* Introduce spaces to list */
+
+      /* split ratings 0 is regular; -1 is force/cmt; 1 is weak */
+      vlbuf_reserve(&laccum, 2 * netlen, st);
+      vlbuf_reserve(&splitpoints, 2 * netlen, st);
+      vlbuf_reserve(&split_ratings, 2 * netlen, st);
+      vlbuf_reserve(&split_nestings, 2 * netlen, st);
+
+      int nsplits = 0;
+      char *buildpt = laccum.d.ch;
+
+      /* Line wrapping & printing, oh joy. The open token after the last
+       * is never a backslash, so ends the skipping of those. */
+      int nests = 0;
+      int pptok = TOK_INBETWEEN;
+      int pretok = TOK_INBETWEEN;
+      int postok = tt[0];
+      for (int i = 0; i < ntoks; i++) {
+        const struct token *t = &tk[i];
+        const char *tokpos = tok_text(t, lbase, tokbuf.d.ch);
+        while (tt[i + 1] == TOK_LCONT && i < ntoks) {
+          i++;
+        }
+
+        pptok = pretok;
+        pretok = postok;
+        postok = tt[i + 1];
+
+        if (pretok == TOK_OBRACE) {
+          nests++;
+        }
+
+        if (pretok == TOK_COMMENT) {
+          const char *sos = tokpos;
+          const char *eos = tokpos + t->len;
+          while (sos < eos && *sos == ' ') {
+            sos++;
+          }
+          while (eos > sos && eos[-1] == ' ') {
+            eos--;
+          }
+          if (sos == eos || sos[0] == '!') {
+            *buildpt++ = '#';
+          } else {
+            *buildpt++ = '#';
+            *buildpt++ = ' ';
+          }
+          memcpy(buildpt, sos, eos - sos);
+          buildpt += eos - sos;
+          split_ratings.d.in[nsplits] = SSCORE_COMMENT;
+        } else {
+          memcpy(buildpt, tokpos, t->len);
+          buildpt += t->len;
+          if (pretok == TOK_COMMA && postok != TOK_CBRACE && nests > 0) {
+            split_ratings.d.in[nsplits] = 1;
+          } else if (pretok == TOK_COLON && postok != TOK_CBRACE) {
+            split_ratings.d.in[nsplits] = 1;
+          } else if (pretok == TOK_LABEL && postok == TOK_OBRACE) {
+            split_ratings.d.in[nsplits] = SSCORE_NESTING;
+          } else if (pretok == TOK_DOT || postok == TOK_DOT) {
+            split_ratings.d.in[nsplits] = -2;
+          } else {
+            split_ratings.d.in[nsplits] = 0;
+          }
+        }
+        splitpoints.d.in[nsplits] = buildpt - laccum.d.ch;
+        split_nestings.d.in[nsplits] = nests;
+        nsplits++;
+
+        int space;
+        if (pretok == TOK_COMMENT) {
+          space = 0;
+        } else if (pptok == TOK_INBETWEEN && pretok == TOK_OPERATOR &&
+                   postok == TOK_LABEL) {
+          /* annotation */
+          space = 0;
+        } else if (pretok == TOK_EQUAL || postok == TOK_EQUAL) {
+          space = (nests == 0);
+        } else if (pretok == TOK_SPECIAL) {
+          if (postok == TOK_COLON) {
+            space = 0;
+          } else {
+            space = 1;
+          }
+        } else if (postok == TOK_SPECIAL) {
+          space = 1;
+        } else if (pretok == TOK_TRISTR && postok == TOK_TRISTR) {
+          space = 0;
+        } else if (pretok == TOK_EXP || postok == TOK_EXP) {
+          space = 0;
+        } else if (pretok == TOK_DOT || postok == TOK_DOT) {
+          space = 0;
+        } else if (pretok == TOK_OPERATOR && postok == TOK_UNARYOP) {
+          space = 1;
+        } else if (pretok == TOK_LABEL && postok == TOK_UNARYOP) {
+          space = 1;
+        } else if (pretok == TOK_CBRACE && postok == TOK_UNARYOP) {
+          space = 1;
+        } else if (pretok == TOK_OBRACE && postok == TOK_UNARYOP) {
+          space = 0;
+        } else if (pretok == TOK_UNARYOP) {
+          if (pptok == TOK_OPERATOR || pptok == TOK_EXP || pptok == TOK_COMMA ||
+              pptok == TOK_OBRACE || pptok == TOK_EQUAL || pptok == TOK_COLON) {
+            space = 0;
+          } else {
+            space = 1;
+          }
+        } else if (postok == TOK_COMMA || postok == TOK_COLON) {
+          space = 0;
+        } else if (pretok == TOK_COMMA) {
+          if (postok == TOK_CBRACE) {
+            space = 0;
+          } else {
+            space = 1;
+          }
+        } else if (pretok == TOK_COLON) {
+          if (pptok == TOK_LABEL || pptok == TOK_SPECIAL) {
+            space = 1;
+          } else {
+            space = 0;
+          }
+        } else if (pretok == TOK_CBRACE && postok == TOK_LABEL) {
+          space = 1;
+        } else if (pretok == TOK_OPERATOR || postok == TOK_OPERATOR) {
+          space = 1;
+        } else if (pretok == TOK_OBRACE || postok == TOK_CBRACE ||
+                   pretok == TOK_CBRACE || postok == TOK_OBRACE) {
+          space = 0;
+        } else {
+          space = 1;
+        }
+        if (space && i < ntoks - 1) {
+          *buildpt++ = ' ';
+        }
+
+        if (postok == TOK_CBRACE) {
+          nests--;
+        }
+      }
+      int eoff = buildpt - laccum.d.ch;
+      /* lines with no tokens (e.g. a lone form feed) must print nothing */
+      *buildpt = '\0';
+      uint64_t written = 0;
+      if (st) {
+        uint64_t now = stats_clock();
+        st->ns_spacing += now - t;
+        t = now;
+        st->splits += nsplits;
+        written = st->ns_write;
+      }
+
+      /* the art of line breaking */
+      int length_left = 80 - leading_spaces;
+      int optimal = ctx->wrap == WRAP_OPTIMAL && nsplits > 1;
+      const char *brk = NULL;
+      if (optimal) {
+        vlbuf_reserve(&wrap_score, nsplits + 1, st);
+        vlbuf_reserve(&wrap_from, nsplits + 1, st);
+        vlbuf_reserve(&wrap_queue, nsplits + 1, st);
+        plan_breaks(laccum.d.ch, splitpoints.d.in, split_ratings.d.in,
+                    split_nestings.d.in, nsplits, eoff, length_left - 4,
+                    wrap_score.d.ll, wrap_from.d.in, wrap_queue.d.in);
+        brk = wrap_queue.d.ch;
+      }
+
+      /* write leading space buffer */
+      sink_spaces(sink, leading_spaces);
+
+      if (nsplits > 0) {
+        for (int i = 0; i < nsplits; i++) {
+          int fr = i > 0 ? splitpoints.d.in[i - 1] : 0;
+          int to = i >= nsplits - 1 ? eoff : splitpoints.d.in[i];
+          const char *seg = &laccum.d.ch[fr];
+          int nlen = to - fr;
+          int comment_split =
+              i > 0 ? split_ratings.d.in[i - 1] == SSCORE_COMMENT : 0;
+
+          int continuing = 1;
+          if (i == 0) {
+            continuing = 1;
+          } else if (optimal) {
+            continuing = !brk[i];
+          } else {
+            /* The previous location provides the break-off score */
+            int best_score = -1000000, bk = -1;
+            for (int rleft = length_left, k = i; k < nsplits && rleft >= 0;
+                 k++) {
+              /* Estimate segment length, walk further */
+              int fr = k > 0 ? splitpoints.d.in[k - 1] : 0;
+              int to = k >= nsplits - 1 ? eoff : splitpoints.d.in[k];
+              int seglen = to - fr;
+              rleft -= seglen;
+
+              /* We split at the zone with the highest score */
+              int reduced_nestings = k > 0 ? split_nestings.d.in[k - 1] : 0;
+              if (reduced_nestings > 0)
+                reduced_nestings--;
+              int split_score = k > 0 ? (split_ratings.d.in[k - 1] +
+                                         SSCORE_NESTING * reduced_nestings)
+                                      : 0;
+              if (split_score >= best_score) {
+                best_score = split_score;
+                bk = k;
+              }
+
+              /* Never hold up a terminator */
+              if (rleft >= 0 && k == nsplits - 1) {
+                bk = -1;
+              }
+            }
+            int want_split = (bk == i);
+            int length_split = (nlen >= length_left);
+            continuing = !(comment_split || length_split || want_split);
+          }
+
+          if (continuing) {
+            length_left -= nlen;
+            sink_write(sink, seg, nlen);
+          } else {
+            if (st) {
+              st->breaks++;
+            }
+            if (nlen > 0 && seg[0] == ' ') {
+              seg++;
+              nlen -= 1;
+            }
+            if (comment_split || split_nestings.d.in[i - 1] > 0) {
+              sink_write(sink, "\n", 1);
+            } else {
+              sink_write(sink, " \\\n", 3);
+            }
+            length_left = 80 - leading_spaces - 4 - nlen;
+            sink_spaces(sink, leading_spaces + 4);
+            sink_write(sink, seg, nlen);
+          }
+        }
+        sink_write(sink, "\n", 1);
+      } else {
+        sink_write(sink, laccum.d.ch, eoff);
+        sink_write(sink, "\n", 1);
+      }
+      if (st) {
+        /* time spent passing on output is counted as writing */
+        st->ns_wrap += stats_clock() - t - (st->ns_write - written);
+      }
+      if (line_state == LINE_IS_BLANK) {
+        sink_write(sink, "\n", 1);
+      } else {
+        line_state = LINE_IS_NORMAL;
+      }
+    }
+  }
+
+  ctx->linebuf = linebuf;
+  ctx->tokbuf = tokbuf;
+  ctx->toks = toks;
+  ctx->toktypes = toktypes;
+  ctx->laccum = laccum;
+  ctx->splitpoints = splitpoints;
+  ctx->split_ratings = split_ratings;
+  ctx->split_nestings = split_nestings;
+  ctx->wrap_score = wrap_score;
+  ctx->wrap_from = wrap_from;
+  ctx->wrap_queue = wrap_queue;
+  if (stop < textend && !sink->halted) {
+    sink_write(sink, stop, textend - stop);
+  }
+  sink_close(ctx, sink);
+  if (sink->expect && sink->len != sink->expectlen) {
+    sink->differs = 1;
+  }
+  if (st) {
+    st->bytes_in += src->fd >= 0 ? src->nread : size - src->added_newline;
+    st->bytes_out += sink->len;
+    const struct vlbuf *bufs[] = {&linebuf,     &tokbuf,        &toks,
+                                  &toktypes,    &laccum,        &splitpoints,
+                                  &split_ratings, &split_nestings, &wrap_score,
+                                  &wrap_from,   &wrap_queue};
+    uint64_t scratch = 0;
+    for (size_t i = 0; i < sizeof(bufs) / sizeof(bufs[0]); i++) {
+      scratch += bufs[i]->len * bufs[i]->esize;
+    }
+    if (scratch > st->peak_scratch) {
+      st->peak_scratch = scratch;
+    }
+    if (sink->kind == SINK_BUF && sink->buf->len > st->peak_output) {
+      st->peak_output = sink->buf->len;
+    }
+  }
+}
+
+/* The formatted text goes to `sink`, whose `len` becomes its length.
+ * `origfile` only receives a copy of the input when reading from a
+ * stream. */
+void pyformat(struct pfa_context *ctx, struct source *src,
+              struct vlbuf *origfile, struct sink *sink) {
+  format_text(ctx, src, origfile, sink, NULL);
+}
+
+void pyformat_stats(struct pfa_context *ctx, struct source *src,
+                    struct vlbuf *origfile, struct sink *sink,
+                    struct pfa_stats *stats) {
+  sink->stats = stats;
+  format_text(ctx, src, origfile, sink, stats);
+  sink->stats = NULL;
+}
+
+/* Scratch space is left empty until pyformat knows the size of its text */
+static struct vlbuf scratch_make(size_t es) {
+  struct vlbuf ib;
+  ib.d.vd = NULL;
+  ib.len = 0;
+  ib.esize = es;
+  ib.fixed = 1;
+  return ib;
+}
+
+void pfa_context_init(struct pfa_context *ctx) {
+  ctx->linebuf = scratch_make(sizeof(char));
+  ctx->tokbuf = scratch_make(sizeof(char));
+  ctx->toks = scratch_make(sizeof(struct token));
+  ctx->toktypes = scratch_make(sizeof(uint8_t));
+  ctx->laccum = scratch_make(sizeof(char));
+  ctx->splitpoints = scratch_make(sizeof(int));
+  ctx->split_ratings = scratch_make(sizeof(int));
+  ctx->split_nestings = scratch_make(sizeof(int));
+  ctx->wrap_score = scratch_make(sizeof(long long));
+  ctx->wrap_from = scratch_make(sizeof(int));
+  ctx->wrap_queue = scratch_make(sizeof(int));
+  ctx->wrap = WRAP_GREEDY;
+  ctx->arena = NULL;
+  ctx->outblock = NULL;
+  ctx->input = vlbuf_make(sizeof(char));
+  ctx->output = vlbuf_make(sizeof(char));
+}
+
+void pfa_context_clear(struct pfa_context *ctx) {
+  vlbuf_free(&ctx->linebuf);
+  vlbuf_free(&ctx->tokbuf);
+  vlbuf_free(&ctx->toks);
+  vlbuf_free(&ctx->toktypes);
+  vlbuf_free(&ctx->laccum);
+  vlbuf_free(&ctx->splitpoints);
+  vlbuf_free(&ctx->split_ratings);
+  vlbuf_free(&ctx->split_nestings);
+  vlbuf_free(&ctx->wrap_score);
+  vlbuf_free(&ctx->wrap_from);
+  vlbuf_free(&ctx->wrap_queue);
+  free(ctx->arena);
+  if (ctx->outblock) {
+    munmap(ctx->outblock, SINK_BLOCK);
+  }
+  vlbuf_free(&ctx->input);
+  vlbuf_free(&ctx->output);
+}
+
+struct pfa_context *pfa_context_new(void) {
+  struct pfa_context *ctx =
+      (struct pfa_context *)malloc(sizeof(struct pfa_context));
+  pfa_context_init(ctx);
+  return ctx;
+}
+
+void pfa_context_free(struct pfa_context *ctx) {
+  if (ctx) {
+    pfa_context_clear(ctx);
+    free(ctx);
+  }
+}
+
+/* pyformat reads in place, and needs the text to end in a newline; add
+ * one to a copy if it is missing */
+static void make_source(struct pfa_context *ctx, const char *text, size_t len,
+                        struct source *src) {
+  memset(src, 0, sizeof(*src));
+  src->fd = -1;
+  if (len > 0 && text[len - 1] != '\n') {
+    if (ctx->input.len <= len + 1) {
+      vlbuf_expand(&ctx->input, len + 1);
+    }
+    memcpy(ctx->input.d.ch, text, len);
+    ctx->input.d.ch[len] = '\n';
+    text = ctx->input.d.ch;
+    src->added_newline = 1;
+  }
+  src->data = text;
+  src->end = text + len + src->added_newline;
+}
+
+int pfa_format(struct pfa_context *ctx, const char *text, size_t len,
+               const char **out, size_t *outlen) {
+  struct source src;
+  make_source(ctx, text, len, &src);
+  struct sink sink;
+  memset(&sink, 0, sizeof(sink));
+  sink.buf = &ctx->output;
+  pyformat(ctx, &src, NULL, &sink);
+  *out = ctx->output.d.ch;
+  *outlen = sink.len;
+  return 0;
+}
+
+int pfa_format_lines(struct pfa_context *ctx, const char *text, size_t len,
+                     int first, int last, const char **out, size_t *outlen) {
+  if (first < 1 || last < first) {
+    return -1;
+  }
+  struct source src;
+  make_source(ctx, text, len, &src);
+  src.first = first;
+  src.last = last;
+  struct sink sink;
+  memset(&sink, 0, sizeof(sink));
+  sink.buf = &ctx->output;
+  pyformat(ctx, &src, NULL, &sink);
+  *out = ctx->output.d.ch;
+  *outlen = sink.len;
+  return 0;
+}
+
+int pfa_format_to(struct pfa_context *ctx, const char *text, size_t len,
+                  pfa_sink_fn fn, void *arg) {
+  struct source src;
+  make_source(ctx, text, len, &src);
+  struct sink sink;
+  memset(&sink, 0, sizeof(sink));
+  sink.kind = SINK_FN;
+  sink.fn = fn;
+  sink.arg = arg;
+  pyformat(ctx, &src, NULL, &sink);
+  return sink.halted ? -1 : 0;
+}
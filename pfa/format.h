@@ -0,0 +1,215 @@
+#ifndef PFA_FORMAT_H
+#define PFA_FORMAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "pfa.h"
+
+/* Internals of libpfa shared with the pfa program */
+
+struct vlbuf {
+  union {
+    void *vd;
+    char *ch;
+    int *in;
+    long long *ll;
+    struct token *tk;
+    uint8_t *u8;
+  } d;
+  size_t len;
+  size_t esize;
+  /* set if `d` lies in a context's arena, and so is never freed or
+   * reallocated; growing such a buffer copies it to the heap */
+  int fixed;
+};
+
+struct vlbuf vlbuf_make(size_t es);
+size_t vlbuf_expand(struct vlbuf *ib, size_t minsize);
+size_t vlbuf_append(struct vlbuf *ib, const char *str, size_t lstr,
+                    size_t countedlen);
+void vlbuf_free(struct vlbuf *ib);
+size_t strapp(char *target, const char *app);
+
+/* A token of a logical line: `len` bytes at `off` in the line itself, or,
+ * if TOKEN_COPIED is set in `off`, in the context's tokbuf. Its type is
+ * kept apart, in `toktypes`, so that each token takes 9 bytes. */
+struct token {
+  uint32_t off;
+  uint32_t len;
+};
+
+#define TOKEN_COPIED 0x80000000u
+
+/* Where pyformat's input lines come from: either read in large blocks
+ * from `fd`, if it is not negative, or taken in place from [data, end),
+ * which must end in '\n' */
+struct source {
+  int fd;
+  const char *data;
+  const char *end;
+  /* set if the final '\n' was not in the original file */
+  int added_newline;
+  /* if `first` is set, and reading in place, only the logical lines
+   * overlapping lines first..last are formatted; the rest is copied */
+  int first;
+  int last;
+  /* for reading from `fd`: the read and unread parts of the buffer, how
+   * far it has been searched for '\n', and how much was read in all */
+  size_t rpos, rfill, rscan, origlen;
+  /* the buffer is kept from here on, so that a logical line stays whole */
+  size_t keep;
+  /* everything read from `fd` */
+  size_t nread;
+  int at_eof;
+  /* set if reading failed, rather than reaching the end */
+  int failed;
+};
+
+/* What --stats reports, summed over files except for the peaks. Times
+ * are in nanoseconds. */
+enum { STATS_TOKENS = 32 };
+struct pfa_stats {
+  uint64_t files;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  /* lines as read, and as joined by brackets and continuations */
+  uint64_t lines;
+  uint64_t logical_lines;
+  /* indexed by TOK_* */
+  uint64_t tokens[STATS_TOKENS];
+  /* places where a long line may be broken, and where lines were */
+  uint64_t splits;
+  uint64_t breaks;
+  uint64_t regrowths;
+  uint64_t peak_scratch;
+  uint64_t peak_output;
+  uint64_t ns_read;
+  uint64_t ns_tokenize;
+  uint64_t ns_spacing;
+  uint64_t ns_wrap;
+  uint64_t ns_write;
+  uint64_t ns_commit;
+};
+
+static inline uint64_t stats_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Where pyformat's output goes */
+enum {
+  SINK_BUF,    /* into `buf`, which grows to hold it all */
+  SINK_FD,     /* written to `fd`; if `expect` is set, also compared
+                * against it, setting `differs` */
+  SINK_FN,     /* passed to `fn` */
+  SINK_EXPECT, /* nowhere: only compared against [expect, expect +
+                * expectlen), and formatting stops at the first difference */
+  SINK_REWRITE, /* compared as for SINK_EXPECT, but formatting goes on, and
+                 * from the first difference all of it is written to `fd`,
+                 * starting with the part of `expect` that matched */
+};
+
+/* Output is gathered in one contiguous stage, so that emitting a token is
+ * a bounds check and a copy; only when the stage fills does the kind of
+ * sink matter. For SINK_BUF the stage is `buf` itself. */
+struct sink {
+  int kind;
+  struct vlbuf *buf;
+  int fd;
+  pfa_sink_fn fn;
+  void *arg;
+  const char *expect;
+  size_t expectlen;
+  char *stage;
+  size_t fill;
+  size_t cap;
+  /* bytes passed on from the stage; once pyformat returns, all of them */
+  size_t len;
+  int differs;
+  /* set once `fn` asks to stop, or `fd` can take no more */
+  int halted;
+  /* `fd` is a pipe, so full stages are spliced into it */
+  int pipe;
+  /* set by pyformat_stats, to time output and count regrowth */
+  struct pfa_stats *stats;
+};
+
+/* How long lines are broken: by looking ahead from each place a break
+ * may go, for the best one in reach; or by choosing all breaks of a
+ * logical line together, for the best total score */
+enum { WRAP_GREEDY, WRAP_OPTIMAL };
+
+struct pfa_context {
+  /* WRAP_GREEDY unless set otherwise */
+  int wrap;
+  /* per-line scratch for pyformat, carved from `arena` */
+  struct vlbuf linebuf;
+  /* tokens that are not found unchanged in the line are copied here */
+  struct vlbuf tokbuf;
+  struct vlbuf toks;
+  struct vlbuf toktypes;
+  struct vlbuf laccum;
+  struct vlbuf splitpoints;
+  struct vlbuf split_ratings;
+  struct vlbuf split_nestings;
+  /* for WRAP_OPTIMAL: the best score of each break, the break before
+   * it, and the candidates still in reach */
+  struct vlbuf wrap_score;
+  struct vlbuf wrap_from;
+  struct vlbuf wrap_queue;
+  char *arena;
+  /* stage for sinks that do not build up their output */
+  char *outblock;
+  /* for the library calls: input copies and output */
+  struct vlbuf input;
+  struct vlbuf output;
+};
+
+/* For contexts embedded in other structures */
+void pfa_context_init(struct pfa_context *ctx);
+void pfa_context_clear(struct pfa_context *ctx);
+
+/* The formatted text goes to `sink`, whose `len` becomes its length.
+ * `origfile` only receives a copy of the input when reading from a
+ * stream. */
+void pyformat(struct pfa_context *ctx, struct source *src,
+              struct vlbuf *origfile, struct sink *sink);
+/* As pyformat, also adding to `stats`; pyformat itself counts nothing */
+void pyformat_stats(struct pfa_context *ctx, struct source *src,
+                    struct vlbuf *origfile, struct sink *sink,
+                    struct pfa_stats *stats);
+
+/* What pyformat carries from one line to the next, as far as it decides
+ * where formatting may start afresh; see carry_line */
+struct carry {
+  int line_state;
+  char string_starter;
+  int nestings;
+  /* the last token of the logical line so far is a backslash */
+  int lcont;
+};
+
+/* The state at the start of a text */
+struct carry carry_start(void);
+/* Whether lines that follow state `c` are read as at the start of a text */
+int carry_clean(const struct carry *c);
+/* For cutting a text into pieces: scan the lines [from, to), starting in
+ * state `*c`, leaving the state at `to` in `*c`. Returns the first line
+ * start in (from, to) at which formatting may start afresh and give what
+ * formatting the whole text would, or NULL if there is none. */
+const char *scan_cuts(struct carry *c, const char *from, const char *to);
+
+/* Names for debugging */
+const char *tok_to_string(int tok);
+const char *ls_to_string(int ls);
+
+#ifdef PFA_LEXTRACE
+/* Called with each finished token; defined by the program built with
+ * PFA_LEXTRACE, which must format on one thread */
+void lex_trace(int tok, const char *text, size_t len);
+#endif
+
+#endif
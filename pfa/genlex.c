@@ -0,0 +1,338 @@
+/* Build-time generator: reads the tokenizer spec lexer.def and writes the
+ * tables of lextab.h. Usage: genlex lexer.def lextab.h */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { MAXNAMES = 64, MAXKW = 256, MAXWORD = 64 };
+
+static const char *actnames[] = {"store",  "fin",    "back",
+                                 "quote",  "noesc",  "eolspace",
+                                 "opinit", "numinit", "code",
+                                 NULL};
+
+static char tokens[MAXNAMES][MAXWORD];
+static char abbrs[MAXNAMES][MAXWORD];
+static int ntokens = 0;
+/* class 0 is OTHER */
+static char classes[MAXNAMES][MAXWORD] = {"OTHER"};
+static int nclasses = 1;
+static char flags[8][MAXWORD];
+static int nflags = 0;
+static unsigned char flagmask[MAXNAMES];
+static int byteclass[256];
+/* -1 while unset */
+static int nextstate[MAXNAMES][MAXNAMES];
+static unsigned actions[MAXNAMES][MAXNAMES];
+/* states given by `*` are only filled in after the whole spec is read */
+static int defnext[MAXNAMES];
+static unsigned defact[MAXNAMES];
+static int hasdef[MAXNAMES];
+static char keywords[MAXKW][MAXWORD];
+static int nkeywords = 0;
+
+static const char *specname;
+static int lineno;
+
+static void fail(const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "%s:%d: ", specname, lineno);
+  vfprintf(stderr, fmt, ap);
+  fputc('\n', stderr);
+  va_end(ap);
+  exit(1);
+}
+
+static int lookup(char names[][MAXWORD], int n, const char *w) {
+  for (int i = 0; i < n; i++)
+    if (strcmp(names[i], w) == 0)
+      return i;
+  return -1;
+}
+
+/* One byte of a byte list: c, \s, \\, \#, \t, \n or \xHH */
+static int parse_byte(const char **pp) {
+  const char *p = *pp;
+  int c;
+  if (p[0] != '\\') {
+    c = (unsigned char)p[0];
+    p++;
+  } else if (p[1] == 's') {
+    c = ' ';
+    p += 2;
+  } else if (p[1] == 't') {
+    c = '\t';
+    p += 2;
+  } else if (p[1] == 'n') {
+    c = '\n';
+    p += 2;
+  } else if (p[1] == 'x') {
+    char *e;
+    char hex[3] = {p[2], p[2] ? p[3] : 0, 0};
+    c = strtol(hex, &e, 16);
+    if (e != hex + 2)
+      fail("bad byte escape");
+    p += 4;
+  } else if (p[1] == '\\' || p[1] == '#') {
+    c = p[1];
+    p += 2;
+  } else {
+    fail("bad byte escape");
+    c = 0;
+  }
+  *pp = p;
+  return c;
+}
+
+static void add_class(char **words, int nwords) {
+  if (nwords < 2)
+    fail("class needs a name and bytes");
+  if (lookup(classes, nclasses, words[0]) >= 0)
+    fail("class %s given twice", words[0]);
+  int id = nclasses++;
+  strcpy(classes[id], words[0]);
+  for (int i = 1; i < nwords; i++) {
+    const char *p = words[i];
+    int lo = parse_byte(&p), hi = lo;
+    if (*p == '-') {
+      p++;
+      hi = parse_byte(&p);
+    }
+    if (*p || hi < lo)
+      fail("bad byte list entry %s", words[i]);
+    for (int c = lo; c <= hi; c++) {
+      if (byteclass[c])
+        fail("byte 0x%02x is in both %s and %s", c, classes[byteclass[c]],
+             classes[id]);
+      byteclass[c] = id;
+    }
+  }
+}
+
+static void add_transition(char **words, int nwords) {
+  int colon = -1, arrow = -1;
+  for (int i = 0; i < nwords; i++) {
+    if (strcmp(words[i], ":") == 0 && colon < 0)
+      colon = i;
+    if (strcmp(words[i], "->") == 0 && arrow < 0)
+      arrow = i;
+  }
+  if (colon < 1 || arrow < colon + 2)
+    fail("expected: on STATES : CLASSES -> [NEXT] [ACTIONS]");
+  int a = arrow + 1;
+  int next = -1;
+  if (a < nwords && lookup(tokens, ntokens, words[a]) >= 0)
+    next = lookup(tokens, ntokens, words[a++]);
+  unsigned act = 0;
+  for (; a < nwords; a++) {
+    int k = 0;
+    while (actnames[k] && strcmp(actnames[k], words[a]) != 0)
+      k++;
+    if (!actnames[k])
+      fail("unknown action %s", words[a]);
+    act |= 1u << k;
+  }
+  for (int s = 0; s < colon; s++) {
+    int st = lookup(tokens, ntokens, words[s]);
+    if (st < 0)
+      fail("unknown state %s", words[s]);
+    int to = next >= 0 ? next : st;
+    for (int c = colon + 1; c < arrow; c++) {
+      if (strcmp(words[c], "*") == 0) {
+        if (hasdef[st])
+          fail("state %s has two defaults", tokens[st]);
+        hasdef[st] = 1;
+        defnext[st] = to;
+        defact[st] = act;
+        continue;
+      }
+      int cl = lookup(classes, nclasses, words[c]);
+      if (cl < 0)
+        fail("unknown class %s", words[c]);
+      if (nextstate[st][cl] >= 0)
+        fail("state %s has two transitions on %s", tokens[st], classes[cl]);
+      nextstate[st][cl] = to;
+      actions[st][cl] = act;
+    }
+  }
+}
+
+static void read_spec(FILE *f) {
+  char line[1024];
+  memset(nextstate, -1, sizeof(nextstate));
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    char *words[128];
+    int nwords = 0;
+    for (char *w = strtok(line, " \t\r\n"); w && nwords < 128;
+         w = strtok(NULL, " \t\r\n"))
+      words[nwords++] = w;
+    if (nwords == 0 || words[0][0] == '#')
+      continue;
+    for (int i = 1; i < nwords; i++)
+      if (strlen(words[i]) >= MAXWORD)
+        fail("word too long");
+    if (strcmp(words[0], "token") == 0) {
+      if (nwords != 3 || ntokens == MAXNAMES)
+        fail("expected: token NAME ABBREVIATION");
+      if (lookup(tokens, ntokens, words[1]) >= 0)
+        fail("token %s given twice", words[1]);
+      strcpy(tokens[ntokens], words[1]);
+      strcpy(abbrs[ntokens++], words[2]);
+    } else if (strcmp(words[0], "class") == 0) {
+      if (nclasses == MAXNAMES)
+        fail("too many classes");
+      add_class(&words[1], nwords - 1);
+    } else if (strcmp(words[0], "flag") == 0) {
+      if (nwords < 3 || nflags == 8)
+        fail("expected: flag NAME CLASSES");
+      strcpy(flags[nflags], words[1]);
+      for (int i = 2; i < nwords; i++) {
+        int cl = lookup(classes, nclasses, words[i]);
+        if (cl < 0)
+          fail("unknown class %s", words[i]);
+        flagmask[cl] |= 1 << nflags;
+      }
+      nflags++;
+    } else if (strcmp(words[0], "on") == 0) {
+      add_transition(&words[1], nwords - 1);
+    } else if (strcmp(words[0], "keyword") == 0) {
+      for (int i = 1; i < nwords; i++) {
+        if (nkeywords == MAXKW)
+          fail("too many keywords");
+        for (const char *c = words[i]; *c; c++)
+          if (*c < 'a' || *c > 'z')
+            fail("keywords may only use a-z");
+        strcpy(keywords[nkeywords++], words[i]);
+      }
+    } else {
+      fail("unknown directive %s", words[0]);
+    }
+  }
+  /* every state must say what to do with every class */
+  for (int st = 0; st < ntokens; st++) {
+    for (int cl = 0; cl < nclasses; cl++) {
+      if (nextstate[st][cl] >= 0)
+        continue;
+      if (!hasdef[st])
+        fail("state %s has no transition on %s", tokens[st], classes[cl]);
+      nextstate[st][cl] = defnext[st];
+      actions[st][cl] = defact[st];
+    }
+  }
+  if (ntokens > 255 || nclasses > 255)
+    fail("too many states or classes");
+}
+
+static void write_tables(FILE *o) {
+  fprintf(o, "/* Generated by genlex from %s; do not edit */\n", specname);
+  fprintf(o, "#ifndef PFA_LEXTAB_H\n#define PFA_LEXTAB_H\n\nenum {\n");
+  for (int i = 0; i < ntokens; i++)
+    fprintf(o, "  TOK_%s,\n", tokens[i]);
+  fprintf(o, "  LEX_NTOKENS\n};\n\nenum {\n");
+  for (int i = 0; i < nclasses; i++)
+    fprintf(o, "  LEXC_%s,\n", classes[i]);
+  fprintf(o, "  LEX_NCLASSES\n};\n\nenum {\n");
+  for (int i = 0; i < nflags; i++)
+    fprintf(o, "  LEXF_%s = %d,\n", flags[i], 1 << i);
+  fprintf(o, "};\n\nenum {\n");
+  for (int i = 0; actnames[i]; i++) {
+    char up[MAXWORD];
+    int k = 0;
+    for (; actnames[i][k]; k++)
+      up[k] = actnames[i][k] - 'a' + 'A';
+    up[k] = '\0';
+    fprintf(o, "  LEXA_%s = %d,\n", up, 1 << i);
+  }
+  fprintf(o, "};\n\nstruct lex_step {\n  unsigned char next;\n"
+             "  unsigned short act;\n};\n\n");
+
+  fprintf(o, "static const unsigned char lex_class[256] = {");
+  for (int c = 0; c < 256; c++)
+    fprintf(o, "%s%d,", c % 16 ? " " : "\n    ", byteclass[c]);
+  fprintf(o, "\n};\n\nstatic const unsigned char lex_flags[256] = {");
+  for (int c = 0; c < 256; c++)
+    fprintf(o, "%s%d,", c % 16 ? " " : "\n    ", flagmask[byteclass[c]]);
+  fprintf(o, "\n};\n\n");
+
+  fprintf(o, "static const struct lex_step "
+             "lex_trans[LEX_NTOKENS][LEX_NCLASSES] = {\n");
+  for (int st = 0; st < ntokens; st++) {
+    fprintf(o, "    /* %s */ {", tokens[st]);
+    for (int cl = 0; cl < nclasses; cl++)
+      fprintf(o, "%s{%d, %u}", cl ? ", " : "", nextstate[st][cl],
+              actions[st][cl]);
+    fprintf(o, "},\n");
+  }
+  fprintf(o, "};\n\nstatic const char *const "
+             "lex_token_names[LEX_NTOKENS] = {\n");
+  for (int i = 0; i < ntokens; i++)
+    fprintf(o, "    \"%s\",\n", abbrs[i]);
+  fprintf(o, "};\n\n");
+
+  /* keywords as a trie over 'a'-'z'; 0 is the root, -1 a dead end */
+  int cap = 1;
+  for (int i = 0; i < nkeywords; i++)
+    cap += strlen(keywords[i]);
+  short(*trie)[26] = calloc(cap, sizeof(*trie));
+  unsigned char *final = calloc(cap, 1);
+  memset(trie, -1, cap * sizeof(*trie));
+  int nstates = 1;
+  for (int i = 0; i < nkeywords; i++) {
+    int s = 0;
+    for (const char *c = keywords[i]; *c; c++) {
+      if (trie[s][*c - 'a'] < 0)
+        trie[s][*c - 'a'] = nstates++;
+      s = trie[s][*c - 'a'];
+    }
+    final[s] = 1;
+  }
+  fprintf(o, "static const short lex_kw_next[%d][26] = {\n", nstates);
+  for (int s = 0; s < nstates; s++) {
+    fprintf(o, "    {");
+    for (int k = 0; k < 26; k++)
+      fprintf(o, "%s%d", k ? ", " : "", trie[s][k]);
+    fprintf(o, "},\n");
+  }
+  fprintf(o, "};\n\nstatic const unsigned char lex_kw_final[%d] = {",
+          nstates);
+  for (int s = 0; s < nstates; s++)
+    fprintf(o, "%s%d,", s % 16 ? " " : "\n    ", final[s]);
+  fprintf(o, "\n};\n\n#endif\n");
+  free(trie);
+  free(final);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: genlex lexer.def lextab.h\n");
+    return 1;
+  }
+  specname = argv[1];
+  FILE *f = fopen(argv[1], "r");
+  if (!f) {
+    fprintf(stderr, "Could not open %s\n", argv[1]);
+    return 1;
+  }
+  read_spec(f);
+  fclose(f);
+
+  /* write to a temporary, so a failed run leaves no half-written file */
+  char *tmp = malloc(strlen(argv[2]) + 5);
+  sprintf(tmp, "%s.tmp", argv[2]);
+  FILE *o = fopen(tmp, "w");
+  if (!o) {
+    fprintf(stderr, "Could not create %s\n", tmp);
+    return 1;
+  }
+  write_tables(o);
+  if (fclose(o) != 0 || rename(tmp, argv[2]) != 0) {
+    fprintf(stderr, "Could not write %s\n", argv[2]);
+    remove(tmp);
+    return 1;
+  }
+  free(tmp);
+  return 0;
+}
@@ -0,0 +1,1056 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "gitindex.h"
+
+enum { OID_LEN = 20 };
+
+/* One stage-0 entry of the index, with the stat data git recorded */
+struct ientry {
+  const char *path;
+  int pathlen;
+  uint32_t ctime_s, ctime_ns, mtime_s, mtime_ns;
+  uint32_t dev, ino, mode, uid, gid, size;
+  unsigned char oid[OID_LEN];
+  int stage;
+  int intent_to_add;
+  int in_head;
+  int staged;
+  int modified;
+};
+
+/* A node of the index's cache-tree extension: a directory whose tree
+ * object is known, unless `count` is negative */
+struct ctnode {
+  const char *name;
+  int namelen;
+  int count;
+  unsigned char oid[OID_LEN];
+  int nchildren;
+  struct ctnode *children;
+};
+
+struct pack {
+  const unsigned char *idx;
+  size_t idxlen;
+  const unsigned char *data;
+  size_t datalen;
+};
+
+struct repo {
+  char *gitdir;
+  char *commondir;
+  /* the work tree, relative to the current directory */
+  char *worktree;
+  struct pack *packs;
+  int npacks;
+
+  const unsigned char *index;
+  size_t indexlen;
+  struct timespec index_mtime;
+  struct ientry *entries;
+  int nentries;
+  char *paths;
+  struct ctnode *cachetree;
+};
+
+static uint32_t be32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | p[3];
+}
+
+static char *join(const char *a, const char *b) {
+  size_t la = strlen(a), lb = strlen(b);
+  char *r = (char *)malloc(la + lb + 2);
+  memcpy(r, a, la);
+  r[la] = '/';
+  memcpy(&r[la + 1], b, lb + 1);
+  return r;
+}
+
+/* Read a whole small file, NUL-terminated; trailing newlines removed */
+static char *slurp(const char *path, size_t *len) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  size_t cap = 256, n = 0;
+  char *buf = (char *)malloc(cap);
+  while (1) {
+    if (n + 1 >= cap) {
+      cap *= 2;
+      buf = (char *)realloc(buf, cap);
+    }
+    ssize_t r = read(fd, &buf[n], cap - n - 1);
+    if (r <= 0)
+      break;
+    n += r;
+  }
+  close(fd);
+  while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r'))
+    n--;
+  buf[n] = '\0';
+  if (len)
+    *len = n;
+  return buf;
+}
+
+static const unsigned char *map_file(const char *path, size_t *len,
+                                     struct stat *st) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  const unsigned char *m = NULL;
+  if (fstat(fd, st) == 0 && st->st_size > 0) {
+    m = (const unsigned char *)mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE,
+                                    fd, 0);
+    if (m == MAP_FAILED)
+      m = NULL;
+    *len = st->st_size;
+  }
+  close(fd);
+  return m;
+}
+
+/* Minimal SHA-1, for checking blob ids of files with unreliable stat data */
+struct sha1 {
+  uint32_t h[5];
+  unsigned char buf[64];
+  uint64_t len;
+};
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(struct sha1 *s, const unsigned char *p) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++)
+    w[i] = be32(&p[4 * i]);
+  for (int i = 16; i < 80; i++)
+    w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3], e = s->h[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t t = ROL(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = ROL(b, 30);
+    b = a;
+    a = t;
+  }
+  s->h[0] += a;
+  s->h[1] += b;
+  s->h[2] += c;
+  s->h[3] += d;
+  s->h[4] += e;
+}
+
+static void sha1_init(struct sha1 *s) {
+  s->h[0] = 0x67452301;
+  s->h[1] = 0xefcdab89;
+  s->h[2] = 0x98badcfe;
+  s->h[3] = 0x10325476;
+  s->h[4] = 0xc3d2e1f0;
+  s->len = 0;
+}
+
+static void sha1_update(struct sha1 *s, const void *data, size_t n) {
+  const unsigned char *p = (const unsigned char *)data;
+  size_t fill = s->len % 64;
+  s->len += n;
+  if (fill) {
+    size_t take = 64 - fill < n ? 64 - fill : n;
+    memcpy(&s->buf[fill], p, take);
+    p += take;
+    n -= take;
+    if (fill + take < 64)
+      return;
+    sha1_block(s, s->buf);
+  }
+  for (; n >= 64; n -= 64, p += 64)
+    sha1_block(s, p);
+  memcpy(s->buf, p, n);
+}
+
+static void sha1_final(struct sha1 *s, unsigned char *out) {
+  uint64_t bits = s->len * 8;
+  unsigned char pad[72] = {0x80};
+  size_t fill = s->len % 64;
+  size_t padlen = fill < 56 ? 56 - fill : 120 - fill;
+  for (int i = 0; i < 8; i++)
+    pad[padlen + i] = bits >> (56 - 8 * i);
+  sha1_update(s, pad, padlen + 8);
+  for (int i = 0; i < 5; i++) {
+    out[4 * i] = s->h[i] >> 24;
+    out[4 * i + 1] = s->h[i] >> 16;
+    out[4 * i + 2] = s->h[i] >> 8;
+    out[4 * i + 3] = s->h[i];
+  }
+}
+
+/* Does the file's content hash to the blob id `oid`? */
+static int blob_matches(const char *path, size_t size,
+                        const unsigned char *oid) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  struct sha1 s;
+  sha1_init(&s);
+  char hdr[32];
+  int hlen = snprintf(hdr, sizeof(hdr), "blob %zu", size) + 1;
+  sha1_update(&s, hdr, hlen);
+  char buf[1 << 15];
+  size_t total = 0;
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0) {
+    sha1_update(&s, buf, r);
+    total += r;
+  }
+  close(fd);
+  unsigned char got[OID_LEN];
+  sha1_final(&s, got);
+  return total == size && memcmp(got, oid, OID_LEN) == 0;
+}
+
+/* Locate the repository from the current directory upwards */
+static int find_repo(struct repo *r) {
+  char *up = strdup(".");
+  struct stat here, parent;
+  while (1) {
+    char *dotgit = join(up, ".git");
+    struct stat st;
+    if (stat(dotgit, &st) == 0) {
+      if (S_ISDIR(st.st_mode)) {
+        r->gitdir = dotgit;
+      } else {
+        /* a linked work tree or submodule: "gitdir: <path>" */
+        char *text = slurp(dotgit, NULL);
+        free(dotgit);
+        if (!text || strncmp(text, "gitdir: ", 8) != 0) {
+          free(text);
+          free(up);
+          return -1;
+        }
+        r->gitdir = text[8] == '/' ? strdup(&text[8]) : join(up, &text[8]);
+        free(text);
+      }
+      char *cpath = join(r->gitdir, "commondir");
+      char *common = slurp(cpath, NULL);
+      free(cpath);
+      if (common) {
+        r->commondir =
+            common[0] == '/' ? strdup(common) : join(r->gitdir, common);
+        free(common);
+      } else {
+        r->commondir = strdup(r->gitdir);
+      }
+      r->worktree = up;
+      return 0;
+    }
+    free(dotgit);
+    char *next = strcmp(up, ".") == 0 ? strdup("..") : join(up, "..");
+    if (stat(up, &here) < 0 || stat(next, &parent) < 0 ||
+        (here.st_dev == parent.st_dev && here.st_ino == parent.st_ino)) {
+      free(next);
+      free(up);
+      return -1;
+    }
+    free(up);
+    up = next;
+  }
+}
+
+/* Parse an optionally negative decimal, not reading at or past `end` */
+static const unsigned char *parse_int(const unsigned char *p,
+                                      const unsigned char *end, long *v) {
+  int neg = p < end && *p == '-';
+  if (neg)
+    p++;
+  if (p >= end || *p < '0' || *p > '9')
+    return NULL;
+  long x = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (x > (INT_MAX - 9) / 10)
+      return NULL;
+    x = 10 * x + (*p++ - '0');
+  }
+  *v = neg ? -x : x;
+  return p;
+}
+
+static int parse_cachetree(const unsigned char **pp, const unsigned char *end,
+                           struct ctnode *n) {
+  const unsigned char *p = *pp;
+  const unsigned char *nul = (const unsigned char *)memchr(p, '\0', end - p);
+  if (!nul)
+    return -1;
+  n->name = (const char *)p;
+  n->namelen = nul - p;
+  p = nul + 1;
+  long count, nchildren;
+  p = parse_int(p, end, &count);
+  if (!p || p >= end || *p++ != ' ')
+    return -1;
+  p = parse_int(p, end, &nchildren);
+  if (!p)
+    return -1;
+  n->count = count;
+  n->nchildren = nchildren;
+  if (p >= end || *p != '\n' || n->nchildren < 0)
+    return -1;
+  p++;
+  if (n->count >= 0) {
+    if (end - p < OID_LEN)
+      return -1;
+    memcpy(n->oid, p, OID_LEN);
+    p += OID_LEN;
+  }
+  n->children = (struct ctnode *)calloc(n->nchildren + 1, sizeof(struct ctnode));
+  for (int i = 0; i < n->nchildren; i++) {
+    if (parse_cachetree(&p, end, &n->children[i]) < 0)
+      return -1;
+  }
+  *pp = p;
+  return 0;
+}
+
+static void free_cachetree(struct ctnode *n) {
+  for (int i = 0; i < n->nchildren; i++)
+    free_cachetree(&n->children[i]);
+  free(n->children);
+}
+
+/* Parse index versions 2 to 4, keeping stage-0 entries */
+static int read_index(struct repo *r) {
+  char *ipath = join(r->gitdir, "index");
+  struct stat st;
+  r->index = map_file(ipath, &r->indexlen, &st);
+  free(ipath);
+  if (!r->index)
+    return -1;
+  r->index_mtime = st.st_mtim;
+  const unsigned char *p = r->index, *end = r->index + r->indexlen - OID_LEN;
+  if (r->indexlen < 12 + OID_LEN || memcmp(p, "DIRC", 4) != 0)
+    return -1;
+  uint32_t version = be32(p + 4), n = be32(p + 8);
+  if (version < 2 || version > 4)
+    return -1;
+  p += 12;
+  r->entries = (struct ientry *)calloc(n + 1, sizeof(struct ientry));
+  /* v4 prefix compression means paths must be rebuilt */
+  size_t pathcap = 4096, pathused = 0;
+  r->paths = (char *)malloc(pathcap);
+  size_t *offs = (size_t *)malloc(sizeof(size_t) * (n + 1));
+  /* the previous path, as an offset, since `paths` may move */
+  size_t prev = 0, prevlen = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    const unsigned char *start = p;
+    if (end - p < 62)
+      goto bad;
+    struct ientry *e = &r->entries[r->nentries];
+    e->ctime_s = be32(p);
+    e->ctime_ns = be32(p + 4);
+    e->mtime_s = be32(p + 8);
+    e->mtime_ns = be32(p + 12);
+    e->dev = be32(p + 16);
+    e->ino = be32(p + 20);
+    e->mode = be32(p + 24);
+    e->uid = be32(p + 28);
+    e->gid = be32(p + 32);
+    e->size = be32(p + 36);
+    memcpy(e->oid, p + 40, OID_LEN);
+    unsigned flags = (p[60] << 8) | p[61];
+    e->stage = (flags >> 12) & 3;
+    p += 62;
+    if (flags & 0x4000) {
+      if (version < 3 || end - p < 2)
+        goto bad;
+      unsigned xflags = (p[0] << 8) | p[1];
+      e->intent_to_add = (xflags & 0x2000) != 0;
+      p += 2;
+    }
+    size_t keep = 0;
+    if (version == 4) {
+      /* varint count of bytes to drop from the previous path */
+      if (p >= end)
+        goto bad;
+      size_t drop = *p & 0x7f;
+      while (*p++ & 0x80) {
+        if (p >= end)
+          goto bad;
+        drop = ((drop + 1) << 7) | (*p & 0x7f);
+      }
+      if (drop > prevlen)
+        goto bad;
+      keep = prevlen - drop;
+    }
+    const unsigned char *nul = (const unsigned char *)memchr(p, '\0', end - p);
+    if (!nul)
+      goto bad;
+    size_t len = keep + (nul - p);
+    if (pathused + len + 1 > pathcap) {
+      while (pathused + len + 1 > pathcap)
+        pathcap *= 2;
+      r->paths = (char *)realloc(r->paths, pathcap);
+    }
+    memmove(&r->paths[pathused], &r->paths[prev], keep);
+    memcpy(&r->paths[pathused + keep], p, nul - p);
+    r->paths[pathused + len] = '\0';
+    offs[r->nentries] = pathused;
+    e->pathlen = len;
+    prev = pathused;
+    prevlen = len;
+    pathused += len + 1;
+    if (version == 4) {
+      p = nul + 1;
+    } else {
+      /* entries are NUL-padded to a multiple of eight bytes */
+      size_t elen = (nul - start + 8) & ~(size_t)7;
+      p = start + elen;
+    }
+    r->nentries++;
+  }
+  for (int i = 0; i < r->nentries; i++) {
+    r->entries[i].path = &r->paths[offs[i]];
+  }
+  free(offs);
+
+  /* extensions; only the cache tree is of use. Those not named in
+   * capitals, such as a split index's link or a sparse index's sdir,
+   * change what the entries mean, and must not be skipped. */
+  while (end - p >= 8) {
+    uint32_t sz = be32(p + 4);
+    if ((size_t)(end - p - 8) < sz)
+      break;
+    if (p[0] < 'A' || p[0] > 'Z')
+      return -1;
+    if (memcmp(p, "TREE", 4) == 0) {
+      const unsigned char *t = p + 8;
+      struct ctnode *root = (struct ctnode *)calloc(1, sizeof(struct ctnode));
+      if (parse_cachetree(&t, p + 8 + sz, root) == 0) {
+        r->cachetree = root;
+      } else {
+        free_cachetree(root);
+        free(root);
+      }
+    }
+    p += 8 + sz;
+  }
+  return 0;
+bad:
+  free(offs);
+  return -1;
+}
+
+/* Object store: loose objects and version 2 pack indices */
+enum { OBJ_COMMIT = 1, OBJ_TREE = 2, OBJ_OFS_DELTA = 6, OBJ_REF_DELTA = 7 };
+
+static void load_packs(struct repo *r) {
+  char *pdir = join(r->commondir, "objects/pack");
+  DIR *d = opendir(pdir);
+  if (!d) {
+    free(pdir);
+    return;
+  }
+  struct dirent *de;
+  int cap = 0;
+  while ((de = readdir(d))) {
+    size_t l = strlen(de->d_name);
+    if (l < 5 || strcmp(&de->d_name[l - 4], ".idx") != 0)
+      continue;
+    char *ipath = join(pdir, de->d_name);
+    char *ppath = (char *)malloc(strlen(ipath) + 2);
+    memcpy(ppath, ipath, strlen(ipath) - 4);
+    strcpy(&ppath[strlen(ipath) - 4], ".pack");
+    struct pack pk;
+    struct stat st;
+    pk.idx = map_file(ipath, &pk.idxlen, &st);
+    pk.data = map_file(ppath, &pk.datalen, &st);
+    free(ipath);
+    free(ppath);
+    if (!pk.idx || !pk.data || pk.idxlen < 8 + 1024 ||
+        memcmp(pk.idx, "\377tOc", 4) != 0 || be32(pk.idx + 4) != 2) {
+      if (pk.idx)
+        munmap((void *)pk.idx, pk.idxlen);
+      if (pk.data)
+        munmap((void *)pk.data, pk.datalen);
+      continue;
+    }
+    if (r->npacks == cap) {
+      cap = cap ? 2 * cap : 4;
+      r->packs = (struct pack *)realloc(r->packs, sizeof(struct pack) * cap);
+    }
+    r->packs[r->npacks++] = pk;
+  }
+  closedir(d);
+  free(pdir);
+}
+
+static int pack_find(const struct pack *pk, const unsigned char *oid,
+                     uint64_t *off) {
+  const unsigned char *fan = pk->idx + 8;
+  uint32_t count = be32(fan + 255 * 4);
+  uint32_t lo = oid[0] ? be32(fan + (oid[0] - 1) * 4) : 0;
+  uint32_t hi = be32(fan + oid[0] * 4);
+  const unsigned char *shas = fan + 1024;
+  if (pk->idxlen < 8 + 1024 + (size_t)count * 28)
+    return 0;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int c = memcmp(shas + (size_t)mid * OID_LEN, oid, OID_LEN);
+    if (c == 0) {
+      const unsigned char *offs = shas + (size_t)count * 24;
+      uint32_t o = be32(offs + (size_t)mid * 4);
+      if (o & 0x80000000u) {
+        const unsigned char *big =
+            offs + (size_t)count * 4 + (size_t)(o & 0x7fffffffu) * 8;
+        if (big + 8 > pk->idx + pk->idxlen)
+          return 0;
+        *off = ((uint64_t)be32(big) << 32) | be32(big + 4);
+      } else {
+        *off = o;
+      }
+      return 1;
+    }
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return 0;
+}
+
+static char *inflate_to(const unsigned char *src, size_t srclen, size_t outlen,
+                        size_t *used) {
+  char *out = (char *)malloc(outlen + 1);
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK) {
+    free(out);
+    return NULL;
+  }
+  zs.next_in = (unsigned char *)src;
+  zs.avail_in = srclen;
+  zs.next_out = (unsigned char *)out;
+  zs.avail_out = outlen + 1;
+  int ret = inflate(&zs, Z_FINISH);
+  inflateEnd(&zs);
+  if (ret != Z_STREAM_END || zs.total_out != outlen) {
+    free(out);
+    return NULL;
+  }
+  if (used)
+    *used = zs.total_in;
+  return out;
+}
+
+static char *read_object(struct repo *r, const unsigned char *oid, int *type,
+                         size_t *len);
+
+static char *apply_delta(const char *base, size_t baselen, const char *delta,
+                         size_t deltalen, size_t *outlen) {
+  const unsigned char *p = (const unsigned char *)delta;
+  const unsigned char *end = p + deltalen;
+  size_t sizes[2];
+  for (int k = 0; k < 2; k++) {
+    size_t v = 0;
+    int shift = 0;
+    do {
+      if (p >= end)
+        return NULL;
+      v |= (size_t)(*p & 0x7f) << shift;
+      shift += 7;
+    } while (*p++ & 0x80);
+    sizes[k] = v;
+  }
+  if (sizes[0] != baselen)
+    return NULL;
+  char *out = (char *)malloc(sizes[1] + 1);
+  size_t o = 0;
+  while (p < end) {
+    unsigned c = *p++;
+    if (c & 0x80) {
+      size_t off = 0, sz = 0;
+      for (int b = 0; b < 4; b++)
+        if (c & (1 << b)) {
+          if (p >= end)
+            goto bad;
+          off |= (size_t)*p++ << (8 * b);
+        }
+      for (int b = 0; b < 3; b++)
+        if (c & (0x10 << b)) {
+          if (p >= end)
+            goto bad;
+          sz |= (size_t)*p++ << (8 * b);
+        }
+      if (sz == 0)
+        sz = 0x10000;
+      if (off + sz > baselen || o + sz > sizes[1])
+        break;
+      memcpy(&out[o], &base[off], sz);
+      o += sz;
+    } else if (c) {
+      if (o + c > sizes[1] || p + c > end)
+        break;
+      memcpy(&out[o], p, c);
+      o += c;
+      p += c;
+    } else {
+      break;
+    }
+  }
+  if (p != end || o != sizes[1])
+    goto bad;
+  *outlen = o;
+  return out;
+bad:
+  free(out);
+  return NULL;
+}
+
+static char *pack_read(struct repo *r, const struct pack *pk, uint64_t off,
+                       int *type, size_t *len) {
+  const unsigned char *p = pk->data + off, *end = pk->data + pk->datalen;
+  if (off >= pk->datalen)
+    return NULL;
+  unsigned c = *p++;
+  int t = (c >> 4) & 7;
+  size_t size = c & 15;
+  int shift = 4;
+  while ((c & 0x80) && p < end) {
+    c = *p++;
+    size |= (size_t)(c & 0x7f) << shift;
+    shift += 7;
+  }
+  char *base = NULL;
+  size_t baselen = 0;
+  if (t == OBJ_OFS_DELTA) {
+    if (p >= end)
+      return NULL;
+    uint64_t back = *p & 0x7f;
+    while (*p++ & 0x80) {
+      if (p >= end)
+        return NULL;
+      back = ((back + 1) << 7) | (*p & 0x7f);
+    }
+    if (back > off)
+      return NULL;
+    base = pack_read(r, pk, off - back, type, &baselen);
+  } else if (t == OBJ_REF_DELTA) {
+    if (end - p < OID_LEN)
+      return NULL;
+    base = read_object(r, p, type, &baselen);
+    p += OID_LEN;
+  } else {
+    *type = t;
+    *len = size;
+    return inflate_to(p, end - p, size, NULL);
+  }
+  if (!base)
+    return NULL;
+  char *delta = inflate_to(p, end - p, size, NULL);
+  char *out = delta ? apply_delta(base, baselen, delta, size, len) : NULL;
+  free(base);
+  free(delta);
+  return out;
+}
+
+static char *read_object(struct repo *r, const unsigned char *oid, int *type,
+                         size_t *len) {
+  for (int i = 0; i < r->npacks; i++) {
+    uint64_t off;
+    if (pack_find(&r->packs[i], oid, &off))
+      return pack_read(r, &r->packs[i], off, type, len);
+  }
+  char hex[OID_LEN * 2 + 10];
+  for (int i = 0; i < OID_LEN; i++)
+    sprintf(&hex[2 * i + (i > 0)], i == 0 ? "%02x/" : "%02x", oid[i]);
+  char *opath = join(r->commondir, "objects");
+  char *path = join(opath, hex);
+  free(opath);
+  size_t zlen;
+  struct stat st;
+  const unsigned char *z = map_file(path, &zlen, &st);
+  free(path);
+  if (!z)
+    return NULL;
+  /* the header, "<type> <size>\0", comes first */
+  char head[64];
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  char *out = NULL;
+  if (inflateInit(&zs) == Z_OK) {
+    zs.next_in = (unsigned char *)z;
+    zs.avail_in = zlen;
+    zs.next_out = (unsigned char *)head;
+    zs.avail_out = sizeof(head);
+    inflate(&zs, Z_SYNC_FLUSH);
+    char *nul = (char *)memchr(head, '\0', sizeof(head) - zs.avail_out);
+    inflateEnd(&zs);
+    char *sp = nul ? (char *)memchr(head, ' ', nul - head) : NULL;
+    if (sp) {
+      *type = strncmp(head, "tree ", 5) == 0     ? OBJ_TREE
+              : strncmp(head, "commit ", 7) == 0 ? OBJ_COMMIT
+                                                 : 0;
+      size_t hlen = nul + 1 - head;
+      size_t size = strtoull(sp + 1, NULL, 10);
+      char *all = inflate_to(z, zlen, hlen + size, NULL);
+      if (all) {
+        memmove(all, all + hlen, size);
+        *len = size;
+        out = all;
+      }
+    }
+  }
+  munmap((void *)z, zlen);
+  return out;
+}
+
+static int parse_hex(const char *s, unsigned char *oid) {
+  for (int i = 0; i < OID_LEN; i++) {
+    unsigned v;
+    if (sscanf(&s[2 * i], "%2x", &v) != 1)
+      return -1;
+    oid[i] = v;
+  }
+  return 0;
+}
+
+/* Resolve HEAD to the id of its tree; returns -1 on an unborn branch */
+static int head_tree(struct repo *r, unsigned char *tree) {
+  char *hpath = join(r->gitdir, "HEAD");
+  char *head = slurp(hpath, NULL);
+  free(hpath);
+  if (!head)
+    return -1;
+  unsigned char commit[OID_LEN];
+  int ok = -1;
+  if (strncmp(head, "ref: ", 5) == 0) {
+    const char *ref = &head[5];
+    char *rpath = join(r->commondir, ref);
+    char *hex = slurp(rpath, NULL);
+    free(rpath);
+    if (hex) {
+      ok = parse_hex(hex, commit);
+      free(hex);
+    } else {
+      char *ppath = join(r->commondir, "packed-refs");
+      char *packed = slurp(ppath, NULL);
+      free(ppath);
+      size_t rl = strlen(ref);
+      for (char *line = packed; ok < 0 && line && *line;) {
+        char *nl = strchr(line, '\n');
+        if (strlen(line) > 41 && line[40] == ' ' &&
+            strncmp(&line[41], ref, rl) == 0 &&
+            (line[41 + rl] == '\n' || line[41 + rl] == '\0')) {
+          ok = parse_hex(line, commit);
+        }
+        line = nl ? nl + 1 : NULL;
+      }
+      free(packed);
+    }
+  } else {
+    ok = parse_hex(head, commit);
+  }
+  free(head);
+  if (ok < 0)
+    return -1;
+  int type;
+  size_t len;
+  char *obj = read_object(r, commit, &type, &len);
+  if (!obj || type != OBJ_COMMIT || len < 45 || strncmp(obj, "tree ", 5)) {
+    free(obj);
+    return -2;
+  }
+  ok = parse_hex(&obj[5], tree);
+  free(obj);
+  return ok < 0 ? -2 : 0;
+}
+
+static int cmp_path(const char *a, int alen, const char *b, int blen) {
+  int c = memcmp(a, b, alen < blen ? alen : blen);
+  return c ? c : alen - blen;
+}
+
+/* First entry whose path is not less than `path` */
+static int lower_bound(const struct repo *r, const char *path, int len) {
+  int lo = 0, hi = r->nentries;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    const struct ientry *e = &r->entries[mid];
+    if (cmp_path(e->path, e->pathlen, path, len) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Compare the tree `oid` at `prefix` with the index, marking what is
+ * staged. Subtrees that the cache tree shows to be unchanged are not
+ * read at all. */
+static int diff_head(struct repo *r, const unsigned char *oid, char *prefix,
+                     int plen, const struct ctnode *ct) {
+  if (ct && ct->count >= 0 && memcmp(ct->oid, oid, OID_LEN) == 0) {
+    for (int i = lower_bound(r, prefix, plen);
+         i < r->nentries && r->entries[i].pathlen >= plen &&
+         memcmp(r->entries[i].path, prefix, plen) == 0;
+         i++) {
+      r->entries[i].in_head = 1;
+    }
+    return 0;
+  }
+  int type;
+  size_t len;
+  char *tree = read_object(r, oid, &type, &len);
+  if (!tree || type != OBJ_TREE) {
+    free(tree);
+    return -1;
+  }
+  int ret = 0;
+  for (size_t p = 0; p < len && ret == 0;) {
+    char *sp = (char *)memchr(&tree[p], ' ', len - p);
+    char *nul = sp ? (char *)memchr(sp, '\0', &tree[len] - sp) : NULL;
+    if (!nul || nul + 1 + OID_LEN > &tree[len]) {
+      ret = -1;
+      break;
+    }
+    unsigned mode = strtoul(&tree[p], NULL, 8);
+    const char *name = sp + 1;
+    int nlen = nul - name;
+    const unsigned char *eoid = (const unsigned char *)nul + 1;
+    p = nul + 1 + OID_LEN - tree;
+
+    char *sub = (char *)malloc(plen + nlen + 2);
+    memcpy(sub, prefix, plen);
+    memcpy(&sub[plen], name, nlen);
+    if (mode == 040000) {
+      sub[plen + nlen] = '/';
+      const struct ctnode *child = NULL;
+      for (int i = 0; ct && i < ct->nchildren; i++) {
+        if (ct->children[i].namelen == nlen &&
+            memcmp(ct->children[i].name, name, nlen) == 0)
+          child = &ct->children[i];
+      }
+      ret = diff_head(r, eoid, sub, plen + nlen + 1, child);
+    } else {
+      int i = lower_bound(r, sub, plen + nlen);
+      if (i < r->nentries && r->entries[i].pathlen == plen + nlen &&
+          memcmp(r->entries[i].path, sub, plen + nlen) == 0) {
+        r->entries[i].in_head = 1;
+        if (memcmp(r->entries[i].oid, eoid, OID_LEN) != 0)
+          r->entries[i].staged = 1;
+      }
+    }
+    free(sub);
+  }
+  free(tree);
+  return ret;
+}
+
+static int is_python(const char *name, int nlen) {
+  return (nlen > 3 && memcmp(name + nlen - 3, ".py", 3) == 0) ||
+         (nlen > 4 && memcmp(name + nlen - 4, ".pyi", 4) == 0);
+}
+
+static char *worktree_path(const struct repo *r, const char *path) {
+  return strcmp(r->worktree, ".") == 0 ? strdup(path)
+                                       : join(r->worktree, path);
+}
+
+struct statwork {
+  struct repo *repo;
+  int *todo;
+  int ntodo;
+  int next;
+};
+
+/* Compare working files with their index stat data, hashing only when
+ * stat can not tell (touched files, or "racily clean" entries written
+ * in the same instant as the index) */
+static void *stat_thread(void *varg) {
+  struct statwork *sw = (struct statwork *)varg;
+  struct repo *r = sw->repo;
+  while (1) {
+    int k = __atomic_fetch_add(&sw->next, 64, __ATOMIC_RELAXED);
+    if (k >= sw->ntodo)
+      break;
+    int kend = k + 64 < sw->ntodo ? k + 64 : sw->ntodo;
+    for (; k < kend; k++) {
+      struct ientry *e = &r->entries[sw->todo[k]];
+      char *path = worktree_path(r, e->path);
+      struct stat st;
+      if (lstat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        if ((uint32_t)st.st_size != e->size || e->intent_to_add) {
+          e->modified = 1;
+        } else {
+          int racy = e->mtime_s > (uint32_t)r->index_mtime.tv_sec ||
+                     (e->mtime_s == (uint32_t)r->index_mtime.tv_sec &&
+                      e->mtime_ns >= (uint32_t)r->index_mtime.tv_nsec);
+          int same = (uint32_t)st.st_mtim.tv_sec == e->mtime_s &&
+                     (uint32_t)st.st_mtim.tv_nsec == e->mtime_ns &&
+                     (uint32_t)st.st_ctim.tv_sec == e->ctime_s &&
+                     (uint32_t)st.st_ctim.tv_nsec == e->ctime_ns &&
+                     (uint32_t)st.st_ino == e->ino &&
+                     (uint32_t)st.st_uid == e->uid &&
+                     (uint32_t)st.st_gid == e->gid;
+          if (!same || racy) {
+            e->modified = !blob_matches(path, st.st_size, e->oid);
+          }
+        }
+      }
+      free(path);
+    }
+  }
+  return NULL;
+}
+
+struct untracked_arg {
+  struct repo *repo;
+  int skip;
+  walk_found_fn found;
+  void *arg;
+};
+
+static void found_untracked(const char *path, void *varg) {
+  struct untracked_arg *u = (struct untracked_arg *)varg;
+  const char *rel = path + u->skip;
+  int len = strlen(rel);
+  int i = lower_bound(u->repo, rel, len);
+  if (i < u->repo->nentries && u->repo->entries[i].pathlen == len &&
+      memcmp(u->repo->entries[i].path, rel, len) == 0)
+    return;
+  /* match the form of the tracked paths */
+  u->found(strcmp(u->repo->worktree, ".") == 0 ? rel : path, u->arg);
+}
+
+static void free_repo(struct repo *r) {
+  for (int i = 0; i < r->npacks; i++) {
+    munmap((void *)r->packs[i].idx, r->packs[i].idxlen);
+    munmap((void *)r->packs[i].data, r->packs[i].datalen);
+  }
+  free(r->packs);
+  if (r->index)
+    munmap((void *)r->index, r->indexlen);
+  if (r->cachetree) {
+    free_cachetree(r->cachetree);
+    free(r->cachetree);
+  }
+  free(r->entries);
+  free(r->paths);
+  free(r->gitdir);
+  free(r->commondir);
+  free(r->worktree);
+}
+
+int git_changed(int nthreads, int untracked, walk_found_fn found, void *arg) {
+  struct repo r;
+  memset(&r, 0, sizeof(r));
+  if (find_repo(&r) < 0 || read_index(&r) < 0) {
+    free_repo(&r);
+    return 1;
+  }
+
+  /* conflicted entries are left alone; only stage 0 is considered */
+  int n = 0;
+  for (int i = 0; i < r.nentries; i++) {
+    if (r.entries[i].stage == 0)
+      r.entries[n++] = r.entries[i];
+  }
+  r.nentries = n;
+
+  load_packs(&r);
+  unsigned char tree[OID_LEN];
+  int h = head_tree(&r, tree);
+  if (h == -2 || (h == 0 && diff_head(&r, tree, "", 0, r.cachetree) < 0)) {
+    free_repo(&r);
+    return 1;
+  }
+  for (int i = 0; i < r.nentries; i++) {
+    /* new files are staged too */
+    if (!r.entries[i].in_head && !r.entries[i].intent_to_add)
+      r.entries[i].staged = 1;
+  }
+
+  struct statwork sw;
+  sw.repo = &r;
+  sw.todo = (int *)malloc(sizeof(int) * (r.nentries + 1));
+  sw.ntodo = 0;
+  sw.next = 0;
+  for (int i = 0; i < r.nentries; i++) {
+    struct ientry *e = &r.entries[i];
+    if (S_ISREG(e->mode) && is_python(e->path, e->pathlen))
+      sw.todo[sw.ntodo++] = i;
+  }
+  if (nthreads < 1)
+    nthreads = 1;
+  pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * nthreads);
+  for (int t = 1; t < nthreads; t++)
+    pthread_create(&threads[t], NULL, stat_thread, &sw);
+  stat_thread(&sw);
+  for (int t = 1; t < nthreads; t++)
+    pthread_join(threads[t], NULL);
+  free(threads);
+
+  for (int k = 0; k < sw.ntodo; k++) {
+    struct ientry *e = &r.entries[sw.todo[k]];
+    if (!e->staged && !e->modified)
+      continue;
+    char *path = worktree_path(&r, e->path);
+    struct stat st;
+    /* files deleted from the work tree have nothing to format */
+    if (lstat(path, &st) == 0 && S_ISREG(st.st_mode))
+      found(path, arg);
+    free(path);
+  }
+  free(sw.todo);
+
+  int ret = 0;
+  if (untracked) {
+    /* .git/info/exclude applies on top of the .gitignore files */
+    char *xpath = join(r.commondir, "info/exclude");
+    char *text = slurp(xpath, NULL);
+    free(xpath);
+    int nx = 0;
+    const char **excludes = NULL;
+    if (text) {
+      excludes = (const char **)malloc(sizeof(char *) * (strlen(text) + 1));
+      for (char *line = strtok(text, "\n"); line; line = strtok(NULL, "\n"))
+        excludes[nx++] = line;
+    }
+    struct untracked_arg u;
+    u.repo = &r;
+    u.skip = strcmp(r.worktree, ".") == 0 ? 2 : strlen(r.worktree) + 1;
+    u.found = found;
+    u.arg = arg;
+    ret = walk_trees(&r.worktree, 1, excludes, nx, nthreads, found_untracked,
+                     &u);
+    free(excludes);
+    free(text);
+  }
+  free_repo(&r);
+  return ret;
+}
@@ -0,0 +1,16 @@
+#ifndef PFA_GITINDEX_H
+#define PFA_GITINDEX_H
+
+#include "walk.h"
+
+/* Find the git work tree containing the current directory, and call
+ * `found` for every tracked *.py or *.pyi file whose index entry differs
+ * from HEAD (staged) or whose working copy differs from the index
+ * (modified). With `untracked`, files that are neither tracked nor
+ * ignored are included too. This reads .git/index and the object store
+ * directly, checking the working tree on `nthreads` threads. Returns
+ * nonzero if no repository was found or it could not be read, as when
+ * the index is split or sparse. */
+int git_changed(int nthreads, int untracked, walk_found_fn found, void *arg);
+
+#endif
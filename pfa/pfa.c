@@ -1,1016 +1,1984 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-/* Tokens: things which can't be split.
- * For instance,
- *   TOK_LABEL includes everything from 'import' to 'quit' to 'try'
- *   TOK_NUMBER is: 3j, 1.05e-55
- *   TOK_STRING is: a'BDEFDSF' r'GSGFDG' b"\"\"\'''" """ afsfa """
- *   TOK_OBRACE is: any of ( { [
- *   TOK_CBRACE is: any of ] } )
- *   TOK_COMMENT is: a comment!
- *   TOK_OPERATOR is: * ^ | |= @=
- *   TOK_EXP is: **
- *   TOK_PM is: + -
- *   TOK_COLON is: :
- */
-enum {
-  TOK_LABEL,
-  TOK_SPECIAL,
-  TOK_NUMBER,
-  TOK_STRING,
-  TOK_TRISTR,
-  TOK_OBRACE,
-  TOK_CBRACE,
-  TOK_COMMENT,
-  TOK_EQUAL,
-  TOK_OPERATOR,
-  TOK_COMMA,
-  TOK_COLON,
-  TOK_EXP,
-  TOK_INBETWEEN,
-  TOK_LCONT,
-  TOK_DOT,
-  TOK_UNARYOP,
+#include "cache.h"
+#include "diff.h"
+#include "embed.h"
+#include "format.h"
+#include "gitindex.h"
+#include "uring.h"
+#include "walk.h"
+#include "watch.h"
+
+/* simple fprintf replacement */
+static void logerr(int narg, ...) {
+  va_list alist;
+  if (narg > 1) {
+    int netlen = 0;
+    va_start(alist, narg);
+    for (int i = 0; i < narg; i++) {
+      const char *s = va_arg(alist, const char *);
+      netlen += strlen(s);
+    }
+    va_end(alist);
+
+    char *data = (char *)malloc(netlen);
+    va_start(alist, narg);
+    char *local = data;
+    for (int i = 0; i < narg; i++) {
+      const char *s = va_arg(alist, const char *);
+      local += strapp(local, s);
+    }
+    va_end(alist);
+
+    write(STDERR_FILENO, data, netlen);
+    free(data);
+  } else {
+    va_start(alist, narg);
+    const char *s = va_arg(alist, const char *);
+    write(STDERR_FILENO, s, strlen(s));
+    va_end(alist);
+  }
+}
+
+/* Command line choices that apply to every file */
+struct settings {
+  int inplace;
+  /* only report files that would change; never write */
+  int check;
+  /* with `check`, show the changes as unified diffs */
+  int diff;
+  /* if set, only format lines first..last of each file */
+  int first;
+  int last;
+  /* WRAP_GREEDY or WRAP_OPTIMAL */
+  int wrap;
+  struct cache *cache;
+  /* threads left idle, which may be borrowed to format large files */
+  int *spare;
+  /* if set, --stats was given, and per-file counts are added here as
+   * they are reported */
+  struct pfa_stats *stats;
 };
 
+/* Per-file results, kept until they can be reported in order */
 enum {
-  LINE_IS_BLANK,
-  LINE_IS_CONTINUATION,
-  LINE_IS_TRISTR,
-  LINE_IS_NORMAL,
+  JOB_DNE = 1,
+  JOB_NOSTAT = 2,
+  JOB_NORENAME = 4,
+  JOB_CHANGED = 8,
+  JOB_NOLINES = 16,
+  JOB_NOREAD = 32,
+  /* would change, and `output` holds the diff */
+  JOB_DIFF = 64,
+  /* a notebook or Markdown file that could not be mapped */
+  JOB_NOEMBED = 128,
+  /* the formatted text could not all be written to the temporary */
+  JOB_NOWRITE = 256
 };
 
-enum { SSCORE_COMMENT = 10000, SSCORE_NESTING = -100 };
+struct job {
+  const char *name;
+  off_t size;
+  int status;
+  char *tmpname;
+  /* formatted text, when output is deferred */
+  struct vlbuf output;
+  size_t outlen;
+  int done;
+  /* set for jobs that pass through the I/O engine, which reads the file
+   * ahead into `input` when it can, and writes back the formatted text in
+   * `output` if `commit` is set */
+  int engine;
+  int commit;
+  char *input;
+  size_t inlen;
+  int added_newline;
+  int fd;
+  /* the file's permissions, if known */
+  int havestat;
+  mode_t mode;
+  uid_t uid;
+  gid_t gid;
+  struct statx *stx;
+  /* completions still due for a write back */
+  int inflight;
+  /* with --stats only; `since` is when the engine's current step began */
+  struct pfa_stats *stats;
+  uint64_t since;
+  struct job *next;
+};
 
-struct vlbuf {
-  union {
-    void *vd;
-    char *ch;
-    int *in;
-  } d;
-  size_t len;
-  size_t esize;
+/* Scratch buffers owned by a single formatting thread */
+struct worker {
+  struct pfa_context ctx;
+  struct vlbuf origfile;
+  struct vlbuf formfile;
+  struct vlbuf nbuf;
+  struct differ differ;
+  struct vlbuf difftext;
+  struct embedder embed;
 };
 
-struct vlbuf vlbuf_make(size_t es) {
-  struct vlbuf ib;
-  ib.esize = es;
-  ib.len = 16;
-  ib.d.vd = malloc(ib.len * ib.esize);
-  return ib;
+static void worker_init(struct worker *w) {
+  pfa_context_init(&w->ctx);
+  w->origfile = vlbuf_make(sizeof(char));
+  w->formfile = vlbuf_make(sizeof(char));
+  w->nbuf = vlbuf_make(sizeof(char));
+  differ_init(&w->differ);
+  w->difftext = vlbuf_make(sizeof(char));
+  embedder_init(&w->embed);
+}
+
+static void worker_free(struct worker *w) {
+  pfa_context_clear(&w->ctx);
+  vlbuf_free(&w->origfile);
+  vlbuf_free(&w->formfile);
+  vlbuf_free(&w->nbuf);
+  differ_free(&w->differ);
+  vlbuf_free(&w->difftext);
+  embedder_free(&w->embed);
+}
+
+/* Map `size` bytes of a regular file read-only, followed by a newline if
+ * the file does not end with one; the mapping spans `*maplen` bytes */
+static char *map_input(int fd, size_t size, size_t *maplen,
+                       int *added_newline) {
+  size_t pgsize = sysconf(_SC_PAGESIZE);
+  *maplen = (size + 1 + pgsize - 1) / pgsize * pgsize;
+  /* reserve room for the extra byte, then place the file over it */
+  char *base = (char *)mmap(NULL, *maplen, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+           0) == MAP_FAILED) {
+    munmap(base, *maplen);
+    return NULL;
+  }
+  madvise(base, size, MADV_SEQUENTIAL);
+  *added_newline = base[size - 1] != '\n';
+  if (*added_newline) {
+    /* only this page is copied on write */
+    base[size] = '\n';
+  }
+  return base;
+}
+
+static void stats_add(struct pfa_stats *total, const struct pfa_stats *s) {
+  total->files++;
+  total->bytes_in += s->bytes_in;
+  total->bytes_out += s->bytes_out;
+  total->lines += s->lines;
+  total->logical_lines += s->logical_lines;
+  for (int i = 0; i < STATS_TOKENS; i++) {
+    total->tokens[i] += s->tokens[i];
+  }
+  total->splits += s->splits;
+  total->breaks += s->breaks;
+  total->regrowths += s->regrowths;
+  if (s->peak_scratch > total->peak_scratch) {
+    total->peak_scratch = s->peak_scratch;
+  }
+  if (s->peak_output > total->peak_output) {
+    total->peak_output = s->peak_output;
+  }
+  total->ns_read += s->ns_read;
+  total->ns_tokenize += s->ns_tokenize;
+  total->ns_spacing += s->ns_spacing;
+  total->ns_wrap += s->ns_wrap;
+  total->ns_write += s->ns_write;
+  total->ns_commit += s->ns_commit;
+}
+
+static void format_with(struct pfa_context *ctx, struct source *src,
+                        struct vlbuf *origfile, struct sink *sink,
+                        struct pfa_stats *stats) {
+  if (stats) {
+    pyformat_stats(ctx, src, origfile, sink, stats);
+  } else {
+    pyformat(ctx, src, origfile, sink);
+  }
 }
 
-static size_t vlbuf_expand(struct vlbuf *ib, size_t minsize) {
+/* Files this large are cut into pieces of about SPLIT_MIN bytes or more,
+ * and formatted on threads borrowed from `spare` */
+enum { SPLIT_MIN = 4 << 20 };
+
+/* Files this large are rewritten in place as they are formatted, never
+ * held whole in memory. The temporary is made before it is known to be
+ * needed, which small files that are already formatted should not pay. */
+enum { REWRITE_MIN = 1 << 20 };
+
+/* How many threads beyond the caller's may help format `size` bytes */
+static int borrow_threads(const struct settings *set, size_t size) {
+  int want = size / SPLIT_MIN - 1;
+  int have = __atomic_load_n(set->spare, __ATOMIC_RELAXED);
+  int take;
   do {
-    ib->len *= 2;
-  } while (ib->len <= minsize);
-  ib->d.vd = realloc(ib->d.vd, ib->len * ib->esize);
-  return ib->len;
-}
-
-static size_t vlbuf_append(struct vlbuf *ib, const char *str, int lstr,
-                           size_t countedlen, FILE *out) {
-  if (ib) {
-    if (ib->len <= countedlen + lstr + 1) {
-      vlbuf_expand(ib, lstr + countedlen + 1);
-    }
-    memcpy(&ib->d.ch[countedlen], str, lstr + 1);
-  }
-  if (out) {
-    fwrite(str, 1, lstr, out);
-  }
-  return lstr + countedlen;
-}
-static size_t vlbuf_extend(struct vlbuf *ib, char ch, int nch,
-                           size_t countedlen, FILE *out) {
-  if (ib) {
-    if (ib->len <= countedlen + nch + 1) {
-      vlbuf_expand(ib, countedlen + nch + 1);
-    }
-    memset(&ib->d.ch[countedlen], ch, nch);
-    ib->d.ch[countedlen + nch + 1] = '\0';
-  }
-  if (out) {
-    char buf[1024];
-    memset(buf, ' ', nch > 1024 ? 1024 : nch);
-    int wrt = nch;
-    while (wrt > 0) {
-      fwrite(buf, 1, wrt > 1024 ? 1024 : wrt, out);
-      wrt -= 1024;
-    }
-  }
-  return nch + countedlen;
-}
-
-static void vlbuf_free(struct vlbuf *ib) {
-  free(ib->d.vd);
-  ib->d.vd = 0;
-  ib->len = 0;
-}
-
-static size_t strapp(char *target, const char *app) {
-  size_t delta = 0;
-  while (*app != '\0') {
-    target[delta] = *app;
-    delta++;
-    app++;
-  }
-  return delta;
-}
-static const char *tok_to_string(int tok) {
-  switch (tok) {
-  case TOK_LABEL:
-    return "LAB";
-  case TOK_SPECIAL:
-    return "SPC";
-  case TOK_NUMBER:
-    return "NUM";
-  case TOK_STRING:
-    return "STR";
-  case TOK_TRISTR:
-    return "TST";
-  case TOK_OBRACE:
-    return "OBR";
-  case TOK_CBRACE:
-    return "CBR";
-  case TOK_COMMENT:
-    return "CMT";
-  case TOK_OPERATOR:
-    return "OPR";
-  case TOK_EQUAL:
-    return "EQL";
-  case TOK_EXP:
-    return "EXP";
-  case TOK_COLON:
-    return "CLN";
-  case TOK_COMMA:
-    return "CMA";
-  case TOK_INBETWEEN:
-    return "INB";
-  case TOK_LCONT:
-    return "LCO";
-  case TOK_DOT:
-    return "DOT";
-  case TOK_UNARYOP:
-    return "UNO";
-  default:
-    return "???";
-  }
-}
-
-static const char *ls_to_string(int ls) {
-  switch (ls) {
-  case LINE_IS_BLANK:
-    return "LINE_BLNK";
-  case LINE_IS_CONTINUATION:
-    return "LINE_CONT";
-  case LINE_IS_NORMAL:
-    return "LINE_NORM";
-  case LINE_IS_TRISTR:
-    return "LINE_TSTR";
-  default:
-    return "LINE_????";
-  }
-}
-
-static int isalpha_lead(char c) {
-  if ((unsigned int)c > 127)
-    return 1;
-  if ('a' <= c && c <= 'z')
-    return 1;
-  if ('A' <= c && c <= 'Z')
-    return 1;
-  if ('_' == c)
-    return 1;
-  return 0;
+    take = have < want ? have : want;
+    if (take <= 0) {
+      return 0;
+    }
+  } while (!__atomic_compare_exchange_n(set->spare, &have, have - take, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return take;
 }
-static int isnumeric_lead(char c) {
-  if ('0' <= c && c <= '9')
-    return 1;
-  if ('.' == c)
-    return 1;
+
+/* A piece of a split file: the lines [from, to) are scanned for a place to
+ * cut, then `src`, from that cut to the next, is formatted into `out`; or,
+ * when rewriting in place, compared against `src` and written to the
+ * scratch file `fd` once it differs */
+struct piece {
+  const char *from;
+  const char *to;
+  struct carry carry;
+  const char *cut;
+  struct source src;
+  struct vlbuf out;
+  size_t len;
+  int fd;
+  int differs;
+  int halted;
+  struct pfa_stats *stats;
+  int wrap;
+  /* if not, the piece was handled on the caller's thread */
+  int threaded;
+  pthread_t thread;
+};
+
+static void *scan_piece(void *arg) {
+  struct piece *pc = (struct piece *)arg;
+  pc->carry = carry_start();
+  pc->cut = scan_cuts(&pc->carry, pc->from, pc->to);
+  return NULL;
+}
+
+static void *format_piece(void *arg) {
+  struct piece *pc = (struct piece *)arg;
+  struct pfa_context ctx;
+  pfa_context_init(&ctx);
+  ctx.wrap = pc->wrap;
+  struct sink sink;
+  memset(&sink, 0, sizeof(sink));
+  if (pc->fd >= 0) {
+    sink.kind = SINK_REWRITE;
+    sink.fd = pc->fd;
+    sink.expect = pc->src.data;
+    sink.expectlen = pc->src.end - pc->src.added_newline - pc->src.data;
+  } else {
+    sink.buf = &pc->out;
+  }
+  format_with(&ctx, &pc->src, NULL, &sink, pc->stats);
+  pc->len = sink.len;
+  pc->differs = sink.differs;
+  pc->halted = sink.halted;
+  pfa_context_clear(&ctx);
+  return NULL;
+}
+
+/* Returns nonzero if not all of it could be written */
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t w = write(fd, data, len);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      return 1;
+    }
+    data += w;
+    len -= w;
+  }
   return 0;
 }
 
-static int isoptype(char c) {
-  if (c == '=' || c == '+' || c == '-' || c == '@' || c == '|' || c == '^' ||
-      c == '&' || c == '*' || c == '/' || c == '<' || c == '>' || c == '!' ||
-      c == '~' || c == '%')
-    return 1;
+/* Append the first `len` bytes of the file `in` to `out`, within the
+ * kernel where it can be; returns nonzero if they could not all be */
+static int copy_all(int in, int out, size_t len) {
+  loff_t off = 0;
+  while (len > 0) {
+    ssize_t c = copy_file_range(in, &off, out, NULL, len, 0);
+    if (c < 0 && errno == EINTR) {
+      continue;
+    }
+    if (c <= 0) {
+      break;
+    }
+    len -= c;
+  }
+  char buf[1 << 16];
+  while (len > 0) {
+    ssize_t r = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), off);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0 || write_all(out, buf, r)) {
+      return 1;
+    }
+    off += r;
+    len -= r;
+  }
   return 0;
 }
 
-/* import keyword; print(*keyword.kwlist) */
-static const char *specnames[] = {
-    "and",    "as",    "assert", "break",  "class",   "continue", "def",
-    "del",    "elif",  "else",   "except", "finally", "for",      "from",
-    "global", "if",    "import", "in",     "is",      "lambda",   "nonlocal",
-    "not",    "or",    "pass",   "raise",  "return",  "try",      "while",
-    "with",   "yield", NULL};
-
-static int *spectable = NULL;
-static int *terminal = NULL;
-static void make_special_name_table() {
-  /* string tree uses least memory; this is simpler to debug */
-  int ncodes = 0;
-  int nstates = 0;
-  for (int i = 0; specnames[i]; i++) {
-    nstates += strlen(specnames[i]) + 1;
-    ncodes++;
-  }
-  spectable = (int *)malloc(sizeof(int) * 26 * nstates);
-  terminal = (int *)malloc(sizeof(int) * nstates);
-  /* by default all paths lead one to failure */
-  for (int i = 0; i < 26 * nstates; i++) {
-    spectable[i] = -1;
-  }
-  for (int i = 0; i < nstates; i++) {
-    terminal[i] = 0;
-  }
-  /* fill in table, reusing old paths if available */
-  int gstate = 1;
-  for (int i = 0; i < ncodes; i++) {
-    const char *s = specnames[i];
-    int cstate = 0;
-    for (int k = 0; s[k]; k++) {
-      int cc = s[k] - 'a';
-      if (spectable[26 * cstate + cc] == -1) {
-        spectable[26 * cstate + cc] = gstate;
-        cstate = gstate;
-        gstate++;
-      } else {
-        cstate = spectable[26 * cstate + cc];
-      }
+/* Fill `w->nbuf` with a mkstemp template for a temporary beside `name` */
+static char *temp_name(struct worker *w, const char *name) {
+  int l = strlen(name);
+  if (w->nbuf.len <= (size_t)l + 12)
+    vlbuf_expand(&w->nbuf, l + 12);
+  char *nbuf = w->nbuf.d.ch;
+  strncpy(nbuf, name, l + 1);
+  int co = 0;
+  for (int j = l - 1; j >= 0; j--)
+    if (name[j] == '/') {
+      co = j + 1;
+      break;
     }
-    terminal[cstate] = 1;
+  strncpy(&nbuf[co], ".pfa_XXXXXX", 12);
+  return nbuf;
+}
+
+/* An unnamed file beside the temporary `like`, to hold one piece of it */
+static int scratch_file(const char *like) {
+  char *name = strdup(like);
+  memcpy(&name[strlen(name) - 6], "XXXXXX", 6);
+  int fd = mkstemp(name);
+  if (fd >= 0) {
+    unlink(name);
   }
+  free(name);
+  return fd;
 }
-static void free_special_name_table() {
-  free(spectable);
-  free(terminal);
+
+/* Pass on the output of a piece of a file rewritten in place, which was
+ * cut from `orig`. Only once some piece differs is anything written: the
+ * original up to it, then each piece from its scratch file if it differed
+ * too, or from the original if not. */
+static void rewrite_piece(struct sink *sink, struct piece *pc,
+                          const char *orig, size_t origlen) {
+  int differs = pc->differs;
+  if (pc->fd < 0) {
+    /* there was no scratch file, so the output was kept */
+    differs = pc->len != origlen || memcmp(orig, pc->out.d.ch, pc->len) != 0;
+  }
+  if (differs && !sink->differs) {
+    sink->differs = 1;
+    sink->halted |= write_all(sink->fd, sink->expect, sink->len);
+  }
+  if (!differs) {
+    if (sink->differs) {
+      sink->halted |= write_all(sink->fd, orig, pc->len);
+    }
+  } else if (pc->fd >= 0) {
+    sink->halted |= pc->halted || copy_all(pc->fd, sink->fd, pc->len);
+  } else {
+    sink->halted |= write_all(sink->fd, pc->out.d.ch, pc->len);
+  }
 }
-static int is_special_name(const char *tst) {
-  int fcode = 0;
-  for (int k = 0; tst[k]; k++) {
-    if (tst[k] < 'a' || tst[k] > 'z') {
-      return 0;
+
+/* Format the mapped text of `src` in up to `npieces` pieces: the first on
+ * this thread, into `sink`, and the rest on threads of their own, their
+ * output passed on after it. Each piece is first scanned in parallel, as
+ * if it started where pyformat holds no state; the guesses are checked in
+ * order, and a piece is only scanned again where one was wrong, e.g. when
+ * it starts inside a docstring. Pieces are then cut where pyformat holds
+ * no state, so that together they format as the whole text would. */
+static void format_split(struct worker *w, struct source *src,
+                         struct sink *sink, struct pfa_stats *stats,
+                         int npieces) {
+  struct piece *pcs = (struct piece *)calloc(npieces, sizeof(struct piece));
+  const char *data = src->data, *end = src->end;
+  size_t size = end - data;
+  int n = 1;
+  pcs[0].from = data;
+  for (int k = 1; k < npieces; k++) {
+    const char *p = data + size / npieces * k;
+    p = (const char *)memchr(p, '\n', end - p) + 1;
+    if (p > pcs[n - 1].from && p < end) {
+      pcs[n++].from = p;
     }
-    fcode = spectable[26 * fcode + (tst[k] - 'a')];
-    if (fcode == -1) {
-      return 0;
+  }
+  for (int k = 0; k < n; k++) {
+    pcs[k].to = k + 1 < n ? pcs[k + 1].from : end;
+  }
+  for (int k = 1; k < n; k++) {
+    pcs[k].threaded =
+        pthread_create(&pcs[k].thread, NULL, scan_piece, &pcs[k]) == 0;
+    if (!pcs[k].threaded) {
+      scan_piece(&pcs[k]);
     }
   }
-  return terminal[fcode];
-}
-
-static void pyformat(FILE *file, FILE *out, struct vlbuf *origfile,
-                     struct vlbuf *formfile) {
-  struct vlbuf linebuf = vlbuf_make(sizeof(char));
-  struct vlbuf tokbuf = vlbuf_make(sizeof(char));
-  struct vlbuf toks = vlbuf_make(sizeof(int));
-  struct vlbuf laccum = vlbuf_make(sizeof(char));
-  struct vlbuf splitpoints = vlbuf_make(sizeof(int));
-  struct vlbuf split_ratings = vlbuf_make(sizeof(int));
-  struct vlbuf split_nestings = vlbuf_make(sizeof(int));
-  struct vlbuf lineout = vlbuf_make(sizeof(char));
-
-  char *tokd = NULL;
-  char *stokd = NULL;
-  int ntoks = 0;
-
-  char string_starter = '\0';
-  int line_state = LINE_IS_NORMAL;
-  int leading_spaces = 0;
-  int nestings = 0;
-  int netlen = 0;
-  int origfilelen = 0;
-  int formfilelen = 0;
-  int no_more_lines = 0;
-  while (1) {
-    int llen = 0;
-    {
-      char *readct;
-      while (1) {
-        readct = fgets(&linebuf.d.ch[llen], linebuf.len - 3 - llen, file);
-        if (!readct)
-          break;
-        int rlen = strlen(readct);
-        if (feof(file) && readct[rlen - 1] != '\n') {
-          /* if file ends, preserve line invariants by adding newline */
-          readct[rlen] = '\n';
-          readct[rlen + 1] = '\0';
-          rlen++;
-          no_more_lines = 1;
-        }
-        if (origfile) {
-          if (origfile->len < rlen + origfilelen)
-            vlbuf_expand(origfile, rlen + origfilelen);
-          memcpy(&origfile->d.ch[origfilelen], &linebuf.d.ch[llen], rlen + 1);
-          origfilelen += rlen;
-        }
-        llen += rlen;
+  scan_piece(&pcs[0]);
+  /* where the piece before ended in state `c`, the guess was right */
+  const char **cuts = (const char **)malloc(sizeof(char *) * (n + 1));
+  int m = 0;
+  cuts[m++] = data;
+  for (int k = 1; k < n; k++) {
+    if (pcs[k].threaded) {
+      pthread_join(pcs[k].thread, NULL);
+    }
+    if (!carry_clean(&pcs[k - 1].carry)) {
+      pcs[k].carry = pcs[k - 1].carry;
+      pcs[k].cut = scan_cuts(&pcs[k].carry, pcs[k].from, pcs[k].to);
+    }
+    if (pcs[k].cut) {
+      cuts[m++] = pcs[k].cut;
+    }
+  }
+  cuts[m] = end;
 
-        if (linebuf.d.ch[llen - 1] != '\n') {
-          vlbuf_expand(&linebuf, llen + 3);
-        } else {
-          break;
-        }
+  for (int j = 1; j < m; j++) {
+    struct piece *pc = &pcs[j];
+    pc->src.fd = -1;
+    pc->src.data = cuts[j];
+    pc->src.end = cuts[j + 1];
+    pc->src.added_newline = j == m - 1 ? src->added_newline : 0;
+    pc->out = vlbuf_make(sizeof(char));
+    pc->fd = sink->kind == SINK_REWRITE ? scratch_file(w->nbuf.d.ch) : -1;
+    pc->wrap = w->ctx.wrap;
+    if (stats) {
+      pc->stats = (struct pfa_stats *)calloc(1, sizeof(struct pfa_stats));
+    }
+    pc->threaded = pthread_create(&pc->thread, NULL, format_piece, pc) == 0;
+    if (!pc->threaded) {
+      format_piece(pc);
+    }
+  }
+  int added_newline = src->added_newline;
+  size_t expectlen = sink->expectlen;
+  src->end = cuts[1];
+  src->added_newline = m == 1 ? added_newline : 0;
+  if (m > 1) {
+    sink->expectlen = cuts[1] - data;
+  }
+  format_with(&w->ctx, src, NULL, sink, stats);
+  src->end = end;
+  src->added_newline = added_newline;
+  sink->expectlen = expectlen;
+  for (int j = 1; j < m; j++) {
+    struct piece *pc = &pcs[j];
+    if (pc->threaded) {
+      pthread_join(pc->thread, NULL);
+    }
+    if (sink->kind == SINK_BUF) {
+      vlbuf_append(sink->buf, pc->out.d.ch, pc->len, sink->len);
+    } else if (sink->kind == SINK_REWRITE) {
+      rewrite_piece(sink, pc, cuts[j],
+                    pc->src.end - pc->src.added_newline - cuts[j]);
+    } else {
+      if (sink->expect && !sink->differs) {
+        size_t origlen = pc->src.end - pc->src.added_newline - cuts[j];
+        sink->differs = pc->len != origlen ||
+                        memcmp(cuts[j], pc->out.d.ch, pc->len) != 0;
       }
+      write_all(sink->fd, pc->out.d.ch, pc->len);
+    }
+    sink->len += pc->len;
+    if (pc->fd >= 0) {
+      close(pc->fd);
+    }
+    vlbuf_free(&pc->out);
+    if (stats) {
+      stats_add(stats, pc->stats);
+      free(pc->stats);
+    }
+  }
+  free(cuts);
+  free(pcs);
+}
 
-      if (!readct) {
-        break;
-      }
+static void format_into(struct worker *w, struct source *src,
+                        struct vlbuf *origfile, struct sink *sink,
+                        struct pfa_stats *stats, int npieces) {
+  if (npieces > 1) {
+    format_split(w, src, sink, stats, npieces);
+  } else {
+    format_with(&w->ctx, src, origfile, sink, stats);
+  }
+}
+
+/* Format one file. When `out` is null and not in place, the formatted
+ * text is held in the job until it is reported. */
+static void format_job(struct job *job, struct worker *w,
+                       const struct settings *set, FILE *out) {
+  const char *name = job->name;
+  /* "-" is standard input, which is streamed, never mapped, and never
+   * written in place */
+  int isstdin = strcmp(name, "-") == 0;
+  int inplace = set->inplace && !isstdin;
+  /* notebooks and Markdown are only formatted whole, and in place */
+  int embedded = embed_kind(name);
+  w->ctx.wrap = set->wrap;
+  if (embedded && set->first) {
+    job->status |= JOB_NOLINES;
+    return;
+  }
+  /* text read ahead by the I/O engine is used as a mapping would be */
+  int preloaded = job->input != NULL;
+  struct pfa_stats *stats = job->stats;
+  uint64_t t = 0;
+  if (set->stats) {
+    if (!stats) {
+      stats = job->stats =
+          (struct pfa_stats *)calloc(1, sizeof(struct pfa_stats));
+    }
+    t = stats_clock();
+  }
+  int fd = preloaded ? -1 : isstdin ? STDIN_FILENO : open(name, O_RDONLY);
+  if (fd < 0 && !preloaded) {
+    job->status |= JOB_DNE;
+    return;
+  }
+  struct source src;
+  memset(&src, 0, sizeof(src));
+  src.fd = -1;
+  struct stat st;
+  char *map = NULL;
+  size_t maplen = 0;
+  int regular;
+  if (preloaded) {
+    regular = 1;
+    st.st_size = job->inlen;
+    map = job->input;
+    src.added_newline = job->added_newline;
+  } else {
+    regular = !isstdin && fstat(fd, &st) == 0;
+    if (regular && job->engine) {
+      job->havestat = 1;
+      job->mode = st.st_mode;
+      job->uid = st.st_uid;
+      job->gid = st.st_gid;
+    }
+    regular = regular && S_ISREG(st.st_mode);
+    if (regular && st.st_size > 0) {
+      map = map_input(fd, st.st_size, &maplen, &src.added_newline);
     }
+  }
+  if (map) {
+    src.data = map;
+    src.end = map + st.st_size + src.added_newline;
+    src.first = set->first;
+    src.last = set->last;
+  } else if ((set->first || embedded) && !(regular && st.st_size == 0)) {
+    /* ranges are found in place, which streams do not allow */
+    job->status |= embedded ? JOB_NOEMBED : JOB_NOLINES;
+    if (!isstdin) {
+      close(fd);
+    }
+    return;
+  } else {
+    src.fd = fd;
+  }
+  if (stats) {
+    stats->ns_read += stats_clock() - t;
+  }
 
-    if (line_state == LINE_IS_NORMAL || line_state == LINE_IS_BLANK) {
-      netlen = llen;
-      ntoks = 0;
-      /* Ensure buffers can hold the worst case line */
-      if (tokbuf.len < netlen * 2) {
-        vlbuf_expand(&tokbuf, netlen * 2);
-        vlbuf_expand(&toks, netlen * 2);
-      }
-      tokd = tokbuf.d.ch;
-      stokd = tokbuf.d.ch;
-      nestings = 0;
-    } else {
-      /* Adjust buffers in the case of line extension */
-      netlen += llen;
-      int tokdoff = tokd - tokbuf.d.ch;
-      int stokdoff = stokd - tokbuf.d.ch;
-      if (tokbuf.len < netlen * 2) {
-        vlbuf_expand(&tokbuf, netlen * 2);
-        vlbuf_expand(&toks, netlen * 2);
+  uint64_t hash = 0;
+  if (map && set->cache) {
+    hash = cache_hash(map, st.st_size);
+    if (cache_has(set->cache, hash, st.st_size)) {
+      /* Already formatted, so the output is the input */
+      if (stats) {
+        stats->bytes_in += st.st_size;
+        stats->bytes_out += st.st_size;
       }
-      tokd = &tokbuf.d.ch[tokdoff];
-      stokd = &tokbuf.d.ch[stokdoff];
-    }
-
-    /* token-split the line with NULL characters; double NULL is eof */
-
-    /* Tokenizer state machine */
-    char *cur = linebuf.d.ch;
-    /* space char gives room for termination checks */
-    if (llen > 0)
-      cur[llen - 1] = '\n';
-    cur[llen] = '\0';
-    cur[llen + 1] = '\0';
-
-    int is_whitespace = 1;
-    for (char *c = cur; *c != '\n'; ++c)
-      if (*c != ' ' && *c != '\t')
-        is_whitespace = 0;
-
-    int dumprest = 0;
-    if (line_state == LINE_IS_TRISTR) {
-      /* tristrings are unaffected by blank lines */
-    } else if (is_whitespace) {
-      if (line_state == LINE_IS_CONTINUATION) {
-        line_state = LINE_IS_BLANK;
-        dumprest = 1;
-      } else if (line_state == LINE_IS_BLANK) {
-        continue;
+      if (inplace || set->check) {
+        /* nothing to write */
+      } else if (out) {
+        fwrite(map, 1, st.st_size, out);
       } else {
-        line_state = LINE_IS_BLANK;
+        job->output = vlbuf_make(sizeof(char));
+        vlbuf_append(&job->output, map, st.st_size, 0);
+        job->outlen = st.st_size;
       }
-    } else if (line_state == LINE_IS_BLANK) {
-      line_state = LINE_IS_NORMAL;
+      if (!preloaded) {
+        munmap(map, maplen);
+        close(fd);
+      }
+      return;
+    }
+  }
+
+  /* Large files may be formatted in pieces; a range is formatted whole */
+  int npieces = 1;
+  if (map && !set->first && !embedded) {
+    npieces += borrow_threads(set, st.st_size);
+  }
+
+  /* Large files rewritten in place go straight to the temporary */
+  int rewrite = -1;
+  if (inplace && !set->check && map && !preloaded && !embedded &&
+      st.st_size >= REWRITE_MIN) {
+    if (stats) {
+      t = stats_clock();
     }
+    rewrite = mkstemp(temp_name(w, name));
+    if (stats) {
+      stats->ns_commit += stats_clock() - t;
+    }
+  }
 
-    if (line_state == LINE_IS_NORMAL) {
-      leading_spaces = 0;
-      for (; cur[0] == '\n' || cur[0] == ' ' || cur[0] == '\t'; cur++) {
-        leading_spaces++;
+  /* Format file contents, saving to stdout or to buffers */
+  struct sink sink;
+  memset(&sink, 0, sizeof(sink));
+  if (embedded && map) {
+    /* the code in the file is formatted piece by piece, into a buffer */
+    if (inplace || set->check || out) {
+      sink.len = embed_format(&w->embed, &w->ctx, embedded, map, st.st_size,
+                              &w->formfile);
+      if (!inplace && !set->check) {
+        fwrite(w->formfile.d.ch, 1, sink.len, out);
       }
     } else {
+      job->output = vlbuf_make(sizeof(char));
+      sink.len = embed_format(&w->embed, &w->ctx, embedded, map, st.st_size,
+                              &job->output);
+      job->outlen = sink.len;
     }
+    if (stats) {
+      stats->bytes_in += st.st_size;
+      stats->bytes_out += sink.len;
+    }
+  } else if (set->check && map && !set->diff && npieces == 1) {
+    /* compare as the output is made; no copy is kept */
+    sink.kind = SINK_EXPECT;
+    sink.expect = map;
+    sink.expectlen = st.st_size;
+    format_into(w, &src, 0, &sink, stats, npieces);
+  } else if (rewrite >= 0) {
+    /* compare as the output is made, writing only from the first
+     * difference; memory does not grow with the file */
+    sink.kind = SINK_REWRITE;
+    sink.fd = rewrite;
+    sink.expect = map;
+    sink.expectlen = st.st_size;
+    format_into(w, &src, 0, &sink, stats, npieces);
+  } else if (inplace || set->check) {
+    sink.buf = &w->formfile;
+    format_into(w, &src, map ? 0 : &w->origfile, &sink, stats, npieces);
+  } else if (out) {
+    /* bypass stdio; whatever it holds goes first */
+    fflush(out);
+    sink.kind = SINK_FD;
+    sink.fd = fileno(out);
+    if (set->cache && map) {
+      /* to learn whether the text formats to itself */
+      sink.expect = map;
+      sink.expectlen = st.st_size;
+    }
+    format_into(w, &src, 0, &sink, stats, npieces);
+  } else {
+    job->output = vlbuf_make(sizeof(char));
+    sink.buf = &job->output;
+    format_into(w, &src, 0, &sink, stats, npieces);
+    job->outlen = sink.len;
+  }
+  size_t formlen = sink.len;
+  if (npieces > 1) {
+    __atomic_add_fetch(set->spare, npieces - 1, __ATOMIC_RELAXED);
+  }
 
-    int proctok = TOK_INBETWEEN;
-    if (line_state == LINE_IS_TRISTR) {
-      proctok = TOK_TRISTR;
-      --ntoks;
-      --tokd;
+  int unchanged = 0;
+  if (sink.expect) {
+    unchanged = !sink.differs;
+  } else if (inplace || set->check) {
+    /* Compare against the mapping directly; no copy of the original */
+    if (map) {
+      unchanged = formlen == (size_t)st.st_size &&
+                  memcmp(map, w->formfile.d.ch, formlen) == 0;
+    } else {
+      unchanged = strcmp(w->origfile.d.ch, w->formfile.d.ch) == 0;
     }
+  } else if (map && set->cache && job->output.d.vd) {
+    unchanged = formlen == (size_t)st.st_size &&
+                memcmp(map, job->output.d.ch, formlen) == 0;
+  }
+  /* Only record text seen to format to itself, as a whole; formatting
+   * freshly written output is not guaranteed to be a no-op */
+  if (unchanged && map && set->cache && !set->first) {
+    cache_add(set->cache, hash, st.st_size);
+  }
+  if (src.failed) {
+    job->status |= JOB_NOREAD;
+    unchanged = 1;
+  }
+  if (set->diff && !unchanged) {
+    const char *orig = map ? map : w->origfile.d.ch;
+    size_t origlen = map ? (size_t)st.st_size : src.origlen;
+    if (out) {
+      size_t n = diff_unified(&w->differ, name, orig, origlen,
+                              w->formfile.d.ch, formlen, &w->difftext, 0);
+      fwrite(w->difftext.d.ch, 1, n, out);
+    } else {
+      job->output = vlbuf_make(sizeof(char));
+      job->outlen = diff_unified(&w->differ, name, orig, origlen,
+                                 w->formfile.d.ch, formlen, &job->output, 0);
+    }
+  }
+  if (!preloaded) {
+    if (map) {
+      munmap(map, maplen);
+    }
+    if (!isstdin) {
+      close(fd);
+    }
+  }
 
-    char *eolpos = &cur[strlen(cur) - 1];
-    char lopchar = '\0';
-    int numlen = 0;
-    int nstrescps = 0;
-    int nstrleads = 0;
-    for (; cur[0]; cur++) {
-      /* main tokenizing loop */
-      if (cur[0] == '\t') {
-        cur[0] = ' ';
+  if (set->check) {
+    if (!unchanged) {
+      job->status |= set->diff ? JOB_DIFF : JOB_CHANGED;
+    }
+  } else if (inplace) {
+    if (rewrite >= 0 && (unchanged || sink.halted)) {
+      /* the original stays */
+      close(rewrite);
+      unlink(w->nbuf.d.ch);
+      if (sink.halted) {
+        job->status |= JOB_NOWRITE;
       }
-      int inside_string = proctok == TOK_STRING || proctok == TOK_TRISTR;
-      if (!inside_string && cur[0] == ' ' && cur[1] == ' ') {
-        continue;
+    } else if (unchanged) {
+      /* Do nothing */
+    } else if (job->engine && rewrite < 0) {
+      /* the I/O engine writes it back, taking the buffer */
+      job->output = w->formfile;
+      job->outlen = formlen;
+      job->commit = 1;
+      w->formfile = vlbuf_make(sizeof(char));
+    } else {
+      /* Write to temporary, unless already written */
+      if (stats) {
+        t = stats_clock();
       }
-      /* single space is a token boundary ... */
-      char nxt = *cur;
-      int ignore = 0;
-      int tokfin = 0;
-      int otok = proctok;
-      switch (proctok) {
-      case TOK_SPECIAL:
-      case TOK_LABEL: {
-        if (isalpha_lead(nxt) || ('0' <= nxt && nxt <= '9')) {
-        } else if (nxt == '\'' || nxt == '\"') {
-          /* String with prefix */
-          proctok = TOK_STRING;
-          nstrleads = 1;
-          string_starter = nxt;
-        } else {
-          tokfin = 1;
-          proctok = TOK_INBETWEEN;
-          ignore = 1;
-          cur--;
+      int fo = rewrite;
+      int failed = 0;
+      if (fo < 0) {
+        fo = mkstemp(temp_name(w, name));
+        uint64_t opened = stats ? stats_clock() : 0;
+        failed = fo < 0 || write_all(fo, w->formfile.d.ch, formlen);
+        if (stats) {
+          uint64_t now = stats_clock();
+          stats->ns_write += now - opened;
+          stats->ns_commit += opened - t;
+          t = now;
         }
-      } break;
-      case TOK_DOT:
-      case TOK_NUMBER: {
-        /* We don't care about the number itself, just that things stay
-         * numberish */
-        int isdot = (numlen == 1) && cur[-1] == '.' && !isnumeric_lead(nxt);
-        if (!isdot && isnumeric_lead(nxt)) {
-        } else if (cur[-1] == 'e' && (nxt == '-' || nxt == '+')) {
-        } else if (!isdot && (nxt == 'e' || nxt == 'x')) {
-        } else {
-          if (cur[-1] == '.' && numlen == 1)
-            otok = TOK_DOT;
+      }
+      if (fo >= 0 && close(fo) < 0) {
+        failed = 1;
+      }
+      char *nbuf = w->nbuf.d.ch;
 
-          tokfin = 1;
-          proctok = TOK_INBETWEEN;
-          ignore = 1;
-          cur--;
+      if (failed) {
+        /* the original stays */
+        if (fo >= 0) {
+          unlink(nbuf);
         }
-        numlen++;
-      } break;
-      case TOK_STRING: {
-        /* The fun one */
-        int ffin = 0;
-        if (nxt == string_starter) {
-          nstrleads++;
-        } else {
-          if (nstrleads == 2) {
-            /* implicitly to the end */
-            ffin = 1;
-            cur--;
-            ignore = 1;
-          } else {
-            nstrleads = 0;
-          }
-        }
-        if (nstrleads == 3) {
-          proctok = TOK_TRISTR;
-          nstrleads = 0;
-          nstrescps = 0;
-        } else if (!ffin && nstrleads == 2) {
-          /* doubled */
-        } else if ((nxt != string_starter ||
-                    (nstrescps % 2 == 1 && nxt == string_starter)) &&
-                   !ffin) {
-          if (nxt == '\\') {
-            nstrescps++;
-          } else {
-            nstrescps = 0;
-          }
-        } else {
-          tokfin = 1;
-          proctok = TOK_INBETWEEN;
-        }
-      } break;
-      case TOK_TRISTR: {
-        /* Only entry this once we've been in TOK_STRING */
-        if (nxt == string_starter && nstrescps % 2 == 0) {
-          nstrleads++;
-        } else {
-          nstrleads = 0;
-        }
-        if ((nxt != string_starter ||
-             (nstrescps % 2 == 1 && nxt == string_starter))) {
-          if (nxt == '\\') {
-            nstrescps++;
-          } else {
-            nstrescps = 0;
-          }
-        }
-        if (nstrleads == 3) {
-          tokfin = 1;
-          proctok = TOK_INBETWEEN;
-        }
-      } break;
-      case TOK_OBRACE: {
-        /* Single character */
-        tokfin = 1;
-        proctok = TOK_INBETWEEN;
-      } break;
-      case TOK_CBRACE: {
-        /* Single character */
-        tokfin = 1;
-        proctok = TOK_INBETWEEN;
-      } break;
-      case TOK_COMMENT: {
-        /* do nothing because comment goes to EOL */
-      } break;
-      case TOK_EQUAL:
-      case TOK_EXP:
-      case TOK_UNARYOP:
-      case TOK_OPERATOR: {
-        /* Operator handles subtypes */
-        if (lopchar == '\0' && isoptype(nxt)) {
-        } else if (lopchar == '*' && nxt == '*') {
-          proctok = TOK_EXP;
-        } else if (lopchar == '/' && nxt == '/') {
-        } else if (lopchar == '>' && nxt == '>') {
-        } else if (lopchar == '<' && nxt == '<') {
-        } else if (nxt == '=') {
-          if (proctok == TOK_EXP) {
-            proctok = TOK_OPERATOR;
-          }
+        job->status |= JOB_NOWRITE;
+      } else {
+        /* Ensure properties match */
+        struct stat st;
+        if (stat(name, &st) < 0) {
+          job->status |= JOB_NOSTAT;
         } else {
-          if (proctok != TOK_EXP) {
-            if (lopchar == '-' || lopchar == '+' || lopchar == '*') {
-              otok = TOK_UNARYOP;
-            }
-            if (lopchar == '=' && !isoptype(cur[-2])) {
-              otok = TOK_EQUAL;
-            }
-          }
-          tokfin = 1;
-          proctok = TOK_INBETWEEN;
-          ignore = 1;
-          cur--;
+          chmod(nbuf, st.st_mode);
+          chown(nbuf, st.st_uid, st.st_gid);
         }
-        lopchar = nxt;
-      } break;
-      case TOK_COMMA: {
-        /* Single character */
-        tokfin = 1;
-        proctok = TOK_INBETWEEN;
-      } break;
-      case TOK_COLON: {
-        /* Single character */
-        tokfin = 1;
-        proctok = TOK_INBETWEEN;
-      } break;
-      case TOK_LCONT: {
-        /* Single character */
-        tokfin = 1;
-        proctok = TOK_INBETWEEN;
-      } break;
-      case TOK_INBETWEEN: {
-        ignore = 1;
-        if (nxt == '#') {
-          proctok = TOK_COMMENT;
-          /* nix the terminating newline */
-          linebuf.d.ch[llen - 1] = ' ';
-        } else if (nxt == '"' || nxt == '\'') {
-          string_starter = nxt;
-          proctok = TOK_STRING;
-          ignore = 0;
-          nstrescps = 0;
-          nstrleads = 1;
-        } else if (isoptype(nxt)) {
-          lopchar = '\0';
-          proctok = TOK_OPERATOR;
-          cur--;
-        } else if (nxt == ',') {
-          proctok = TOK_COMMA;
-          cur--;
-        } else if (nxt == ':') {
-          proctok = TOK_COLON;
-          cur--;
-        } else if (nxt == '(' || nxt == '[' || nxt == '{') {
-          proctok = TOK_OBRACE;
-          cur--;
-        } else if (nxt == ')' || nxt == ']' || nxt == '}') {
-          proctok = TOK_CBRACE;
-          cur--;
-        } else if (nxt == '\\') {
-          proctok = TOK_LCONT;
-          cur--;
-        } else if (isalpha_lead(nxt)) {
-          proctok = TOK_LABEL;
-          cur--;
-        } else if (isnumeric_lead(nxt)) {
-          numlen = 0;
-          proctok = TOK_NUMBER;
-          cur--;
+
+        int s = rename(nbuf, name);
+        if (s) {
+          job->status |= JOB_NORENAME;
+          job->tmpname = strdup(nbuf);
+          remove(nbuf);
         }
-      } break;
       }
-
-      if (!ignore) {
-        *tokd = *cur;
-        tokd++;
+      if (stats) {
+        stats->ns_commit += stats_clock() - t;
       }
+    }
+  }
+}
 
-      if (cur == eolpos && otok != TOK_INBETWEEN) {
-        tokfin = 1;
-      }
+/* Print deferred output and errors; returns nonzero if the file was lost,
+ * or would be changed by --check or --diff */
+static int report_result(struct job *job) {
+  if (job->status & JOB_DNE) {
+    logerr(3, "File ", job->name, " dne\n");
+    return 1;
+  }
+  if (job->status & JOB_NOLINES) {
+    logerr(3, "Cannot format --lines of ", job->name,
+           embed_kind(job->name) ? ", not a Python file\n"
+                                 : ", not a regular file\n");
+    return 1;
+  }
+  if (job->status & JOB_NOEMBED) {
+    logerr(3, "Cannot format ", job->name, ", not a regular file\n");
+    return 1;
+  }
+  if (job->status & JOB_CHANGED) {
+    fputs(job->name, stdout);
+    fputc('\n', stdout);
+    return 1;
+  }
+  if (job->status & JOB_NOSTAT) {
+    logerr(3, "Could not get original permissions for ", job->name, "\n");
+  }
+  if (job->status & JOB_NORENAME) {
+    logerr(5, "Failed to overwrite ", job->name, " with ", job->tmpname, "\n");
+    free(job->tmpname);
+  }
+  if (job->output.d.vd) {
+    fwrite(job->output.d.ch, 1, job->outlen, stdout);
+    vlbuf_free(&job->output);
+  }
+  if (job->status & JOB_NOREAD) {
+    logerr(3, "Could not read ", job->name, "\n");
+    return 1;
+  }
+  if (job->status & JOB_NOWRITE) {
+    logerr(3, "Could not write ", job->name, ", left unchanged\n");
+    return 1;
+  }
+  return (job->status & JOB_DIFF) != 0;
+}
 
-      if (tokfin) {
-        *tokd = '\0';
-        ++tokd;
-        /* convert label to special if it's a word in a list we have */
-        if (otok == TOK_LABEL && is_special_name(stokd)) {
-          otok = TOK_SPECIAL;
-        }
-        if (otok == TOK_OBRACE) {
-          nestings++;
-        } else if (otok == TOK_CBRACE) {
-          nestings--;
-        }
-        toks.d.in[ntoks] = otok;
-        stokd = tokd;
-        ntoks++;
-      }
+/* Append printf-style text to the JSON being built in `b` */
+static size_t json_put(struct vlbuf *b, size_t len, const char *fmt, ...) {
+  va_list alist;
+  va_start(alist, fmt);
+  int n = vsnprintf(&b->d.ch[len], b->len - len, fmt, alist);
+  va_end(alist);
+  if ((size_t)n >= b->len - len) {
+    vlbuf_expand(b, len + n + 1);
+    va_start(alist, fmt);
+    vsnprintf(&b->d.ch[len], b->len - len, fmt, alist);
+    va_end(alist);
+  }
+  return len + n;
+}
+
+static size_t json_string(struct vlbuf *b, size_t len, const char *s) {
+  len = json_put(b, len, "\"");
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      len = json_put(b, len, "\\%c", c);
+    } else if (c < 0x20) {
+      len = json_put(b, len, "\\u%04x", c);
+    } else {
+      len = json_put(b, len, "%c", c);
+    }
+  }
+  return json_put(b, len, "\"");
+}
+
+/* Append `"key":n`, after a comma unless `len` is just past a brace */
+static size_t json_field(struct vlbuf *b, size_t len, const char *key,
+                         uint64_t n) {
+  const char *sep = b->d.ch[len - 1] == '{' ? "" : ",";
+  return json_put(b, len, "%s\"%s\":%" PRIu64, sep, key, n);
+}
+
+/* Write one line of --stats output: a file's counts, or the total */
+static void print_stats(const char *name, const struct pfa_stats *s) {
+  struct vlbuf b = vlbuf_make(sizeof(char));
+  vlbuf_expand(&b, 1024);
+  size_t len;
+  if (name) {
+    len = json_put(&b, 0, "{\"file\":");
+    len = json_string(&b, len, name);
+  } else {
+    len = json_put(&b, 0, "{\"total\":{");
+    len = json_field(&b, len, "files", s->files);
+  }
+  len = json_field(&b, len, "bytes_in", s->bytes_in);
+  len = json_field(&b, len, "bytes_out", s->bytes_out);
+  len = json_field(&b, len, "lines", s->lines);
+  len = json_field(&b, len, "logical_lines", s->logical_lines);
+  len = json_put(&b, len, ",\"tokens\":{");
+  for (int i = 0; i < STATS_TOKENS; i++) {
+    if (s->tokens[i]) {
+      len = json_field(&b, len, tok_to_string(i), s->tokens[i]);
+    }
+  }
+  len = json_put(&b, len, "}");
+  len = json_field(&b, len, "splits", s->splits);
+  len = json_field(&b, len, "breaks", s->breaks);
+  len = json_field(&b, len, "regrowths", s->regrowths);
+  len = json_field(&b, len, "peak_scratch", s->peak_scratch);
+  len = json_field(&b, len, "peak_output", s->peak_output);
+  len = json_put(&b, len, ",\"ns\":{");
+  len = json_field(&b, len, "read", s->ns_read);
+  len = json_field(&b, len, "tokenize", s->ns_tokenize);
+  len = json_field(&b, len, "spacing", s->ns_spacing);
+  len = json_field(&b, len, "wrap", s->ns_wrap);
+  len = json_field(&b, len, "write", s->ns_write);
+  len = json_field(&b, len, "commit", s->ns_commit);
+  len = json_put(&b, len, name ? "}}\n" : "}}}\n");
+  write(STDERR_FILENO, b.d.ch, len);
+  vlbuf_free(&b);
+}
+
+/* report_result, followed with --stats by the file's counts */
+static int report_job(struct job *job, const struct settings *set) {
+  if (!set->stats || !job->stats) {
+    return report_result(job);
+  }
+  struct pfa_stats *s = job->stats;
+  uint64_t t = stats_clock();
+  int ret = report_result(job);
+  s->ns_write += stats_clock() - t;
+  print_stats(job->name, s);
+  stats_add(set->stats, s);
+  free(s);
+  job->stats = NULL;
+  return ret;
+}
+
+/* Work-stealing deque of jobs. The owner takes from the head, where the
+ * largest files are, and thieves take from the tail. */
+struct deque {
+  pthread_mutex_t lock;
+  struct job **items;
+  int head;
+  int tail;
+  int cap;
+};
+
+struct engine;
+static void engine_add(struct engine *e, struct job *job);
+static void engine_return(struct engine *e, struct job *job);
+
+/* Formatting threads. Jobs may be submitted while they run, e.g. as a
+ * directory walk finds files. */
+struct pool {
+  int nthreads;
+  const struct settings *set;
+  /* if set, jobs are submitted through it, and handed back to it */
+  struct engine *engine;
+  struct deque *queues;
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  /* jobs submitted but not yet taken */
+  int queued;
+  int open;
+  int next;
+  /* every submitted job, for reporting */
+  struct job **all;
+  int nall;
+  int maxall;
+};
+
+struct thread_arg {
+  struct pool *pool;
+  int id;
+};
+
+static struct job *deque_pop(struct deque *q, int from_head) {
+  struct job *r = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail) {
+    r = from_head ? q->items[q->head++] : q->items[--q->tail];
+  }
+  pthread_mutex_unlock(&q->lock);
+  return r;
+}
+
+static void deque_push(struct deque *q, struct job *job) {
+  pthread_mutex_lock(&q->lock);
+  if (q->tail == q->cap) {
+    /* slide live entries down before growing */
+    if (q->head > 0) {
+      memmove(q->items, &q->items[q->head],
+              sizeof(struct job *) * (q->tail - q->head));
+      q->tail -= q->head;
+      q->head = 0;
+    }
+    if (q->tail >= q->cap / 2) {
+      q->cap = q->cap ? 2 * q->cap : 16;
+      q->items =
+          (struct job **)realloc(q->items, sizeof(struct job *) * q->cap);
+    }
+  }
+  q->items[q->tail++] = job;
+  pthread_mutex_unlock(&q->lock);
+}
+
+static struct job *take_job(struct pool *pool, int id) {
+  while (1) {
+    struct job *r = deque_pop(&pool->queues[id], 1);
+    for (int v = 1; !r && v < pool->nthreads; v++) {
+      r = deque_pop(&pool->queues[(id + v) % pool->nthreads], 0);
+    }
+    if (r) {
+      __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+      return r;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (pool->open &&
+           __atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0) {
+      pthread_cond_wait(&pool->work_cond, &pool->lock);
+    }
+    int finished =
+        !pool->open && __atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (finished) {
+      return NULL;
     }
-    *tokd = '\0';
+  }
+}
+
+static void job_done(struct pool *pool, struct job *job) {
+  pthread_mutex_lock(&pool->lock);
+  job->done = 1;
+  pthread_cond_broadcast(&pool->done_cond);
+  pthread_mutex_unlock(&pool->lock);
+}
 
-    /* determine if the next line shall continue this one */
-    if (line_state == LINE_IS_BLANK) {
-      line_state = LINE_IS_BLANK;
-    } else if (proctok == TOK_TRISTR) {
-      line_state = LINE_IS_TRISTR;
-    } else if ((ntoks > 0 && toks.d.in[ntoks - 1] == TOK_LCONT) ||
-               nestings > 0) {
-      line_state = LINE_IS_CONTINUATION;
+static void *pool_thread(void *varg) {
+  struct thread_arg *arg = (struct thread_arg *)varg;
+  struct pool *pool = arg->pool;
+  struct worker w;
+  worker_init(&w);
+  struct job *job;
+  while ((job = take_job(pool, arg->id))) {
+    format_job(job, &w, pool->set, 0);
+    if (job->engine) {
+      engine_return(pool->engine, job);
     } else {
-      line_state = LINE_IS_NORMAL;
-    }
-
-    if (line_state == LINE_IS_BLANK && !dumprest) {
-      formfilelen = vlbuf_append(formfile, "\n", 1, formfilelen, out);
-    } else if (line_state == LINE_IS_NORMAL || no_more_lines || dumprest) {
-      /* Introduce spaces to list */
-
-      /* split ratings 0 is regular; -1 is force/cmt; 1 is weak */
-      if (laccum.len < 2 * netlen) {
-        vlbuf_expand(&laccum, 2 * netlen);
-        vlbuf_expand(&splitpoints, 2 * netlen);
-        vlbuf_expand(&split_ratings, 2 * netlen);
-        vlbuf_expand(&split_nestings, 2 * netlen);
-        vlbuf_expand(&lineout, 2 * netlen);
-        vlbuf_expand(&laccum, 2 * netlen);
-      }
+      job_done(pool, job);
+    }
+  }
+  worker_free(&w);
+  free(arg);
+  return NULL;
+}
 
-      int nsplits = 0;
-      char *buildpt = laccum.d.ch;
-
-      /* Line wrapping & printing, oh joy */
-      char *tokpos = tokbuf.d.ch;
-      char *ntokpos = tokpos;
-      int nests = 0;
-      int pptok = TOK_INBETWEEN;
-      int pretok = TOK_INBETWEEN;
-      int postok = toks.d.in[0];
-      for (int i = 0; i < ntoks; i++) {
-        ntokpos += strlen(ntokpos) + 1;
-        while (toks.d.in[i + 1] == TOK_LCONT && i < ntoks) {
-          ntokpos += strlen(ntokpos) + 1;
-          i++;
-        }
+static void pool_start(struct pool *pool, int nthreads,
+                       const struct settings *set) {
+  pool->nthreads = nthreads;
+  pool->set = set;
+  pool->engine = NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+  pool->queued = 0;
+  pool->open = 1;
+  pool->next = 0;
+  pool->all = NULL;
+  pool->nall = 0;
+  pool->maxall = 0;
+  pool->queues = (struct deque *)calloc(nthreads, sizeof(struct deque));
+  for (int t = 0; t < nthreads; t++) {
+    pthread_mutex_init(&pool->queues[t].lock, NULL);
+  }
+  pool->threads = (pthread_t *)malloc(sizeof(pthread_t) * nthreads);
+  for (int t = 0; t < nthreads; t++) {
+    struct thread_arg *arg =
+        (struct thread_arg *)malloc(sizeof(struct thread_arg));
+    arg->pool = pool;
+    arg->id = t;
+    pthread_create(&pool->threads[t], NULL, pool_thread, arg);
+  }
+}
 
-        pptok = pretok;
-        pretok = postok;
-        postok = toks.d.in[i + 1];
+/* Hand out jobs round-robin; submitting in decreasing size order puts
+ * the largest files at the head of every deque */
+static void pool_submit(struct pool *pool, struct job *job) {
+  pthread_mutex_lock(&pool->lock);
+  int t = pool->next;
+  pool->next = (pool->next + 1) % pool->nthreads;
+  if (pool->nall == pool->maxall) {
+    pool->maxall = pool->maxall ? 2 * pool->maxall : 64;
+    pool->all = (struct job **)realloc(pool->all,
+                                       sizeof(struct job *) * pool->maxall);
+  }
+  pool->all[pool->nall++] = job;
+  pthread_mutex_unlock(&pool->lock);
 
-        if (pretok == TOK_OBRACE) {
-          nests++;
-        }
+  deque_push(&pool->queues[t], job);
 
-        if (pretok == TOK_COMMENT) {
-          int toklen = strlen(tokpos);
-          char *eos = tokpos + toklen - 1;
-          char *sos = tokpos;
-          while (*sos == ' ') {
-            sos++;
-          }
-          while (*eos == ' ') {
-            *eos = '\0';
-            eos--;
-          }
-          if (sos[0] == '!' || sos > eos) {
-            *buildpt++ = '#';
-          } else {
-            *buildpt++ = '#';
-            *buildpt++ = ' ';
-          }
-          buildpt += strapp(buildpt, sos);
-          split_ratings.d.in[nsplits] = SSCORE_COMMENT;
-        } else {
-          buildpt += strapp(buildpt, tokpos);
-          if (pretok == TOK_COMMA && postok != TOK_CBRACE && nests > 0) {
-            split_ratings.d.in[nsplits] = 1;
-          } else if (pretok == TOK_COLON && postok != TOK_CBRACE) {
-            split_ratings.d.in[nsplits] = 1;
-          } else if (pretok == TOK_LABEL && postok == TOK_OBRACE) {
-            split_ratings.d.in[nsplits] = SSCORE_NESTING;
-          } else if (pretok == TOK_DOT || postok == TOK_DOT) {
-            split_ratings.d.in[nsplits] = -2;
-          } else {
-            split_ratings.d.in[nsplits] = 0;
-          }
-        }
-        splitpoints.d.in[nsplits] = buildpt - laccum.d.ch;
-        split_nestings.d.in[nsplits] = nests;
-        nsplits++;
-        tokpos = ntokpos;
-
-        int space;
-        if (pretok == TOK_COMMENT) {
-          space = 0;
-        } else if (pptok == TOK_INBETWEEN && pretok == TOK_OPERATOR &&
-                   postok == TOK_LABEL) {
-          /* annotation */
-          space = 0;
-        } else if (pretok == TOK_EQUAL || postok == TOK_EQUAL) {
-          space = (nests == 0);
-        } else if (pretok == TOK_SPECIAL) {
-          if (postok == TOK_COLON) {
-            space = 0;
-          } else {
-            space = 1;
-          }
-        } else if (postok == TOK_SPECIAL) {
-          space = 1;
-        } else if (pretok == TOK_TRISTR && postok == TOK_TRISTR) {
-          space = 0;
-        } else if (pretok == TOK_EXP || postok == TOK_EXP) {
-          space = 0;
-        } else if (pretok == TOK_DOT || postok == TOK_DOT) {
-          space = 0;
-        } else if (pretok == TOK_OPERATOR && postok == TOK_UNARYOP) {
-          space = 1;
-        } else if (pretok == TOK_LABEL && postok == TOK_UNARYOP) {
-          space = 1;
-        } else if (pretok == TOK_CBRACE && postok == TOK_UNARYOP) {
-          space = 1;
-        } else if (pretok == TOK_OBRACE && postok == TOK_UNARYOP) {
-          space = 0;
-        } else if (pretok == TOK_UNARYOP) {
-          if (pptok == TOK_OPERATOR || pptok == TOK_EXP || pptok == TOK_COMMA ||
-              pptok == TOK_OBRACE || pptok == TOK_EQUAL || pptok == TOK_COLON) {
-            space = 0;
-          } else {
-            space = 1;
-          }
-        } else if (postok == TOK_COMMA || postok == TOK_COLON) {
-          space = 0;
-        } else if (pretok == TOK_COMMA) {
-          if (postok == TOK_CBRACE) {
-            space = 0;
-          } else {
-            space = 1;
-          }
-        } else if (pretok == TOK_COLON) {
-          if (pptok == TOK_LABEL || pptok == TOK_SPECIAL) {
-            space = 1;
-          } else {
-            space = 0;
-          }
-        } else if (pretok == TOK_CBRACE && postok == TOK_LABEL) {
-          space = 1;
-        } else if (pretok == TOK_OPERATOR || postok == TOK_OPERATOR) {
-          space = 1;
-        } else if (pretok == TOK_OBRACE || postok == TOK_CBRACE ||
-                   pretok == TOK_CBRACE || postok == TOK_OBRACE) {
-          space = 0;
-        } else {
-          space = 1;
-        }
-        if (space && i < ntoks - 1) {
-          *buildpt++ = ' ';
-        }
+  pthread_mutex_lock(&pool->lock);
+  __atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_close(struct pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->open = 0;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_wait(struct pool *pool, struct job *job) {
+  pthread_mutex_lock(&pool->lock);
+  while (!job->done) {
+    pthread_cond_wait(&pool->done_cond, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Stops the threads; `all` is left for the caller to report and free */
+static void pool_join(struct pool *pool) {
+  /* any thread may still steal from any queue until all have stopped */
+  for (int t = 0; t < pool->nthreads; t++) {
+    pthread_join(pool->threads[t], NULL);
+  }
+  for (int t = 0; t < pool->nthreads; t++) {
+    pthread_mutex_destroy(&pool->queues[t].lock);
+    free(pool->queues[t].items);
+  }
+  free(pool->threads);
+  free(pool->queues);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_cond_destroy(&pool->done_cond);
+}
+
+/* The I/O engine: one thread keeps the reads of many files in flight
+ * through io_uring, ahead of the formatting threads, and writes back
+ * changed files as they are finished, so that file system latency
+ * overlaps with formatting instead of adding to it. Files it cannot read
+ * this way are passed on unread, and opened by format_job as usual. */
+enum {
+  /* jobs taken from the intake, but not yet done */
+  ENGINE_WINDOW = 64,
+  ENGINE_RING = 256,
+  /* larger files are mapped by format_job instead */
+  ENGINE_PRELOAD_MAX = 16 << 20
+};
+
+/* Completions carry a job pointer, tagged with the operation. Those
+ * without a job are either the wake-up, or a close after reading. */
+enum {
+  OP_OPEN,
+  OP_STATX,
+  OP_READ,
+  OP_CREATE,
+  OP_WRITE,
+  OP_CLOSE,
+  OP_RENAME,
+  OP_WAKE,
+  OP_MASK = 7
+};
+
+struct engine {
+  struct uring ring;
+  struct pool *pool;
+  pthread_t thread;
+  /* counted by every hand-over to the engine thread */
+  int wakefd;
+  uint64_t wakeval;
+  pthread_mutex_t lock;
+  /* jobs not yet started, in order */
+  struct job *intake;
+  struct job *intake_tail;
+  /* formatted jobs, handed back */
+  struct job *back;
+  int open;
+  /* owned by the engine thread */
+  int active;
+  mode_t umask;
+  uint64_t seed;
+};
+
+static uint64_t tag(struct job *job, int op) { return (uintptr_t)job | op; }
+
+/* Submit what is queued until `n` more entries fit */
+static void make_room(struct engine *e, unsigned n) {
+  while (uring_space(&e->ring) < n) {
+    uring_enter(&e->ring, 0);
+  }
+}
 
-        if (postok == TOK_CBRACE) {
-          nests--;
+static void wake_engine(struct engine *e) {
+  uint64_t one = 1;
+  if (write(e->wakefd, &one, sizeof(one)) < 0) {
+    /* the counter is already nonzero */
+  }
+}
+
+static void arm_wake(struct engine *e) {
+  make_room(e, 1);
+  uring_read(&e->ring, e->wakefd, &e->wakeval, sizeof(e->wakeval), 0,
+             tag(NULL, OP_WAKE));
+}
+
+/* Time spent reading ahead, or trying to, counts as reading */
+static void read_time(struct job *job) {
+  if (job->stats) {
+    job->stats->ns_read += stats_clock() - job->since;
+  }
+}
+
+/* Give up on reading ahead; format_job opens the file itself */
+static void pass_unread(struct engine *e, struct job *job) {
+  read_time(job);
+  free(job->stx);
+  job->stx = NULL;
+  free(job->input);
+  job->input = NULL;
+  pool_submit(e->pool, job);
+}
+
+static void start_read(struct engine *e, struct job *job) {
+  if (e->pool->set->stats) {
+    job->stats = (struct pfa_stats *)calloc(1, sizeof(struct pfa_stats));
+    job->since = stats_clock();
+  }
+  if (strcmp(job->name, "-") == 0) {
+    pass_unread(e, job);
+    return;
+  }
+  make_room(e, 1);
+  uring_openat(&e->ring, job->name, O_RDONLY | O_CLOEXEC, 0, 0,
+               tag(job, OP_OPEN));
+}
+
+static void close_quietly(struct engine *e, int fd) {
+  make_room(e, 1);
+  uring_close(&e->ring, fd, 0, tag(NULL, OP_CLOSE));
+}
+
+static void read_done(struct engine *e, struct job *job, int op, int res) {
+  if (op == OP_OPEN) {
+    if (res < 0) {
+      pass_unread(e, job);
+      return;
+    }
+    job->fd = res;
+    if (job->stx) {
+      /* stat'ed already, by stat_jobs */
+      read_done(e, job, OP_STATX, 0);
+      return;
+    }
+    job->stx = (struct statx *)malloc(sizeof(struct statx));
+    make_room(e, 1);
+    uring_statx(&e->ring, job->fd, "", job->stx, 0, tag(job, OP_STATX));
+  } else if (op == OP_STATX) {
+    struct statx *stx = job->stx;
+    if (res < 0 || !S_ISREG(stx->stx_mode) || stx->stx_size == 0 ||
+        stx->stx_size > ENGINE_PRELOAD_MAX) {
+      close_quietly(e, job->fd);
+      pass_unread(e, job);
+      return;
+    }
+    job->havestat = 1;
+    job->mode = stx->stx_mode;
+    job->uid = stx->stx_uid;
+    job->gid = stx->stx_gid;
+    job->inlen = stx->stx_size;
+    /* room for a final newline and a zero after it, as map_input leaves;
+     * a byte more than expected is asked for, as the size may be from a
+     * stat of the path, taken before the file was saved again */
+    job->input = (char *)malloc(job->inlen + 2);
+    make_room(e, 1);
+    uring_read(&e->ring, job->fd, job->input, job->inlen + 1, 0,
+               tag(job, OP_READ));
+  } else {
+    close_quietly(e, job->fd);
+    if (res != (int)job->inlen) {
+      /* the file changed size since stat'ed; map it instead */
+      pass_unread(e, job);
+      return;
+    }
+    job->added_newline = job->input[job->inlen - 1] != '\n';
+    job->input[job->inlen] = job->added_newline ? '\n' : '\0';
+    job->input[job->inlen + 1] = '\0';
+    free(job->stx);
+    job->stx = NULL;
+    read_time(job);
+    pool_submit(e->pool, job);
+  }
+}
+
+static void finish_job(struct engine *e, struct job *job) {
+  if (job->stats && job->commit) {
+    job->stats->ns_commit += stats_clock() - job->since;
+  }
+  e->active--;
+  job_done(e->pool, job);
+}
+
+/* Create a temporary beside the file, named as mkstemp would */
+static void start_commit(struct engine *e, struct job *job) {
+  static const char letters[] =
+      "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  const char *name = job->name;
+  int l = strlen(name);
+  if (!job->tmpname) {
+    job->tmpname = (char *)malloc(l + 12);
+  }
+  int co = 0;
+  for (int j = l - 1; j >= 0; j--)
+    if (name[j] == '/') {
+      co = j + 1;
+      break;
+    }
+  memcpy(job->tmpname, name, co);
+  memcpy(&job->tmpname[co], ".pfa_", 5);
+  for (int i = 0; i < 6; i++) {
+    e->seed = e->seed * 6364136223846793005ull + 1442695040888963407ull;
+    job->tmpname[co + 5 + i] = letters[(e->seed >> 33) % 62];
+  }
+  job->tmpname[co + 11] = '\0';
+  mode_t mode = job->havestat ? job->mode & 07777 : 0600;
+  make_room(e, 1);
+  uring_openat(&e->ring, job->tmpname, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+               mode, 0, tag(job, OP_CREATE));
+}
+
+static void commit_done(struct engine *e, struct job *job, int op, int res) {
+  if (op == OP_CREATE) {
+    if (res == -EEXIST) {
+      start_commit(e, job);
+      return;
+    }
+    if (res < 0) {
+      job->status |= JOB_NOWRITE;
+      free(job->tmpname);
+      job->tmpname = NULL;
+      vlbuf_free(&job->output);
+      finish_job(e, job);
+      return;
+    }
+    job->fd = res;
+    if (!job->havestat) {
+      job->status |= JOB_NOSTAT;
+    } else {
+      /* creation honored the umask, and made the file ours; both are
+       * rarely in the way, and cheap to correct */
+      if ((job->mode & 07777) & e->umask) {
+        fchmod(job->fd, job->mode & 07777);
+      }
+      if (job->uid != geteuid() || job->gid != getegid()) {
+        if (fchown(job->fd, job->uid, job->gid) < 0) {
+          /* as with chown in format_job, keep going */
         }
       }
-      int eoff = buildpt - laccum.d.ch;
-
-      /* the art of line breaking */
-      int length_left = 80 - leading_spaces;
-
-      /* write leading space buffer */
-      formfilelen =
-          vlbuf_extend(formfile, ' ', leading_spaces, formfilelen, out);
-
-      if (nsplits > 0) {
-        for (int i = 0; i < nsplits; i++) {
-          int fr = i > 0 ? splitpoints.d.in[i - 1] : 0;
-          int to = i >= nsplits - 1 ? eoff : splitpoints.d.in[i];
-          memcpy(lineout.d.ch, &laccum.d.ch[fr], to - fr);
-          lineout.d.ch[to - fr] = '\0';
-          int nlen = to - fr;
-          int comment_split =
-              i > 0 ? split_ratings.d.in[i - 1] == SSCORE_COMMENT : 0;
-
-          /* The previous location provides the break-off score */
-          int best_score = -1000000, bk = -1;
-          for (int rleft = length_left, k = i; k < nsplits && rleft >= 0; k++) {
-            /* Estimate segment length, walk further */
-            int fr = k > 0 ? splitpoints.d.in[k - 1] : 0;
-            int to = k >= nsplits - 1 ? eoff : splitpoints.d.in[k];
-            int seglen = to - fr;
-            rleft -= seglen;
-
-            /* We split at the zone with the highest score */
-            int reduced_nestings = split_nestings.d.in[k - 1];
-            if (reduced_nestings > 0)
-              reduced_nestings--;
-            int split_score = k > 0 ? (split_ratings.d.in[k - 1] +
-                                       SSCORE_NESTING * reduced_nestings)
-                                    : 0;
-            if (split_score >= best_score) {
-              best_score = split_score;
-              bk = k;
-            }
-
-            /* Never hold up a terminator */
-            if (rleft >= 0 && k == nsplits - 1) {
-              bk = -1;
-            }
-          }
-          int want_split = (bk == i);
-          int length_split = (nlen >= length_left);
-
-          int continuing = 1;
-          if (i == 0) {
-            continuing = 1;
-          } else if (comment_split || length_split || want_split) {
-            continuing = 0;
-          } else {
-            continuing = 1;
-          }
+    }
+    /* a failed or short write cancels the rest, keeping the original */
+    job->inflight = 3;
+    make_room(e, 3);
+    uring_write(&e->ring, job->fd, job->output.d.ch, job->outlen, URING_LINK,
+                tag(job, OP_WRITE));
+    uring_close(&e->ring, job->fd, URING_LINK, tag(job, OP_CLOSE));
+    uring_rename(&e->ring, job->tmpname, job->name, 0, tag(job, OP_RENAME));
+    return;
+  }
+  if ((op == OP_WRITE && (res < 0 || (size_t)res != job->outlen)) ||
+      (op == OP_CLOSE && res < 0 && res != -ECANCELED)) {
+    job->status |= JOB_NOWRITE;
+  }
+  if (op == OP_CLOSE && res == -ECANCELED) {
+    close(job->fd);
+  }
+  if (op == OP_RENAME && res < 0) {
+    /* if canceled, the temporary was never complete */
+    if (res != -ECANCELED) {
+      job->status |= JOB_NORENAME;
+    }
+    unlink(job->tmpname);
+  }
+  if (--job->inflight > 0) {
+    return;
+  }
+  if (!(job->status & JOB_NORENAME)) {
+    free(job->tmpname);
+    job->tmpname = NULL;
+  }
+  vlbuf_free(&job->output);
+  finish_job(e, job);
+}
 
-          if (continuing) {
-            length_left -= nlen;
-            formfilelen = vlbuf_append(formfile, lineout.d.ch,
-                                       strlen(lineout.d.ch), formfilelen, out);
-          } else {
-            char *prn = &lineout.d.ch[0];
-            if (lineout.d.ch[0] == ' ') {
-              prn = &lineout.d.ch[1];
-              nlen -= 1;
-            }
-            if (comment_split || split_nestings.d.in[i - 1] > 0) {
-              formfilelen = vlbuf_append(formfile, "\n", 1, formfilelen, out);
-            } else {
-              formfilelen =
-                  vlbuf_append(formfile, " \\\n", 3, formfilelen, out);
-            }
-            length_left = 80 - leading_spaces - 4 - nlen;
-            formfilelen = vlbuf_extend(formfile, ' ', leading_spaces + 4,
-                                       formfilelen, out);
-            formfilelen =
-                vlbuf_append(formfile, prn, strlen(prn), formfilelen, out);
-          }
+static void *engine_main(void *arg) {
+  struct engine *e = (struct engine *)arg;
+  arm_wake(e);
+  while (1) {
+    pthread_mutex_lock(&e->lock);
+    struct job *back = e->back;
+    e->back = NULL;
+    pthread_mutex_unlock(&e->lock);
+
+    for (struct job *job = back, *next; job; job = next) {
+      next = job->next;
+      free(job->input);
+      job->input = NULL;
+      if (job->commit) {
+        if (job->stats) {
+          job->since = stats_clock();
         }
-        formfilelen = vlbuf_append(formfile, "\n", 1, formfilelen, out);
+        start_commit(e, job);
       } else {
-        formfilelen = vlbuf_append(formfile, laccum.d.ch, strlen(laccum.d.ch),
-                                   formfilelen, out);
-        formfilelen = vlbuf_append(formfile, "\n", 1, formfilelen, out);
+        finish_job(e, job);
       }
-      if (line_state == LINE_IS_BLANK) {
-        formfilelen = vlbuf_append(formfile, "\n", 1, formfilelen, out);
+    }
+
+    /* only now, with the jobs just finished out of the window, refill it;
+     * nothing would wake the engine for the intake left over */
+    pthread_mutex_lock(&e->lock);
+    struct job *start = NULL, **last = &start;
+    while (e->intake && e->active < ENGINE_WINDOW) {
+      *last = e->intake;
+      last = &e->intake->next;
+      e->intake = e->intake->next;
+      e->active++;
+    }
+    *last = NULL;
+    int closed = !e->open && !e->intake;
+    pthread_mutex_unlock(&e->lock);
+
+    for (struct job *job = start, *next; job; job = next) {
+      next = job->next;
+      start_read(e, job);
+    }
+    if (closed && e->active == 0) {
+      break;
+    }
+    if (uring_enter(&e->ring, 1) < 0) {
+      continue;
+    }
+    uint64_t data;
+    int res;
+    while (uring_next(&e->ring, &data, &res)) {
+      struct job *job = (struct job *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+      int op = data & OP_MASK;
+      if (!job) {
+        if (op == OP_WAKE) {
+          arm_wake(e);
+        }
+      } else if (op <= OP_READ) {
+        read_done(e, job, op, res);
       } else {
-        line_state = LINE_IS_NORMAL;
+        commit_done(e, job, op, res);
       }
     }
   }
+  return NULL;
+}
+
+/* Start the engine for `pool`, or return NULL to do without */
+static struct engine *engine_start(struct pool *pool) {
+  struct engine *e = (struct engine *)calloc(1, sizeof(struct engine));
+  if (uring_init(&e->ring, ENGINE_RING) != 0) {
+    free(e);
+    return NULL;
+  }
+  e->wakefd = eventfd(0, EFD_CLOEXEC);
+  if (e->wakefd < 0) {
+    uring_exit(&e->ring);
+    free(e);
+    return NULL;
+  }
+  e->pool = pool;
+  e->open = 1;
+  e->umask = umask(0);
+  umask(e->umask);
+  e->seed = (uint64_t)getpid() << 32 ^ (uint64_t)time(NULL);
+  pthread_mutex_init(&e->lock, NULL);
+  pool->engine = e;
+  if (pthread_create(&e->thread, NULL, engine_main, e) != 0) {
+    /* nothing would drain the engine's lists */
+    pool->engine = NULL;
+    pthread_mutex_destroy(&e->lock);
+    close(e->wakefd);
+    uring_exit(&e->ring);
+    free(e);
+    return NULL;
+  }
+  return e;
+}
 
-  vlbuf_free(&linebuf);
-  vlbuf_free(&tokbuf);
-  vlbuf_free(&toks);
-  vlbuf_free(&laccum);
-  vlbuf_free(&splitpoints);
-  vlbuf_free(&split_ratings);
-  vlbuf_free(&split_nestings);
-  vlbuf_free(&lineout);
+/* The engine thread drains each list whole, so it only needs waking when
+ * one was empty. Wakes are sent under the lock: once the engine has taken
+ * the last job back, no worker is left touching it. */
+static void engine_add(struct engine *e, struct job *job) {
+  job->engine = 1;
+  job->next = NULL;
+  pthread_mutex_lock(&e->lock);
+  int idle = !e->intake;
+  if (e->intake) {
+    e->intake_tail->next = job;
+  } else {
+    e->intake = job;
+  }
+  e->intake_tail = job;
+  if (idle) {
+    wake_engine(e);
+  }
+  pthread_mutex_unlock(&e->lock);
 }
 
-/* simple fprintf replacement */
-static void logerr(int narg, ...) {
-  va_list alist;
-  if (narg > 1) {
-    int netlen = 0;
-    va_start(alist, narg);
-    for (int i = 0; i < narg; i++) {
-      const char *s = va_arg(alist, const char *);
-      netlen += strlen(s);
+static void engine_return(struct engine *e, struct job *job) {
+  pthread_mutex_lock(&e->lock);
+  int idle = !e->back;
+  job->next = e->back;
+  e->back = job;
+  if (idle) {
+    wake_engine(e);
+  }
+  pthread_mutex_unlock(&e->lock);
+}
+
+/* No more jobs will be added */
+static void engine_close(struct engine *e) {
+  pthread_mutex_lock(&e->lock);
+  e->open = 0;
+  wake_engine(e);
+  pthread_mutex_unlock(&e->lock);
+}
+
+/* Wait until every job added is done, then stop the engine */
+static void engine_join(struct engine *e) {
+  pthread_join(e->thread, NULL);
+  e->pool->engine = NULL;
+  close(e->wakefd);
+  uring_exit(&e->ring);
+  pthread_mutex_destroy(&e->lock);
+  free(e);
+}
+
+struct sized {
+  off_t size;
+  int idx;
+};
+
+static int cmp_size_desc(const void *a, const void *b) {
+  const struct sized *x = (const struct sized *)a;
+  const struct sized *y = (const struct sized *)b;
+  if (x->size != y->size)
+    return x->size < y->size ? 1 : -1;
+  return x->idx - y->idx;
+}
+
+/* Stat the files of all jobs into their `stx`, many at a time through a
+ * ring of their own, for the engine to use rather than stat them again.
+ * Where that fails, `stx` is left unset. */
+static void stat_jobs(struct job *jobs, int njobs) {
+  struct uring ring;
+  if (uring_init(&ring, ENGINE_RING) != 0) {
+    return;
+  }
+  int next = 0, inflight = 0;
+  while (next < njobs || inflight > 0) {
+    while (next < njobs && uring_space(&ring) > 0) {
+      struct job *job = &jobs[next++];
+      if (strcmp(job->name, "-") == 0) {
+        continue;
+      }
+      job->stx = (struct statx *)malloc(sizeof(struct statx));
+      uring_statx(&ring, AT_FDCWD, job->name, job->stx, 0, (uintptr_t)job);
+      inflight++;
     }
-    va_end(alist);
+    if (inflight == 0 || uring_enter(&ring, 1) < 0) {
+      continue;
+    }
+    uint64_t data;
+    int res;
+    while (uring_next(&ring, &data, &res)) {
+      struct job *job = (struct job *)(uintptr_t)data;
+      if (res < 0) {
+        free(job->stx);
+        job->stx = NULL;
+      }
+      inflight--;
+    }
+  }
+  uring_exit(&ring);
+}
 
-    char *data = (char *)malloc(netlen);
-    va_start(alist, narg);
-    char *local = data;
-    for (int i = 0; i < narg; i++) {
-      const char *s = va_arg(alist, const char *);
-      local += strapp(local, s);
+/* Format all jobs on `nthreads` threads, reporting results in order */
+static int run_pool(struct job *jobs, int njobs, int nthreads,
+                    const struct settings *set) {
+  struct pool pool;
+  pool_start(&pool, nthreads, set);
+  struct engine *engine = engine_start(&pool);
+
+  /* Deal out files largest first, so no big file starts last. The
+   * engine's sizes are found many at a time, and kept for it to use. */
+  struct sized *order = (struct sized *)malloc(sizeof(struct sized) * njobs);
+  if (engine) {
+    stat_jobs(jobs, njobs);
+  }
+  for (int i = 0; i < njobs; i++) {
+    struct stat st;
+    if (engine) {
+      order[i].size = jobs[i].stx ? (off_t)jobs[i].stx->stx_size : 0;
+    } else {
+      order[i].size = stat(jobs[i].name, &st) < 0 ? 0 : st.st_size;
     }
-    va_end(alist);
+    order[i].idx = i;
+  }
+  qsort(order, njobs, sizeof(struct sized), cmp_size_desc);
+  for (int i = 0; i < njobs; i++) {
+    struct job *job = &jobs[order[i].idx];
+    job->size = order[i].size;
+    if (engine) {
+      /* read in this order, and formatted as soon as read */
+      engine_add(engine, job);
+    } else {
+      pool_submit(&pool, job);
+    }
+  }
+  free(order);
+  if (engine) {
+    engine_close(engine);
+  } else {
+    pool_close(&pool);
+  }
 
-    write(STDERR_FILENO, data, netlen);
-    free(data);
+  int ret = 0;
+  for (int i = 0; i < njobs; i++) {
+    pool_wait(&pool, &jobs[i]);
+    if (report_job(&jobs[i], set)) {
+      ret = 1;
+    }
+  }
+  if (engine) {
+    engine_join(engine);
+    pool_close(&pool);
+  }
+  pool_join(&pool);
+  free(pool.all);
+  return ret;
+}
+
+static void submit_found(const char *path, void *arg) {
+  struct pool *pool = (struct pool *)arg;
+  struct job *job = (struct job *)calloc(1, sizeof(struct job));
+  job->name = strdup(path);
+  if (pool->engine) {
+    engine_add(pool->engine, job);
   } else {
-    va_start(alist, narg);
-    const char *s = va_arg(alist, const char *);
-    write(STDERR_FILENO, s, strlen(s));
-    va_end(alist);
+    pool_submit(pool, job);
   }
 }
 
-int main(int argc, char **argv) {
-  (void)ls_to_string;
-  (void)tok_to_string;
+static int cmp_job_name(const void *a, const void *b) {
+  return strcmp((*(struct job *const *)a)->name,
+                (*(struct job *const *)b)->name);
+}
 
-  int inplace = 0;
-  if (argv[0][strlen(argv[0]) - 1] == 'i') {
-    inplace = 1;
+/* Wait for the jobs of submit_found, then report them sorted by path */
+static int finish_found(struct pool *pool, int ret) {
+  if (pool->engine) {
+    engine_close(pool->engine);
+    engine_join(pool->engine);
   }
+  pool_close(pool);
+  pool_join(pool);
+
+  qsort(pool->all, pool->nall, sizeof(struct job *), cmp_job_name);
+  for (int i = 0; i < pool->nall; i++) {
+    if (report_job(pool->all[i], pool->set)) {
+      ret = 1;
+    }
+    free((char *)pool->all[i]->name);
+    free(pool->all[i]);
+  }
+  free(pool->all);
+  return ret;
+}
 
-  if (argc == 1) {
-    if (inplace) {
-      logerr(1, "Usage: pfai [files]\n       (to stdout) pfa [files]\n");
+/* Format the Python files under `roots` as they are found. Since walk
+ * order is not stable, results are reported sorted by path. */
+static int run_recursive(char **roots, int nroots, const char **excludes,
+                         int nexcludes, int nthreads,
+                         const struct settings *set) {
+  struct pool pool;
+  pool_start(&pool, nthreads, set);
+  engine_start(&pool);
+
+  char **dirs = (char **)malloc(sizeof(char *) * nroots);
+  int ndirs = 0;
+  for (int i = 0; i < nroots; i++) {
+    struct stat st;
+    if (stat(roots[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      dirs[ndirs++] = roots[i];
     } else {
-      logerr(1, "Usage: pfa [files]\n       (in place)  pfai [files]\n");
+      /* plain files are taken as given; missing ones fail as usual */
+      submit_found(roots[i], &pool);
     }
-    return 1;
   }
+  int ret = 0;
+  if (ndirs > 0 && walk_trees(dirs, ndirs, excludes, nexcludes, nthreads,
+                              submit_found, &pool)) {
+    logerr(1, "Could not read all directories\n");
+    ret = 1;
+  }
+  free(dirs);
+  return finish_found(&pool, ret);
+}
 
-  make_special_name_table();
-  struct vlbuf origfile = vlbuf_make(sizeof(char));
-  struct vlbuf formfile = vlbuf_make(sizeof(char));
-  int maxnlen = 0;
-  for (int i = 1; i < argc; i++) {
-    int l = strlen(argv[i]);
-    if (l > maxnlen)
-      maxnlen = l;
+/* Format the Python files that git would show as staged or modified
+ * (and, with `untracked`, the new ones not yet added) */
+static int run_git_changed(int untracked, int nthreads,
+                           const struct settings *set) {
+  struct pool pool;
+  pool_start(&pool, nthreads, set);
+  engine_start(&pool);
+  int ret = 0;
+  if (git_changed(nthreads, untracked, submit_found, &pool)) {
+    logerr(1, "Could not read git repository\n");
+    ret = 1;
   }
-  char *nbuf = (char *)malloc(sizeof(char) * (maxnlen + 12));
+  return finish_found(&pool, ret);
+}
+
+/* For --watch: one worker, kept warm from one save to the next */
+struct watcher {
+  struct worker w;
+  const struct settings *set;
+};
 
-  for (int i = 1; i < argc; i++) {
-    const char *name = argv[i];
-    FILE *in = fopen(name, "r");
-    if (!in) {
-      logerr(3, "File ", name, " dne\n");
+static void format_saved(const char *path, void *arg) {
+  struct watcher *wt = (struct watcher *)arg;
+  struct job job;
+  memset(&job, 0, sizeof(job));
+  job.name = path;
+  format_job(&job, &wt->w, wt->set, stdout);
+  report_job(&job, wt->set);
+  fflush(stdout);
+}
+
+/* Format the Python files under `roots` each time one is saved */
+static int run_watch(char **roots, int nroots, const char **excludes,
+                     int nexcludes, const struct settings *set) {
+  struct watcher wt;
+  worker_init(&wt.w);
+  wt.set = set;
+  int ret = 0;
+  if (watch_trees(roots, nroots, excludes, nexcludes, format_saved, &wt)) {
+    logerr(1, "Could not watch all directories\n");
+    ret = 1;
+  }
+  worker_free(&wt.w);
+  return ret;
+}
+
+static void usage(int inplace) {
+  if (inplace) {
+    logerr(1, "Usage: pfai [--check | --diff] [--lines A-B] [--stats] "
+              "[--wrap greedy|optimal]\n"
+              "            [-c CACHE] [-j N] [-r [-x PATTERN]...] [files]\n"
+              "       pfai [--check | --diff] [--stats] "
+              "[--wrap greedy|optimal]\n"
+              "            [-c CACHE] [-j N] --git-changed [--untracked]\n"
+              "       pfai [--check | --diff] [--stats] "
+              "[--wrap greedy|optimal]\n"
+              "            [-c CACHE] [-x PATTERN]... --watch dirs\n"
+              "       (to stdout) pfa [-c CACHE] [-j N] [-r] [files]\n");
+  } else {
+    logerr(1, "Usage: pfa [--check | --diff] [--lines A-B] [--stats] "
+              "[--wrap greedy|optimal]\n"
+              "           [-c CACHE] [-j N] [-r [-x PATTERN]...] [files]\n"
+              "       pfa [--check | --diff] [--stats] "
+              "[--wrap greedy|optimal]\n"
+              "           [-c CACHE] [-j N] --git-changed [--untracked]\n"
+              "       pfa (--check | --diff) [--stats] "
+              "[--wrap greedy|optimal]\n"
+              "           [-c CACHE] [-x PATTERN]... --watch dirs\n"
+              "       (in place)  pfai [-c CACHE] [-j N] [-r [-x PATTERN]...] "
+              "[files]\n"
+              "                   pfai [-c CACHE] [-x PATTERN]... --watch "
+              "dirs\n");
+  }
+}
+
+int main(int argc, char **argv) {
+  struct settings set;
+  memset(&set, 0, sizeof(set));
+  struct pfa_stats total;
+  memset(&total, 0, sizeof(total));
+  int spare = 0;
+  set.spare = &spare;
+  if (argv[0][strlen(argv[0]) - 1] == 'i') {
+    set.inplace = 1;
+  }
+
+  int nthreads = 1;
+  int recursive = 0;
+  int gitchanged = 0, untracked = 0;
+  int watch = 0;
+  const char *cachepath = NULL;
+  const char **excludes = (const char **)malloc(sizeof(char *) * argc);
+  int nexcludes = 0;
+  enum {
+    OPT_GIT_CHANGED = 256,
+    OPT_UNTRACKED,
+    OPT_CHECK,
+    OPT_DIFF,
+    OPT_STATS,
+    OPT_LINES,
+    OPT_WRAP,
+    OPT_WATCH
+  };
+  static const struct option longopts[] = {
+      {"check", no_argument, NULL, OPT_CHECK},
+      {"diff", no_argument, NULL, OPT_DIFF},
+      {"stats", no_argument, NULL, OPT_STATS},
+      {"lines", required_argument, NULL, OPT_LINES},
+      {"wrap", required_argument, NULL, OPT_WRAP},
+      {"git-changed", no_argument, NULL, OPT_GIT_CHANGED},
+      {"untracked", no_argument, NULL, OPT_UNTRACKED},
+      {"watch", no_argument, NULL, OPT_WATCH},
+      {NULL, 0, NULL, 0}};
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:j:rx:", longopts, NULL)) != -1) {
+    switch (opt) {
+    case OPT_CHECK:
+      set.check = 1;
+      break;
+    case OPT_DIFF:
+      set.check = 1;
+      set.diff = 1;
+      break;
+    case OPT_STATS:
+      set.stats = &total;
+      break;
+    case OPT_LINES: {
+      char tail;
+      if (sscanf(optarg, "%d-%d%c", &set.first, &set.last, &tail) != 2 ||
+          set.first < 1 || set.last < set.first) {
+        logerr(3, "Bad line range ", optarg, ", wanted e.g. 120-180\n");
+        free(excludes);
+        return 1;
+      }
+    } break;
+    case OPT_WRAP:
+      if (strcmp(optarg, "greedy") == 0) {
+        set.wrap = WRAP_GREEDY;
+      } else if (strcmp(optarg, "optimal") == 0) {
+        set.wrap = WRAP_OPTIMAL;
+      } else {
+        logerr(3, "Bad wrapping ", optarg, ", wanted greedy or optimal\n");
+        free(excludes);
+        return 1;
+      }
+      break;
+    case OPT_GIT_CHANGED:
+      gitchanged = 1;
+      break;
+    case OPT_UNTRACKED:
+      untracked = 1;
+      break;
+    case OPT_WATCH:
+      watch = 1;
+      break;
+    case 'c':
+      cachepath = optarg;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+      }
+      break;
+    case 'r':
+      recursive = 1;
+      break;
+    case 'x':
+      excludes[nexcludes++] = optarg;
+      break;
+    default:
+      usage(set.inplace);
+      free(excludes);
       return 1;
     }
-    /* Format file contents, saving to stdout or to buffers */
-    pyformat(in, inplace ? 0 : stdout, inplace ? &origfile : 0,
-             inplace ? &formfile : 0);
-    fclose(in);
+  }
 
-    if (inplace) {
-      int unchanged = strcmp(origfile.d.ch, formfile.d.ch) == 0;
-      if (unchanged) {
-        /* Do nothing */
-      } else {
-        /* Construct the temporary name */
-        int l = strlen(name);
-        strncpy(nbuf, name, l + 1);
-        int co = 0;
-        for (int j = l - 1; j >= 0; j--)
-          if (name[j] == '/') {
-            co = j + 1;
-            break;
-          }
-        strncpy(&nbuf[co], ".pfa_XXXXXX", 12);
+  int njobs = argc - optind;
+  if (gitchanged ? njobs > 0 || recursive || watch
+                 : njobs <= 0 || untracked) {
+    usage(set.inplace);
+    free(excludes);
+    return 1;
+  }
+  if (watch && ((!set.inplace && !set.check) || set.first)) {
+    /* printing whole files, or a line range of each, on every save is of
+     * no use */
+    usage(set.inplace);
+    free(excludes);
+    return 1;
+  }
 
-        /* Write to temporary */
-        int fo = mkstemp(nbuf);
-        write(fo, formfile.d.ch, strlen(formfile.d.ch));
-        close(fo);
+  if (cachepath) {
+    /* the output, and so what is known to be formatted, depends on the
+     * wrapping */
+    set.cache = cache_open(cachepath,
+                           PFA_FORMAT_VERSION | (uint32_t)set.wrap << 16);
+    if (!set.cache) {
+      logerr(3, "Could not open cache ", cachepath, "\n");
+    }
+  }
 
-        /* Ensure properties match */
-        struct stat st;
-        if (stat(name, &st) < 0) {
-          logerr(3, "Could not get original permissions for ", name, "\n");
-        } else {
-          chmod(nbuf, st.st_mode);
-          chown(nbuf, st.st_uid, st.st_gid);
-        }
+  /* past a file size limit, writes fail and are reported, rather than
+   * ending the program with temporaries left behind */
+  signal(SIGXFSZ, SIG_IGN);
 
-        int s = rename(nbuf, name);
-        if (s) {
-          logerr(5, "Failed to overwrite ", name, " with ", nbuf, "\n");
-          remove(nbuf);
+  int ret = 0;
+  if (gitchanged) {
+    ret = run_git_changed(untracked, nthreads, &set);
+  } else if (watch) {
+    ret = run_watch(&argv[optind], njobs, excludes, nexcludes, &set);
+  } else if (recursive) {
+    ret = run_recursive(&argv[optind], njobs, excludes, nexcludes, nthreads,
+                        &set);
+  } else {
+    if (nthreads > njobs) {
+      /* threads without a file of their own help with large ones */
+      spare = nthreads - njobs;
+      nthreads = njobs;
+    }
+    struct job *jobs = (struct job *)calloc(njobs, sizeof(struct job));
+    for (int i = 0; i < njobs; i++) {
+      jobs[i].name = argv[optind + i];
+    }
+
+    if (nthreads > 1) {
+      /* Every file is attempted; errors are still reported in order */
+      ret = run_pool(jobs, njobs, nthreads, &set);
+    } else {
+      struct worker w;
+      worker_init(&w);
+      for (int i = 0; i < njobs; i++) {
+        format_job(&jobs[i], &w, &set, stdout);
+        if (report_job(&jobs[i], &set)) {
+          ret = 1;
+          if (jobs[i].status & JOB_DNE) {
+            break;
+          }
         }
       }
+      worker_free(&w);
     }
+    free(jobs);
+  }
+  free(excludes);
+  if (set.cache) {
+    cache_close(set.cache);
+  }
+  if (set.stats) {
+    print_stats(NULL, set.stats);
   }
-  vlbuf_free(&origfile);
-  vlbuf_free(&formfile);
-  free(nbuf);
-  free_special_name_table();
+  return ret;
 }
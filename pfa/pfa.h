@@ -0,0 +1,60 @@
+#ifndef PFA_H
+#define PFA_H
+
+#include <stddef.h>
+
+/* libpfa: format Python source held in memory, without running the pfa
+ * program. Output is byte for byte what `pfa` would print. */
+
+#if defined(__GNUC__)
+#define PFA_API __attribute__((visibility("default")))
+#else
+#define PFA_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Changes whenever the formatted output of some input changes */
+#define PFA_FORMAT_VERSION 2
+
+/* Scratch space for formatting, kept between calls so that repeated use
+ * does not allocate again. A context may be used by one thread at a
+ * time; separate contexts may be used concurrently. */
+struct pfa_context;
+
+PFA_API struct pfa_context *pfa_context_new(void);
+PFA_API void pfa_context_free(struct pfa_context *ctx);
+
+/* Format the `len` bytes at `text`. On return, `*out` points to the
+ * `*outlen` bytes of formatted text, followed by a NUL; it is owned by
+ * `ctx` and valid until its next use. Returns 0. */
+PFA_API int pfa_format(struct pfa_context *ctx, const char *text, size_t len,
+                       const char **out, size_t *outlen);
+
+/* Format only the logical lines that overlap lines `first` to `last` of
+ * the text, counting from 1, and copy the rest unchanged; the formatted
+ * lines come out as they would from pfa_format. The text before the range
+ * is only scanned, and the text after it only copied, so the time taken
+ * mostly depends on the size of the range. Output is as for pfa_format.
+ * Returns 0, or -1 if 1 <= first <= last does not hold. */
+PFA_API int pfa_format_lines(struct pfa_context *ctx, const char *text,
+                             size_t len, int first, int last,
+                             const char **out, size_t *outlen);
+
+/* Receives successive pieces of the formatted text; a nonzero return
+ * stops formatting early */
+typedef int (*pfa_sink_fn)(const char *data, size_t len, void *arg);
+
+/* Format as pfa_format does, passing output to `sink` as it is made,
+ * without building it up in memory. Returns 0, or -1 if the sink asked
+ * to stop. */
+PFA_API int pfa_format_to(struct pfa_context *ctx, const char *text,
+                          size_t len, pfa_sink_fn sink, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
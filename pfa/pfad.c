@@ -0,0 +1,500 @@
+/* pfad: serve formatting requests over a Unix domain socket, so that
+ * editors and hooks which format many times a minute pay neither for
+ * starting a process nor for cold buffers.
+ *
+ * A client connects, then sends any number of requests on the same
+ * connection, each answered in turn. Connections are not tied to a
+ * thread: each request is served by whichever worker is free, so idle
+ * connections held open by editors never keep other clients waiting. All
+ * integers are 32 bits, in network byte order.
+ *
+ *   request:  type, length, first, last, then `length` bytes
+ *     type 1: the bytes are a file's path, which pfad reads itself
+ *     type 2: the bytes are the text to format
+ *     first, last: if nonzero, format only lines first..last, as with
+ *       `pfa --lines`
+ *   response: status, length, then `length` bytes
+ *     status 0: the bytes are the formatted text
+ *     status 1: the text is already formatted; no bytes follow
+ *     status 2: the bytes are an error message
+ *
+ * Usage: pfad [-c CACHE] [-j N] SOCKET */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "format.h"
+
+enum { REQ_PATH = 1, REQ_TEXT = 2 };
+enum { RESP_FORMATTED = 0, RESP_UNCHANGED = 1, RESP_ERROR = 2 };
+/* larger requests are refused, and the connection dropped */
+#define MAX_REQUEST (1u << 30)
+/* texts newly seen to be formatted are written to the cache this often,
+ * in seconds, so that they are neither held until shutdown nor lost in a
+ * crash */
+enum { FLUSH_INTERVAL = 10 };
+
+/* Texts recently seen to be formatted, by hash and size. Unlike the
+ * cache, whose table is only read from disk when opened, this learns as
+ * the daemon runs; it is direct-mapped, so newer entries push out older
+ * ones. */
+enum { SEEN_SLOTS = 1 << 16 };
+struct seen {
+  pthread_mutex_t lock;
+  uint64_t hash[SEEN_SLOTS];
+  uint64_t size[SEEN_SLOTS];
+};
+
+static int seen_has(struct seen *sn, uint64_t hash, uint64_t size) {
+  size_t i = hash & (SEEN_SLOTS - 1);
+  pthread_mutex_lock(&sn->lock);
+  /* sizes are stored plus one, so that empty slots match nothing */
+  int r = sn->hash[i] == hash && sn->size[i] == size + 1;
+  pthread_mutex_unlock(&sn->lock);
+  return r;
+}
+
+static void seen_add(struct seen *sn, uint64_t hash, uint64_t size) {
+  size_t i = hash & (SEEN_SLOTS - 1);
+  pthread_mutex_lock(&sn->lock);
+  sn->hash[i] = hash;
+  sn->size[i] = size + 1;
+  pthread_mutex_unlock(&sn->lock);
+}
+
+struct server {
+  int listenfd;
+  /* the listening socket and all idle connections, each armed for one
+   * event at a time */
+  int epollfd;
+  struct cache *cache;
+  struct seen *seen;
+  /* held for reading while a request is served; shutdown takes it for
+   * writing, so that no request is cut short */
+  pthread_rwlock_t serving;
+};
+
+/* A client's connection, and as much of its next request as has come */
+struct conn {
+  int fd;
+  uint32_t hdr[4];
+  /* bytes received of the header, then of the body */
+  size_t got;
+  struct vlbuf body;
+  /* the part of the last response the socket would not yet take; until
+   * it is sent, no further request is read */
+  struct vlbuf out;
+  size_t outlen;
+  size_t sent;
+};
+
+/* Send what the socket takes of the pending response, without waiting.
+ * Returns 1 once it is all sent, 0 if more is left, and -1 if the
+ * connection should be dropped. */
+static int send_pending(struct conn *c) {
+  while (c->sent < c->outlen) {
+    ssize_t w = send(c->fd, &c->out.d.ch[c->sent], c->outlen - c->sent,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR)
+      continue;
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (w < 0)
+      return -1;
+    c->sent += w;
+  }
+  return 1;
+}
+
+/* Send as much of the response as the socket takes now, and keep the
+ * rest for the epoll loop to finish, so that a client which stops
+ * reading never holds up a worker */
+static int respond(struct conn *c, uint32_t status, const char *data,
+                   size_t len) {
+  uint32_t hdr[2] = {htonl(status), htonl((uint32_t)len)};
+  struct iovec iov[2] = {{hdr, sizeof(hdr)}, {(void *)data, len}};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = len > 0 ? 2 : 1;
+  ssize_t w;
+  do {
+    w = sendmsg(c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  } while (w < 0 && errno == EINTR);
+  if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    return -1;
+  size_t done = w < 0 ? 0 : (size_t)w;
+  size_t total = sizeof(hdr) + len;
+  c->outlen = total - done;
+  c->sent = 0;
+  if (c->outlen == 0)
+    return 0;
+  if (c->out.len <= c->outlen) {
+    vlbuf_expand(&c->out, c->outlen + 1);
+  }
+  /* the header may be partly sent, the text not at all */
+  size_t off = 0;
+  if (done < sizeof(hdr)) {
+    memcpy(c->out.d.ch, (char *)hdr + done, sizeof(hdr) - done);
+    off = sizeof(hdr) - done;
+    done = sizeof(hdr);
+  }
+  memcpy(&c->out.d.ch[off], data + (done - sizeof(hdr)),
+         len - (done - sizeof(hdr)));
+  return 0;
+}
+
+static int respond_error(struct conn *c, const char *msg, const char *what) {
+  char buf[512];
+  int n = snprintf(buf, sizeof(buf), "%s%s", msg, what);
+  return respond(c, RESP_ERROR, buf, n < (int)sizeof(buf) ? n : sizeof(buf));
+}
+
+/* Take what has arrived of the request on `c`, without waiting for the
+ * rest. Returns 1 once it is whole, 0 if more is to come, and -1 if the
+ * connection should be dropped. */
+static int receive(struct conn *c) {
+  while (1) {
+    char *dst;
+    size_t want;
+    if (c->got < sizeof(c->hdr)) {
+      dst = (char *)c->hdr + c->got;
+      want = sizeof(c->hdr) - c->got;
+    } else {
+      size_t have = c->got - sizeof(c->hdr);
+      uint32_t len = ntohl(c->hdr[1]);
+      if (have == len) {
+        return 1;
+      }
+      dst = &c->body.d.ch[have];
+      want = len - have;
+    }
+    ssize_t r = recv(c->fd, dst, want, MSG_DONTWAIT);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (r <= 0)
+      return -1;
+    c->got += r;
+    if (c->got == sizeof(c->hdr)) {
+      uint32_t type = ntohl(c->hdr[0]), len = ntohl(c->hdr[1]);
+      if (len > MAX_REQUEST || (type != REQ_PATH && type != REQ_TEXT)) {
+        respond_error(c, "Bad request", "");
+        return -1;
+      }
+      if (c->body.len <= len) {
+        vlbuf_expand(&c->body, len + 1);
+      }
+    }
+  }
+}
+
+/* Format `text`, and send the result. Whole texts already known to be
+ * formatted are only hashed. */
+static int serve_text(struct server *s, struct pfa_context *ctx,
+                      struct conn *c, const char *text, size_t len, int first,
+                      int last) {
+  uint64_t hash = 0;
+  if (!first) {
+    hash = cache_hash(text, len);
+    if (seen_has(s->seen, hash, len)) {
+      return respond(c, RESP_UNCHANGED, NULL, 0);
+    }
+    if (s->cache && cache_has(s->cache, hash, len)) {
+      seen_add(s->seen, hash, len);
+      return respond(c, RESP_UNCHANGED, NULL, 0);
+    }
+  }
+  const char *out;
+  size_t outlen;
+  if (first) {
+    pfa_format_lines(ctx, text, len, first, last, &out, &outlen);
+  } else {
+    pfa_format(ctx, text, len, &out, &outlen);
+  }
+  if (outlen == len && memcmp(out, text, len) == 0) {
+    if (!first) {
+      seen_add(s->seen, hash, len);
+      if (s->cache) {
+        cache_add(s->cache, hash, len);
+      }
+    }
+    return respond(c, RESP_UNCHANGED, NULL, 0);
+  }
+  return respond(c, RESP_FORMATTED, out, outlen);
+}
+
+/* The file is read into the connection's buffer, after the path, rather
+ * than mapped: were a mapped file truncated by an editor meanwhile, its
+ * end would raise SIGBUS, taking down the daemon with every client */
+static int serve_path(struct server *s, struct pfa_context *ctx,
+                      struct conn *c, size_t pathlen, int first, int last) {
+  int file = open(c->body.d.ch, O_RDONLY | O_CLOEXEC);
+  if (file < 0) {
+    return respond_error(c, "Could not open ", c->body.d.ch);
+  }
+  struct stat st;
+  if (fstat(file, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(file);
+    return respond_error(c, "Not a regular file: ", c->body.d.ch);
+  }
+  /* read to the end, as the size may have changed; asking for a byte
+   * more than expected finds the end in two calls */
+  size_t start = pathlen + 1, len = 0, want = st.st_size + 1;
+  while (1) {
+    if (c->body.len <= start + len + want) {
+      vlbuf_expand(&c->body, start + len + want);
+    }
+    ssize_t r = read(file, &c->body.d.ch[start + len], want);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0) {
+      close(file);
+      return respond_error(c, "Could not read ", c->body.d.ch);
+    }
+    if (r == 0) {
+      break;
+    }
+    len += r;
+    want = len > 4096 ? len : 4096;
+  }
+  close(file);
+  return serve_text(s, ctx, c, &c->body.d.ch[start], len, first, last);
+}
+
+/* Answer the request received whole on `c`; returns -1 if the
+ * connection should be dropped */
+static int serve_request(struct server *s, struct pfa_context *ctx,
+                         struct conn *c) {
+  uint32_t type = ntohl(c->hdr[0]), len = ntohl(c->hdr[1]);
+  int first = ntohl(c->hdr[2]), last = ntohl(c->hdr[3]);
+  char *req = c->body.d.ch;
+  c->got = 0;
+  req[len] = '\0';
+  if (first < 0 || last < 0 || (first && last < first) || (!first && last)) {
+    return respond_error(c, "Bad line range", "");
+  }
+
+  pthread_rwlock_rdlock(&s->serving);
+  int r;
+  if (type == REQ_PATH) {
+    r = serve_path(s, ctx, c, len, first, last);
+  } else {
+    r = serve_text(s, ctx, c, req, len, first, last);
+  }
+  pthread_rwlock_unlock(&s->serving);
+  return r;
+}
+
+/* Wait for the next event on `fd`, which is passed `c`: room to send the
+ * rest of a response, if one is pending, and otherwise a request */
+static int arm(struct server *s, int fd, struct conn *c, int op) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = (c && c->sent < c->outlen ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+  ev.data.ptr = c;
+  return epoll_ctl(s->epollfd, op, fd, &ev);
+}
+
+static void drop(struct conn *c) {
+  close(c->fd);
+  vlbuf_free(&c->body);
+  vlbuf_free(&c->out);
+  free(c);
+}
+
+static void accept_connection(struct server *s) {
+  int fd = accept4(s->listenfd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0) {
+    if (errno == EMFILE || errno == ENFILE) {
+      /* wait for other connections to close */
+      usleep(10000);
+    }
+    return;
+  }
+  struct conn *c = (struct conn *)calloc(1, sizeof(struct conn));
+  c->fd = fd;
+  c->body = vlbuf_make(sizeof(char));
+  c->out = vlbuf_make(sizeof(char));
+  if (arm(s, fd, c, EPOLL_CTL_ADD) < 0) {
+    drop(c);
+  }
+}
+
+/* Workers share the events of every connection. A request is only
+ * served once it has all arrived, and then only one before the
+ * connection is armed again, so that clients take turns; a response the
+ * client is slow to take is finished as the socket makes room. Each
+ * worker keeps its own context warm from one request to the next. */
+static void *worker_main(void *arg) {
+  struct server *s = (struct server *)arg;
+  struct pfa_context *ctx = pfa_context_new();
+  while (1) {
+    struct epoll_event ev;
+    int n = epoll_wait(s->epollfd, &ev, 1, -1);
+    if (n < 0 && errno != EINTR) {
+      break;
+    }
+    if (n <= 0) {
+      continue;
+    }
+    struct conn *c = (struct conn *)ev.data.ptr;
+    if (!c) {
+      accept_connection(s);
+      arm(s, s->listenfd, NULL, EPOLL_CTL_MOD);
+      continue;
+    }
+    int r;
+    if (c->sent < c->outlen) {
+      r = send_pending(c);
+    } else {
+      r = receive(c);
+      if (r > 0) {
+        r = serve_request(s, ctx, c);
+      }
+    }
+    if (r < 0 || arm(s, c->fd, c, EPOLL_CTL_MOD) < 0) {
+      drop(c);
+    }
+  }
+  pfa_context_free(ctx);
+  return NULL;
+}
+
+/* Bind to `path`, replacing a stale socket left by a daemon that died,
+ * but not one that is still answering */
+static int listen_at(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  /* never blocking, since another worker may take the connection first */
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "A daemon is already listening at %s\n", path);
+    close(fd);
+    return -1;
+  }
+  unlink(path);
+  /* only this user may connect */
+  mode_t mask = umask(077);
+  int r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (r < 0 || listen(fd, 64) < 0) {
+    fprintf(stderr, "Could not listen at %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int main(int argc, char **argv) {
+  const char *cachepath = NULL;
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+  while ((opt = getopt(argc, argv, "c:j:")) != -1) {
+    switch (opt) {
+    case 'c':
+      cachepath = optarg;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+      }
+      break;
+    default:
+      fprintf(stderr, "Usage: pfad [-c CACHE] [-j N] SOCKET\n");
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: pfad [-c CACHE] [-j N] SOCKET\n");
+    return 1;
+  }
+  const char *path = argv[optind];
+
+  struct server s;
+  s.cache = NULL;
+  s.seen = (struct seen *)calloc(1, sizeof(struct seen));
+  pthread_mutex_init(&s.seen->lock, NULL);
+  pthread_rwlock_init(&s.serving, NULL);
+  if (cachepath) {
+    s.cache = cache_open(cachepath, PFA_FORMAT_VERSION);
+    if (!s.cache) {
+      fprintf(stderr, "Could not open cache %s\n", cachepath);
+    }
+  }
+  s.listenfd = listen_at(path);
+  s.epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if (s.listenfd >= 0 &&
+      (s.epollfd < 0 || arm(&s, s.listenfd, NULL, EPOLL_CTL_ADD) < 0)) {
+    perror("epoll");
+    close(s.listenfd);
+    s.listenfd = -1;
+  }
+  if (s.listenfd < 0) {
+    if (s.cache) {
+      cache_close(s.cache);
+    }
+    return 1;
+  }
+
+  /* Clients that hang up early must not kill the daemon; termination is
+   * handled here, not in the workers */
+  signal(SIGPIPE, SIG_IGN);
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  sigaddset(&stop, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &stop, NULL);
+  for (int i = 0; i < nthreads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker_main, &s) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+    pthread_detach(thread);
+  }
+
+  struct timespec interval = {FLUSH_INTERVAL, 0};
+  while (sigtimedwait(&stop, NULL, &interval) < 0) {
+    if (errno == EAGAIN && s.cache) {
+      cache_flush(s.cache);
+    }
+  }
+  unlink(path);
+  /* wait for requests in progress, then keep new ones from starting */
+  pthread_rwlock_wrlock(&s.serving);
+  if (s.cache) {
+    cache_close(s.cache);
+  }
+  return 0;
+}
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+#include "scan.h"
+
+static int is_string_stop(char c) {
+  return c == '\'' || c == '"' || c == '\\' || c == '\t' || c == '\n';
+}
+
+static const char *blank_scalar(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  return p;
+}
+
+static const char *string_scalar(const char *p, const char *end) {
+  while (p < end && !is_string_stop(*p))
+    p++;
+  return p;
+}
+
+static const char *comment_scalar(const char *p, const char *end) {
+  for (; p < end; p++) {
+    if (*p == '\t' || *p == '\n')
+      break;
+    if (*p == ' ' && (p[1] == ' ' || p[1] == '\n'))
+      break;
+  }
+  return p;
+}
+
+#ifdef SCAN_X86
+/* Positions of the wanted bytes are found as bit masks, 16 or 32 bytes
+ * at a time; the remainder is left to the scalar loops */
+
+__attribute__((target("sse2"))) static const char *
+blank_sse2(const char *p, const char *end) {
+  const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+  for (; p + 16 <= end; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab));
+    unsigned bits = ~_mm_movemask_epi8(m) & 0xffff;
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+  return blank_scalar(p, end);
+}
+
+__attribute__((target("sse2"))) static const char *
+string_sse2(const char *p, const char *end) {
+  const __m128i sq = _mm_set1_epi8('\''), dq = _mm_set1_epi8('"'),
+                bs = _mm_set1_epi8('\\'), tab = _mm_set1_epi8('\t'),
+                nl = _mm_set1_epi8('\n');
+  for (; p + 16 <= end; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i m = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, sq), _mm_cmpeq_epi8(v, dq)),
+        _mm_or_si128(_mm_cmpeq_epi8(v, bs),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, tab),
+                                  _mm_cmpeq_epi8(v, nl))));
+    unsigned bits = _mm_movemask_epi8(m);
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+  return string_scalar(p, end);
+}
+
+__attribute__((target("sse2"))) static const char *
+comment_sse2(const char *p, const char *end) {
+  const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'),
+                nl = _mm_set1_epi8('\n');
+  /* the byte after each one is needed too; p[16] is at most `end` */
+  for (; p + 16 <= end; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i n = _mm_loadu_si128((const __m128i *)(p + 1));
+    __m128i dropped =
+        _mm_and_si128(_mm_cmpeq_epi8(v, sp), _mm_or_si128(_mm_cmpeq_epi8(n, sp),
+                                                          _mm_cmpeq_epi8(n, nl)));
+    __m128i m = _mm_or_si128(
+        dropped, _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, nl)));
+    unsigned bits = _mm_movemask_epi8(m);
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+  return comment_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static const char *
+blank_avx2(const char *p, const char *end) {
+  const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+  for (; p + 32 <= end; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i m =
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, sp), _mm256_cmpeq_epi8(v, tab));
+    unsigned bits = ~(unsigned)_mm256_movemask_epi8(m);
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+  return blank_sse2(p, end);
+}
+
+__attribute__((target("avx2"))) static const char *
+string_avx2(const char *p, const char *end) {
+  const __m256i sq = _mm256_set1_epi8('\''), dq = _mm256_set1_epi8('"'),
+                bs = _mm256_set1_epi8('\\'), tab = _mm256_set1_epi8('\t'),
+                nl = _mm256_set1_epi8('\n');
+  for (; p + 32 <= end; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i m = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, sq), _mm256_cmpeq_epi8(v, dq)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, bs),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(v, tab),
+                                        _mm256_cmpeq_epi8(v, nl))));
+    unsigned bits = _mm256_movemask_epi8(m);
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+  return string_sse2(p, end);
+}
+
+__attribute__((target("avx2"))) static const char *
+comment_avx2(const char *p, const char *end) {
+  const __m256i sp = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'),
+                nl = _mm256_set1_epi8('\n');
+  for (; p + 32 <= end; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i n = _mm256_loadu_si256((const __m256i *)(p + 1));
+    __m256i dropped = _mm256_and_si256(
+        _mm256_cmpeq_epi8(v, sp),
+        _mm256_or_si256(_mm256_cmpeq_epi8(n, sp), _mm256_cmpeq_epi8(n, nl)));
+    __m256i m = _mm256_or_si256(
+        dropped,
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, tab), _mm256_cmpeq_epi8(v, nl)));
+    unsigned bits = _mm256_movemask_epi8(m);
+    if (bits)
+      return p + __builtin_ctz(bits);
+  }
+  return comment_sse2(p, end);
+}
+#endif
+
+const char *(*scan_blank)(const char *p, const char *end) = blank_scalar;
+const char *(*scan_string)(const char *p, const char *end) = string_scalar;
+const char *(*scan_comment)(const char *p, const char *end) = comment_scalar;
+static const char *scan_kind = "scalar";
+
+void scan_init(void) {
+  const char *want = getenv("PFA_SCAN");
+  if (want && strcmp(want, "scalar") == 0)
+    return;
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("sse2"))
+    return;
+  scan_blank = blank_sse2;
+  scan_string = string_sse2;
+  scan_comment = comment_sse2;
+  scan_kind = "sse2";
+  if ((want && strcmp(want, "sse2") == 0) || !__builtin_cpu_supports("avx2"))
+    return;
+  scan_blank = blank_avx2;
+  scan_string = string_avx2;
+  scan_comment = comment_avx2;
+  scan_kind = "avx2";
+#endif
+}
+
+const char *scan_name(void) { return scan_kind; }
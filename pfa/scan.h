@@ -0,0 +1,23 @@
+#ifndef PFA_SCAN_H
+#define PFA_SCAN_H
+
+/* Kernels that skip, in bulk, the bytes of a line that the tokenizer
+ * would only copy or count. Each returns the first position in [p, end)
+ * holding a byte of interest, or `end`, and reads nothing past `end`,
+ * which must itself be readable (it is the line's '\n'). */
+
+/* Not indentation: anything but ' ' or '\t' */
+extern const char *(*scan_blank)(const char *p, const char *end);
+/* Inside a string: a quote of either kind, '\\', '\t', or '\n' */
+extern const char *(*scan_string)(const char *p, const char *end);
+/* Inside a comment: '\t', '\n', or a ' ' followed by ' ' or '\n', since
+ * such spaces are dropped */
+extern const char *(*scan_comment)(const char *p, const char *end);
+
+/* Picks the widest kernels the CPU runs: AVX2, SSE2, or plain C. Setting
+ * PFA_SCAN to "scalar", "sse2" or "avx2" limits the choice. */
+void scan_init(void);
+/* The name of the kernels in use */
+const char *scan_name(void);
+
+#endif
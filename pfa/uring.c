@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+/* Renames, the newest operation used, arrived with Linux 5.11, as did
+ * IORING_FEAT_EXT_ARG; with older headers io_uring is reported missing */
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+
+static const int needed_ops[] = {IORING_OP_OPENAT, IORING_OP_STATX,
+                                 IORING_OP_READ,   IORING_OP_WRITE,
+                                 IORING_OP_CLOSE,  IORING_OP_RENAMEAT};
+
+static int probe_ops(int fd) {
+  enum { NPROBE = 256 };
+  size_t len = sizeof(struct io_uring_probe) +
+               NPROBE * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, len);
+  int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe,
+                   NPROBE) == 0;
+  for (size_t i = 0; ok && i < sizeof(needed_ops) / sizeof(int); i++) {
+    int op = needed_ops[i];
+    ok = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return ok;
+}
+
+int uring_init(struct uring *r, unsigned entries) {
+  memset(r, 0, sizeof(*r));
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0) {
+    return -1;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !probe_ops(r->fd)) {
+    close(r->fd);
+    return -1;
+  }
+  /* both rings share one mapping */
+  r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (r->cq_ring_len > r->sq_ring_len) {
+    r->sq_ring_len = r->cq_ring_len;
+  }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_len,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, r->fd,
+                                        IORING_OFF_SQES);
+  if (r->sq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+    if (r->sq_ring != MAP_FAILED) {
+      munmap(r->sq_ring, r->sq_ring_len);
+    }
+    if (r->sqes != MAP_FAILED) {
+      munmap(r->sqes, r->sqes_len);
+    }
+    close(r->fd);
+    return -1;
+  }
+  r->cq_ring = r->sq_ring;
+  char *sq = (char *)r->sq_ring, *cq = (char *)r->cq_ring;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 0;
+}
+
+void uring_exit(struct uring *r) {
+  munmap(r->sqes, r->sqes_len);
+  munmap(r->sq_ring, r->sq_ring_len);
+  close(r->fd);
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *r, int flags,
+                                    uint64_t data) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *r->sq_tail;
+  if (tail - head > *r->sq_mask) {
+    return NULL;
+  }
+  unsigned idx = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  if (flags & URING_LINK) {
+    sqe->flags |= IOSQE_IO_LINK;
+  }
+  sqe->user_data = data;
+  r->sq_array[idx] = idx;
+  return sqe;
+}
+
+/* Make the entry filled in by get_sqe visible to the kernel */
+static int put_sqe(struct uring *r) {
+  __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+  r->pending++;
+  return 0;
+}
+
+int uring_openat(struct uring *r, const char *path, int oflags, int mode,
+                 int flags, uint64_t data) {
+  struct io_uring_sqe *sqe = get_sqe(r, flags, data);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)path;
+  sqe->len = mode;
+  sqe->open_flags = oflags;
+  return put_sqe(r);
+}
+
+int uring_statx(struct uring *r, int fd, const char *path, struct statx *stx,
+                int flags, uint64_t data) {
+  struct io_uring_sqe *sqe = get_sqe(r, flags, data);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)path;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = (uintptr_t)stx;
+  sqe->statx_flags = path[0] ? 0 : AT_EMPTY_PATH;
+  return put_sqe(r);
+}
+
+/* Reads and writes are whole-file, from the start */
+static int queue_rw(struct uring *r, int op, int fd, const void *buf,
+                    size_t len, int flags, uint64_t data) {
+  if (len > (1u << 31)) {
+    return -1;
+  }
+  struct io_uring_sqe *sqe = get_sqe(r, flags, data);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = 0;
+  return put_sqe(r);
+}
+
+int uring_read(struct uring *r, int fd, void *buf, size_t len, int flags,
+               uint64_t data) {
+  return queue_rw(r, IORING_OP_READ, fd, buf, len, flags, data);
+}
+
+int uring_write(struct uring *r, int fd, const void *buf, size_t len,
+                int flags, uint64_t data) {
+  return queue_rw(r, IORING_OP_WRITE, fd, buf, len, flags, data);
+}
+
+int uring_close(struct uring *r, int fd, int flags, uint64_t data) {
+  struct io_uring_sqe *sqe = get_sqe(r, flags, data);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+  return put_sqe(r);
+}
+
+int uring_rename(struct uring *r, const char *from, const char *to, int flags,
+                 uint64_t data) {
+  struct io_uring_sqe *sqe = get_sqe(r, flags, data);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RENAMEAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t)from;
+  sqe->len = AT_FDCWD;
+  sqe->addr2 = (uintptr_t)to;
+  return put_sqe(r);
+}
+
+unsigned uring_space(struct uring *r) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  return *r->sq_mask + 1 - (*r->sq_tail - head);
+}
+
+int uring_enter(struct uring *r, unsigned wait) {
+  while (1) {
+    int n = syscall(__NR_io_uring_enter, r->fd, r->pending, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n >= 0) {
+      r->pending -= n;
+      return 0;
+    }
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+}
+
+int uring_next(struct uring *r, uint64_t *data, int *res) {
+  unsigned head = *r->cq_head;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+  *data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+#else
+
+int uring_init(struct uring *r, unsigned entries) {
+  (void)entries;
+  memset(r, 0, sizeof(*r));
+  return -1;
+}
+
+void uring_exit(struct uring *r) { (void)r; }
+
+int uring_openat(struct uring *r, const char *path, int oflags, int mode,
+                 int flags, uint64_t data) {
+  return -1;
+}
+
+int uring_statx(struct uring *r, int fd, const char *path, struct statx *stx,
+                int flags, uint64_t data) {
+  return -1;
+}
+
+int uring_read(struct uring *r, int fd, void *buf, size_t len, int flags,
+               uint64_t data) {
+  return -1;
+}
+
+int uring_write(struct uring *r, int fd, const void *buf, size_t len,
+                int flags, uint64_t data) {
+  return -1;
+}
+
+int uring_close(struct uring *r, int fd, int flags, uint64_t data) {
+  return -1;
+}
+
+int uring_rename(struct uring *r, const char *from, const char *to, int flags,
+                 uint64_t data) {
+  return -1;
+}
+
+unsigned uring_space(struct uring *r) { return 0; }
+
+int uring_enter(struct uring *r, unsigned wait) { return -1; }
+
+int uring_next(struct uring *r, uint64_t *data, int *res) { return 0; }
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef PFA_URING_H
+#define PFA_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct statx;
+
+/* A minimal io_uring, driven through the raw system calls. Only one
+ * thread may use a ring. */
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_len, cq_ring_len, sqes_len;
+  /* entries filled in since the last uring_enter */
+  unsigned pending;
+};
+
+/* Set up a ring of `entries` submissions. Returns nonzero if io_uring is
+ * missing, disabled, or lacks an operation used below. */
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+
+/* Flag for queued operations: the next operation only starts once a
+ * LINKed one succeeds, and otherwise completes with -ECANCELED */
+enum { URING_LINK = 1 };
+
+/* Queue one operation, whose completion will carry `data`. Each returns
+ * -1 if every submission entry is already pending. */
+int uring_openat(struct uring *r, const char *path, int oflags, int mode,
+                 int flags, uint64_t data);
+/* Stats `path` relative to the directory `fd`, or `fd` itself if `path`
+ * is empty */
+int uring_statx(struct uring *r, int fd, const char *path, struct statx *stx,
+                int flags, uint64_t data);
+int uring_read(struct uring *r, int fd, void *buf, size_t len, int flags,
+               uint64_t data);
+int uring_write(struct uring *r, int fd, const void *buf, size_t len,
+                int flags, uint64_t data);
+int uring_close(struct uring *r, int fd, int flags, uint64_t data);
+int uring_rename(struct uring *r, const char *from, const char *to, int flags,
+                 uint64_t data);
+
+/* How many more operations can be queued before uring_enter */
+unsigned uring_space(struct uring *r);
+
+/* Submit what is queued, then wait until at least `wait` completions are
+ * ready. Returns -1 on failure. */
+int uring_enter(struct uring *r, unsigned wait);
+
+/* Take the oldest ready completion; returns 0 if there is none */
+int uring_next(struct uring *r, uint64_t *data, int *res);
+
+#endif
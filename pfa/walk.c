@@ -0,0 +1,583 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "walk.h"
+
+/* Ignore rules, precompiled from gitignore syntax. Most real patterns
+ * are a plain name or "*.ext", which are matched without the glob
+ * interpreter. */
+enum { RULE_EXACT, RULE_SUFFIX, RULE_PREFIX, RULE_GLOB };
+
+struct rule {
+  const char *pat;
+  int len;
+  int kind;
+  int negate;
+  int dironly;
+  /* match against the path below the rule's directory, not the name */
+  int anchored;
+};
+
+/* The rules of one ignore file, chained to those of enclosing folders */
+struct ignlist {
+  struct ignlist *parent;
+  struct ignlist *next_alloc;
+  /* bytes of a path to skip to get the part relative to this list */
+  int skip;
+  int nrules;
+  struct rule *rules;
+  char *text;
+};
+
+struct dirtask {
+  char *path;
+  struct ignlist *ign;
+  struct ignlist *cmd;
+  int root;
+};
+
+struct walkstate {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct dirtask *tasks;
+  int ntasks;
+  int maxtasks;
+  /* walkers holding a task, and walkers waiting for one */
+  int busy;
+  int idle;
+  struct ignlist *lists;
+  walk_found_fn found;
+  void *arg;
+  int failed;
+};
+
+/* Per-thread path being built, extended and truncated while recursing */
+struct pathbuf {
+  char *s;
+  int len;
+  int cap;
+};
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+enum { DENTS_BUFSIZE = 1 << 15 };
+
+/* Match `[s, se)` against the glob `[p, pe)`. `*` and `?` never match
+ * '/'; `**` matches across directories. */
+static int glob_match(const char *p, const char *pe, const char *s,
+                      const char *se) {
+  while (p < pe) {
+    if (*p == '*') {
+      if (p + 1 < pe && p[1] == '*') {
+        while (p < pe && *p == '*')
+          p++;
+        if (p < pe && *p == '/') {
+          /* "**" then a slash: zero or more whole directories */
+          p++;
+          for (const char *t = s; t <= se; t++) {
+            if ((t == s || t[-1] == '/') && glob_match(p, pe, t, se))
+              return 1;
+          }
+          return 0;
+        }
+        for (const char *t = s; t <= se; t++) {
+          if (glob_match(p, pe, t, se))
+            return 1;
+        }
+        return 0;
+      }
+      p++;
+      for (const char *t = s;; t++) {
+        if (glob_match(p, pe, t, se))
+          return 1;
+        if (t == se || *t == '/')
+          return 0;
+      }
+    }
+    if (s == se) {
+      return 0;
+    }
+    if (*p == '?') {
+      if (*s == '/')
+        return 0;
+    } else if (*p == '[') {
+      const char *q = p + 1;
+      int invert = 0;
+      if (q < pe && (*q == '!' || *q == '^')) {
+        invert = 1;
+        q++;
+      }
+      int hit = 0;
+      const char *first = q;
+      while (q < pe && (*q != ']' || q == first)) {
+        if (q + 2 < pe && q[1] == '-' && q[2] != ']') {
+          if (q[0] <= *s && *s <= q[2])
+            hit = 1;
+          q += 3;
+        } else {
+          if (*q == *s)
+            hit = 1;
+          q++;
+        }
+      }
+      if (q >= pe) {
+        /* unterminated class: a literal '[' */
+        if (*s != '[')
+          return 0;
+      } else {
+        if (hit == invert || *s == '/')
+          return 0;
+        p = q;
+      }
+    } else {
+      if (*p == '\\' && p + 1 < pe)
+        p++;
+      if (*p != *s)
+        return 0;
+    }
+    p++;
+    s++;
+  }
+  return s == se;
+}
+
+static int has_glob(const char *s, int len) {
+  for (int i = 0; i < len; i++) {
+    if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\')
+      return 1;
+  }
+  return 0;
+}
+
+/* Parse one line of an ignore file in place; returns 0 if it is empty */
+static int compile_rule(struct rule *r, char *line, int len) {
+  while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ') &&
+         (len < 2 || line[len - 2] != '\\')) {
+    len--;
+  }
+  if (len == 0 || line[0] == '#') {
+    return 0;
+  }
+  r->negate = 0;
+  r->dironly = 0;
+  r->anchored = 0;
+  if (line[0] == '!') {
+    r->negate = 1;
+    line++;
+    len--;
+  }
+  if (len > 0 && line[len - 1] == '/') {
+    r->dironly = 1;
+    len--;
+  }
+  if (memchr(line, '/', len)) {
+    r->anchored = 1;
+    if (line[0] == '/') {
+      line++;
+      len--;
+    }
+  }
+  if (len <= 0) {
+    return 0;
+  }
+  r->pat = line;
+  r->len = len;
+  if (!has_glob(line, len)) {
+    r->kind = RULE_EXACT;
+  } else if (line[0] == '*' && len > 1 && !has_glob(line + 1, len - 1)) {
+    r->kind = RULE_SUFFIX;
+  } else if (line[len - 1] == '*' && !has_glob(line, len - 1)) {
+    r->kind = RULE_PREFIX;
+  } else {
+    r->kind = RULE_GLOB;
+  }
+  return 1;
+}
+
+static struct ignlist *make_ignlist(struct walkstate *ws, char *text,
+                                    int textlen, int skip,
+                                    struct ignlist *parent) {
+  struct ignlist *l = (struct ignlist *)malloc(sizeof(struct ignlist));
+  int maxrules = 1;
+  for (int i = 0; i < textlen; i++) {
+    if (text[i] == '\n')
+      maxrules++;
+  }
+  l->rules = (struct rule *)malloc(sizeof(struct rule) * maxrules);
+  l->nrules = 0;
+  l->text = text;
+  l->skip = skip;
+  l->parent = parent;
+  for (int s = 0; s < textlen;) {
+    char *nl = (char *)memchr(&text[s], '\n', textlen - s);
+    int e = nl ? nl - text : textlen;
+    if (compile_rule(&l->rules[l->nrules], &text[s], e - s)) {
+      l->nrules++;
+    }
+    s = e + 1;
+  }
+  pthread_mutex_lock(&ws->lock);
+  l->next_alloc = ws->lists;
+  ws->lists = l;
+  pthread_mutex_unlock(&ws->lock);
+  return l;
+}
+
+/* Returns 1 if excluded, 0 if re-included, -1 if no rule matches */
+static int match_list(const struct ignlist *l, const char *path, int pathlen,
+                      int isdir) {
+  const char *rel = path + l->skip;
+  const char *end = path + pathlen;
+  const char *base = end;
+  while (base > rel && base[-1] != '/')
+    base--;
+  for (int i = l->nrules - 1; i >= 0; i--) {
+    const struct rule *r = &l->rules[i];
+    if (r->dironly && !isdir)
+      continue;
+    const char *s = r->anchored ? rel : base;
+    int slen = end - s;
+    int hit;
+    switch (r->kind) {
+    case RULE_EXACT:
+      hit = slen == r->len && memcmp(s, r->pat, slen) == 0;
+      break;
+    case RULE_SUFFIX:
+      hit = slen >= r->len - 1 &&
+            memcmp(end - (r->len - 1), r->pat + 1, r->len - 1) == 0 &&
+            (r->anchored ? !memchr(s, '/', slen - (r->len - 1)) : 1);
+      break;
+    case RULE_PREFIX:
+      hit = slen >= r->len - 1 && memcmp(s, r->pat, r->len - 1) == 0 &&
+            !memchr(s + r->len - 1, '/', slen - (r->len - 1));
+      break;
+    default:
+      hit = glob_match(r->pat, r->pat + r->len, s, end);
+      break;
+    }
+    if (hit) {
+      return !r->negate;
+    }
+  }
+  return -1;
+}
+
+static int is_ignored(const struct dirtask *t, const struct ignlist *ign,
+                      const char *path, int pathlen, int isdir) {
+  int r = t->cmd ? match_list(t->cmd, path, pathlen, isdir) : -1;
+  for (const struct ignlist *l = ign; r < 0 && l; l = l->parent) {
+    r = match_list(l, path, pathlen, isdir);
+  }
+  return r > 0;
+}
+
+static struct ignlist *load_ignore(struct walkstate *ws, int dfd, int skip,
+                                   struct ignlist *parent) {
+  int fd = openat(dfd, ".gitignore", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return parent;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+    close(fd);
+    return parent;
+  }
+  char *text = (char *)malloc(st.st_size);
+  ssize_t got = 0;
+  while (got < st.st_size) {
+    ssize_t r = read(fd, text + got, st.st_size - got);
+    if (r <= 0)
+      break;
+    got += r;
+  }
+  close(fd);
+  return make_ignlist(ws, text, got, skip, parent);
+}
+
+static void pathbuf_set(struct pathbuf *pb, int len, const char *name,
+                        int nlen) {
+  if (pb->cap < len + nlen + 2) {
+    pb->cap = 2 * (len + nlen + 2);
+    pb->s = (char *)realloc(pb->s, pb->cap);
+  }
+  pb->len = len;
+  if (len > 0 && pb->s[len - 1] != '/') {
+    pb->s[pb->len++] = '/';
+  }
+  memcpy(&pb->s[pb->len], name, nlen);
+  pb->len += nlen;
+  pb->s[pb->len] = '\0';
+}
+
+int walk_selected(const char *name, int nlen) {
+  return (nlen > 3 && memcmp(name + nlen - 3, ".py", 3) == 0) ||
+         (nlen > 4 && memcmp(name + nlen - 4, ".pyi", 4) == 0);
+}
+
+static void push_task(struct walkstate *ws, char *path, struct ignlist *ign,
+                      struct ignlist *cmd, int root) {
+  pthread_mutex_lock(&ws->lock);
+  if (ws->ntasks == ws->maxtasks) {
+    ws->maxtasks = ws->maxtasks ? 2 * ws->maxtasks : 16;
+    ws->tasks = (struct dirtask *)realloc(
+        ws->tasks, sizeof(struct dirtask) * ws->maxtasks);
+  }
+  ws->tasks[ws->ntasks].path = path;
+  ws->tasks[ws->ntasks].ign = ign;
+  ws->tasks[ws->ntasks].cmd = cmd;
+  ws->tasks[ws->ntasks].root = root;
+  ws->ntasks++;
+  pthread_cond_signal(&ws->cond);
+  pthread_mutex_unlock(&ws->lock);
+}
+
+/* List the directory open at `dfd`, whose path is in `pb`. Files are
+ * handed out immediately; subdirectories are given to idle walkers, or
+ * else descended into with openat. */
+static void walk_dir(struct walkstate *ws, const struct dirtask *t, int dfd,
+                     struct pathbuf *pb, char *dents, struct ignlist *ign) {
+  int dirlen = pb->len;
+  int skip = dirlen > 0 && pb->s[dirlen - 1] != '/' ? dirlen + 1 : dirlen;
+  ign = load_ignore(ws, dfd, skip, ign);
+
+  char *subdirs = NULL;
+  int sublen = 0, subcap = 0;
+  while (1) {
+    long n = syscall(SYS_getdents64, dfd, dents, DENTS_BUFSIZE);
+    if (n <= 0)
+      break;
+    for (long off = 0; off < n;) {
+      struct linux_dirent64 *de = (struct linux_dirent64 *)(dents + off);
+      off += de->d_reclen;
+      const char *name = de->d_name;
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0') ||
+           strcmp(name, ".git") == 0)) {
+        continue;
+      }
+      int type = de->d_type;
+      if (type == DT_UNKNOWN) {
+        struct stat st;
+        if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+          continue;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : 0;
+      }
+      int nlen = strlen(name);
+      if (type == DT_DIR) {
+        pathbuf_set(pb, dirlen, name, nlen);
+        if (is_ignored(t, ign, pb->s, pb->len, 1))
+          continue;
+        if (sublen + nlen + 1 > subcap) {
+          subcap = 2 * (sublen + nlen + 1);
+          subdirs = (char *)realloc(subdirs, subcap);
+        }
+        memcpy(&subdirs[sublen], name, nlen + 1);
+        sublen += nlen + 1;
+      } else if (type == DT_REG && walk_selected(name, nlen)) {
+        pathbuf_set(pb, dirlen, name, nlen);
+        if (!is_ignored(t, ign, pb->s, pb->len, 0)) {
+          ws->found(pb->s, ws->arg);
+        }
+      }
+    }
+  }
+
+  for (int s = 0; s < sublen;) {
+    const char *name = &subdirs[s];
+    int nlen = strlen(name);
+    s += nlen + 1;
+    pathbuf_set(pb, dirlen, name, nlen);
+    if (__atomic_load_n(&ws->idle, __ATOMIC_RELAXED) > 0) {
+      push_task(ws, strdup(pb->s), ign, t->cmd, 0);
+      continue;
+    }
+    int cfd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (cfd >= 0) {
+      walk_dir(ws, t, cfd, pb, dents, ign);
+      close(cfd);
+    }
+  }
+  free(subdirs);
+  pb->len = dirlen;
+}
+
+static void *walker_thread(void *varg) {
+  struct walkstate *ws = (struct walkstate *)varg;
+  struct pathbuf pb = {NULL, 0, 0};
+  char *dents = (char *)malloc(DENTS_BUFSIZE);
+  pthread_mutex_lock(&ws->lock);
+  while (1) {
+    while (ws->ntasks == 0 && ws->busy > 0) {
+      __atomic_add_fetch(&ws->idle, 1, __ATOMIC_RELAXED);
+      pthread_cond_wait(&ws->cond, &ws->lock);
+      __atomic_sub_fetch(&ws->idle, 1, __ATOMIC_RELAXED);
+    }
+    if (ws->ntasks == 0) {
+      break;
+    }
+    struct dirtask t = ws->tasks[--ws->ntasks];
+    ws->busy++;
+    pthread_mutex_unlock(&ws->lock);
+
+    int fd = open(t.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+      pathbuf_set(&pb, 0, t.path, strlen(t.path));
+      walk_dir(ws, &t, fd, &pb, dents, t.ign);
+      close(fd);
+    } else if (t.root) {
+      __atomic_store_n(&ws->failed, 1, __ATOMIC_RELAXED);
+    }
+    free(t.path);
+
+    pthread_mutex_lock(&ws->lock);
+    ws->busy--;
+  }
+  pthread_cond_broadcast(&ws->cond);
+  pthread_mutex_unlock(&ws->lock);
+  free(pb.s);
+  free(dents);
+  return NULL;
+}
+
+/* The command line excludes, as an ignore file in the root `path` */
+static struct ignlist *exclude_list(struct walkstate *ws, const char *path,
+                                    const char *const *excludes,
+                                    int nexcludes) {
+  if (nexcludes == 0) {
+    return NULL;
+  }
+  int exlen = 0;
+  for (int i = 0; i < nexcludes; i++) {
+    exlen += strlen(excludes[i]) + 1;
+  }
+  char *text = (char *)malloc(exlen);
+  char *p = text;
+  for (int k = 0; k < nexcludes; k++) {
+    int l = strlen(excludes[k]);
+    memcpy(p, excludes[k], l);
+    p[l] = '\n';
+    p += l + 1;
+  }
+  int plen = strlen(path);
+  int skip = path[plen - 1] == '/' ? plen : plen + 1;
+  return make_ignlist(ws, text, exlen, skip, NULL);
+}
+
+static void free_lists(struct walkstate *ws) {
+  while (ws->lists) {
+    struct ignlist *l = ws->lists;
+    ws->lists = l->next_alloc;
+    free(l->rules);
+    free(l->text);
+    free(l);
+  }
+}
+
+int walk_excluded(const char *root, const char *const *excludes,
+                  int nexcludes, const char *path, int isdir) {
+  int plen = strlen(root);
+  while (plen > 1 && root[plen - 1] == '/')
+    plen--;
+  int len = strlen(path);
+  if (len <= plen || strncmp(path, root, plen) != 0) {
+    return 0;
+  }
+  struct walkstate ws;
+  pthread_mutex_init(&ws.lock, NULL);
+  ws.lists = NULL;
+  char *dir = strndup(path, plen);
+  struct dirtask t = {NULL, NULL, exclude_list(&ws, dir, excludes, nexcludes),
+                      1};
+  struct ignlist *ign = NULL;
+  int excluded = 0;
+  /* load the ignore files of the directories on the way down, as
+   * walk_dir would, stopping at any it would not enter */
+  int dirlen = plen;
+  while (1) {
+    int skip = path[dirlen - 1] != '/' ? dirlen + 1 : dirlen;
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (dfd >= 0) {
+      ign = load_ignore(&ws, dfd, skip, ign);
+      close(dfd);
+    }
+    const char *name = path + skip;
+    const char *slash = strchr(name, '/');
+    int end = slash ? slash - path : len;
+    if (end - skip == 4 && memcmp(name, ".git", 4) == 0) {
+      excluded = 1;
+      break;
+    }
+    if (!slash) {
+      excluded = is_ignored(&t, ign, path, len, isdir);
+      break;
+    }
+    if (is_ignored(&t, ign, path, end, 1)) {
+      excluded = 1;
+      break;
+    }
+    dirlen = end;
+    dir = strndup(path, dirlen);
+  }
+  free_lists(&ws);
+  pthread_mutex_destroy(&ws.lock);
+  return excluded;
+}
+
+int walk_trees(char *const *roots, int nroots, const char *const *excludes,
+               int nexcludes, int nwalkers, walk_found_fn found, void *arg) {
+  struct walkstate ws;
+  pthread_mutex_init(&ws.lock, NULL);
+  pthread_cond_init(&ws.cond, NULL);
+  ws.tasks = NULL;
+  ws.ntasks = 0;
+  ws.maxtasks = 0;
+  ws.busy = 0;
+  ws.idle = 0;
+  ws.lists = NULL;
+  ws.found = found;
+  ws.arg = arg;
+  ws.failed = 0;
+
+  /* command line excludes are one ignore file per root */
+  for (int i = 0; i < nroots; i++) {
+    char *path = strdup(roots[i]);
+    int plen = strlen(path);
+    while (plen > 1 && path[plen - 1] == '/')
+      path[--plen] = '\0';
+    push_task(&ws, path, NULL, exclude_list(&ws, path, excludes, nexcludes),
+              1);
+  }
+
+  if (nwalkers < 1)
+    nwalkers = 1;
+  pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * nwalkers);
+  for (int i = 0; i < nwalkers; i++) {
+    pthread_create(&threads[i], NULL, walker_thread, &ws);
+  }
+  for (int i = 0; i < nwalkers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  free_lists(&ws);
+  free(ws.tasks);
+  pthread_mutex_destroy(&ws.lock);
+  pthread_cond_destroy(&ws.cond);
+  return ws.failed;
+}
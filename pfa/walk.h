@@ -0,0 +1,24 @@
+#ifndef PFA_WALK_H
+#define PFA_WALK_H
+
+/* Called from walker threads for each selected file, as soon as it is
+ * found. `path` is only valid for the duration of the call. */
+typedef void (*walk_found_fn)(const char *path, void *arg);
+
+/* Recursively walk `roots` on `nwalkers` threads, selecting *.py and *.pyi
+ * files that are not excluded by `.gitignore` files in the walked
+ * directories or by the gitignore-style `excludes` (relative to each
+ * root). Returns nonzero if a root could not be opened. */
+int walk_trees(char *const *roots, int nroots, const char *const *excludes,
+               int nexcludes, int nwalkers, walk_found_fn found, void *arg);
+
+/* Whether walk_trees selects a file named `name`, of length `nlen` */
+int walk_selected(const char *name, int nlen);
+
+/* Whether walk_trees, walking `root`, would pass over `path`, which lies
+ * below it, or over a directory on the way to it. The ignore files on
+ * the way are read afresh. */
+int walk_excluded(const char *root, const char *const *excludes,
+                  int nexcludes, const char *path, int isdir);
+
+#endif
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "watch.h"
+
+/* Saves are gathered until none has come for QUIET_MS, or the first has
+ * waited MAX_WAIT_MS, so that a burst of them is handled at once */
+enum { QUIET_MS = 2, MAX_WAIT_MS = 100 };
+
+enum {
+  DIR_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE |
+               IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK
+};
+
+/* pfai writes formatted files here, then renames them into place */
+static const char own_prefix[] = ".pfa_";
+
+struct watchstate {
+  int fd;
+  char **roots;
+  int nroots;
+  const char *const *excludes;
+  int nexcludes;
+  /* path and root of each watched directory, by watch descriptor */
+  char **dirs;
+  int *dirroots;
+  int maxdirs;
+  /* saved files not yet passed on */
+  char **pending;
+  int npending;
+  int maxpending;
+  /* the cookie of the last rename from one of pfai's temporary files */
+  uint32_t own_cookie;
+  int own_moving;
+  /* events were lost; every tree is walked again once saves pause */
+  int rescan;
+  /* every save before this was seen as an event; after lost events, only
+   * files modified since are passed on */
+  struct timespec handled;
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static char *join_path(const char *dir, const char *name) {
+  int dlen = strlen(dir), nlen = strlen(name);
+  char *p = (char *)malloc(dlen + nlen + 2);
+  memcpy(p, dir, dlen);
+  if (dlen > 0 && dir[dlen - 1] != '/') {
+    p[dlen++] = '/';
+  }
+  memcpy(&p[dlen], name, nlen + 1);
+  return p;
+}
+
+/* Watch the directory `path`, and those below it that walk_trees would
+ * enter. Returns nonzero if `path` itself could not be watched. */
+static int add_tree(struct watchstate *ws, const char *path, int root) {
+  int wd = inotify_add_watch(ws->fd, path, DIR_EVENTS);
+  if (wd < 0) {
+    return 1;
+  }
+  if (wd >= ws->maxdirs) {
+    int old = ws->maxdirs;
+    ws->maxdirs = 2 * wd + 16;
+    ws->dirs = (char **)realloc(ws->dirs, sizeof(char *) * ws->maxdirs);
+    ws->dirroots = (int *)realloc(ws->dirroots, sizeof(int) * ws->maxdirs);
+    memset(&ws->dirs[old], 0, sizeof(char *) * (ws->maxdirs - old));
+  }
+  /* a directory moved within the tree keeps its descriptor */
+  free(ws->dirs[wd]);
+  ws->dirs[wd] = strdup(path);
+  ws->dirroots[wd] = root;
+
+  DIR *d = opendir(path);
+  if (!d) {
+    return 0;
+  }
+  struct dirent *de;
+  while ((de = readdir(d))) {
+    const char *name = de->d_name;
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0') ||
+         strcmp(name, ".git") == 0)) {
+      continue;
+    }
+    int isdir = de->d_type == DT_DIR;
+    if (de->d_type == DT_UNKNOWN) {
+      struct stat st;
+      isdir = fstatat(dirfd(d), name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+              S_ISDIR(st.st_mode);
+    }
+    if (!isdir) {
+      continue;
+    }
+    char *sub = join_path(path, name);
+    if (!walk_excluded(ws->roots[root], ws->excludes, ws->nexcludes, sub,
+                       1)) {
+      add_tree(ws, sub, root);
+    }
+    free(sub);
+  }
+  closedir(d);
+  return 0;
+}
+
+/* Stop watching `path` and the directories below it, which have moved */
+static void drop_tree(struct watchstate *ws, const char *path) {
+  int len = strlen(path);
+  for (int wd = 0; wd < ws->maxdirs; wd++) {
+    const char *dir = ws->dirs[wd];
+    if (dir && strncmp(dir, path, len) == 0 &&
+        (dir[len] == '\0' || dir[len] == '/')) {
+      inotify_rm_watch(ws->fd, wd);
+      free(ws->dirs[wd]);
+      ws->dirs[wd] = NULL;
+    }
+  }
+}
+
+static void add_pending(struct watchstate *ws, char *path) {
+  for (int i = 0; i < ws->npending; i++) {
+    if (strcmp(ws->pending[i], path) == 0) {
+      free(path);
+      return;
+    }
+  }
+  if (ws->npending == ws->maxpending) {
+    ws->maxpending = ws->maxpending ? 2 * ws->maxpending : 16;
+    ws->pending =
+        (char **)realloc(ws->pending, sizeof(char *) * ws->maxpending);
+  }
+  ws->pending[ws->npending++] = path;
+}
+
+static void handle_event(struct watchstate *ws,
+                         const struct inotify_event *ev) {
+  if (ev->mask & IN_Q_OVERFLOW) {
+    ws->rescan = 1;
+    ws->own_moving = 0;
+    return;
+  }
+  if (ev->wd < 0 || ev->wd >= ws->maxdirs) {
+    return;
+  }
+  if (ev->mask & IN_IGNORED) {
+    free(ws->dirs[ev->wd]);
+    ws->dirs[ev->wd] = NULL;
+    return;
+  }
+  const char *dir = ws->dirs[ev->wd];
+  if (!dir || ev->len == 0) {
+    return;
+  }
+  int root = ws->dirroots[ev->wd];
+  const char *name = ev->name;
+  if (ev->mask & IN_ISDIR) {
+    if (strcmp(name, ".git") == 0) {
+      return;
+    }
+    char *sub = join_path(dir, name);
+    if (ev->mask & IN_MOVED_FROM) {
+      drop_tree(ws, sub);
+    } else if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+               !walk_excluded(ws->roots[root], ws->excludes, ws->nexcludes,
+                              sub, 1)) {
+      add_tree(ws, sub, root);
+    }
+    free(sub);
+    return;
+  }
+  if (ev->mask & IN_MOVED_FROM) {
+    if (strncmp(name, own_prefix, sizeof(own_prefix) - 1) == 0) {
+      ws->own_cookie = ev->cookie;
+      ws->own_moving = 1;
+    }
+    return;
+  }
+  if ((ev->mask & IN_MOVED_TO) && ws->own_moving &&
+      ev->cookie == ws->own_cookie) {
+    ws->own_moving = 0;
+    return;
+  }
+  if ((ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) &&
+      walk_selected(name, strlen(name))) {
+    char *path = join_path(dir, name);
+    if (walk_excluded(ws->roots[root], ws->excludes, ws->nexcludes, path,
+                      0)) {
+      free(path);
+    } else {
+      add_pending(ws, path);
+    }
+  }
+}
+
+/* File timestamps come from the coarse clock */
+static struct timespec now_coarse(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  return ts;
+}
+
+struct rescan_arg {
+  struct timespec since;
+  walk_found_fn changed;
+  void *arg;
+};
+
+static void rescan_found(const char *path, void *varg) {
+  struct rescan_arg *ra = (struct rescan_arg *)varg;
+  struct stat st;
+  if (stat(path, &st) == 0 &&
+      (st.st_mtim.tv_sec > ra->since.tv_sec ||
+       (st.st_mtim.tv_sec == ra->since.tv_sec &&
+        st.st_mtim.tv_nsec >= ra->since.tv_nsec))) {
+    ra->changed(path, ra->arg);
+  }
+}
+
+/* After lost events: watch any directories made meanwhile, and pass on
+ * the files modified since the last events known to be complete */
+static void rescan(struct watchstate *ws, walk_found_fn changed, void *arg) {
+  for (int i = 0; i < ws->nroots; i++) {
+    add_tree(ws, ws->roots[i], i);
+  }
+  for (int i = 0; i < ws->npending; i++) {
+    free(ws->pending[i]);
+  }
+  ws->npending = 0;
+  ws->rescan = 0;
+  struct rescan_arg ra = {ws->handled, changed, arg};
+  /* saves during the walk are seen as events from now on */
+  ws->handled = now_coarse();
+  /* on one walker, so `changed` is never called concurrently */
+  walk_trees(ws->roots, ws->nroots, ws->excludes, ws->nexcludes, 1,
+             rescan_found, &ra);
+}
+
+int watch_trees(char *const *roots, int nroots, const char *const *excludes,
+                int nexcludes, walk_found_fn changed, void *arg) {
+  struct watchstate ws;
+  memset(&ws, 0, sizeof(ws));
+  ws.fd = inotify_init1(IN_CLOEXEC);
+  if (ws.fd < 0) {
+    return 1;
+  }
+  ws.excludes = excludes;
+  ws.nexcludes = nexcludes;
+  ws.nroots = nroots;
+  ws.roots = (char **)malloc(sizeof(char *) * nroots);
+  ws.handled = now_coarse();
+  int failed = 0;
+  for (int i = 0; i < nroots; i++) {
+    int plen = strlen(roots[i]);
+    while (plen > 1 && roots[i][plen - 1] == '/')
+      plen--;
+    ws.roots[i] = strndup(roots[i], plen);
+    failed |= add_tree(&ws, ws.roots[i], i);
+  }
+
+  char buf[1 << 16]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  uint64_t first = 0, last = 0;
+  while (!failed) {
+    int timeout = -1;
+    if (ws.npending > 0 || ws.rescan) {
+      uint64_t t = now_ms();
+      int64_t wait = (int64_t)(last + QUIET_MS - t);
+      int64_t limit = (int64_t)(first + MAX_WAIT_MS - t);
+      if (limit < wait) {
+        wait = limit;
+      }
+      timeout = wait > 0 ? (int)wait : 0;
+    }
+    struct pollfd p = {ws.fd, POLLIN, 0};
+    int r = poll(&p, 1, timeout);
+    if (r < 0 && errno != EINTR) {
+      failed = 1;
+      break;
+    }
+    if (r > 0) {
+      struct timespec reading = now_coarse();
+      ssize_t n = read(ws.fd, buf, sizeof(buf));
+      if (n < 0 && errno != EINTR && errno != EAGAIN) {
+        failed = 1;
+        break;
+      }
+      int before = ws.npending + ws.rescan;
+      for (ssize_t off = 0; off < n;) {
+        const struct inotify_event *ev =
+            (const struct inotify_event *)&buf[off];
+        handle_event(&ws, ev);
+        off += sizeof(struct inotify_event) + ev->len;
+      }
+      /* with room to spare for another event, the queue was emptied, so
+       * every save before the read is accounted for */
+      if (!ws.rescan &&
+          n >= 0 && (size_t)n + sizeof(struct inotify_event) + NAME_MAX + 1 <=
+                        sizeof(buf)) {
+        ws.handled = reading;
+      }
+      if (ws.npending + ws.rescan > before) {
+        last = now_ms();
+        if (before == 0) {
+          first = last;
+        }
+      }
+    }
+    if (ws.npending > 0 || ws.rescan) {
+      uint64_t t = now_ms();
+      if (ws.rescan && (t >= last + QUIET_MS || t >= first + MAX_WAIT_MS)) {
+        rescan(&ws, changed, arg);
+      } else if (t >= last + QUIET_MS || t >= first + MAX_WAIT_MS) {
+        for (int i = 0; i < ws.npending; i++) {
+          changed(ws.pending[i], arg);
+          free(ws.pending[i]);
+        }
+        ws.npending = 0;
+      }
+    }
+  }
+
+  for (int i = 0; i < ws.maxdirs; i++) {
+    free(ws.dirs[i]);
+  }
+  for (int i = 0; i < nroots; i++) {
+    free(ws.roots[i]);
+  }
+  for (int i = 0; i < ws.npending; i++) {
+    free(ws.pending[i]);
+  }
+  free(ws.dirs);
+  free(ws.dirroots);
+  free(ws.roots);
+  free(ws.pending);
+  close(ws.fd);
+  return failed;
+}
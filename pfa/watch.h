@@ -0,0 +1,17 @@
+#ifndef PFA_WATCH_H
+#define PFA_WATCH_H
+
+#include "walk.h"
+
+/* Watch the trees under `roots` with inotify, and call `changed` with each
+ * file that walk_trees would select once it is saved: written and closed,
+ * or renamed into place. Saves are passed on when writes pause for a few
+ * milliseconds, each file once. pfai's own renames into place, from its
+ * ".pfa_" temporary files, are passed over. If the event queue overflows,
+ * the trees are walked again, and the selected files modified since the
+ * last events known to be complete are passed on. Only returns, with 1,
+ * if a root could not be watched or events could not be read. */
+int watch_trees(char *const *roots, int nroots, const char *const *excludes,
+                int nexcludes, walk_found_fn changed, void *arg);
+
+#endif
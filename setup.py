@@ -7,11 +7,22 @@ VERSION='0.4'
 class build_and_make_exec(build):
     def run(self):
         from distutils.ccompiler import new_compiler
+        import subprocess
         comp = new_compiler()
-        comp.compile(['pfa/pfa.c'], extra_preargs=['-Wall',
-            '-fno-omit-frame-pointer', '-Os'])
-        comp.link_executable(['pfa/pfa.o'], 'pfa/pfa')
-        comp.link_executable(['pfa/pfa.o'], 'pfa/pfai')
+        # the tokenizer's tables are generated from lexer.def
+        gen = comp.compile(['pfa/genlex.c'])
+        comp.link_executable(gen, 'pfa/genlex')
+        subprocess.check_call(['pfa/genlex', 'pfa/lexer.def', 'pfa/lextab.h'])
+        flags = ['-Wall', '-fno-omit-frame-pointer', '-Os', '-pthread']
+        lib = comp.compile(['pfa/cache.c', 'pfa/format.c', 'pfa/scan.c'],
+            extra_preargs=flags)
+        cli = comp.compile(['pfa/pfa.c', 'pfa/walk.c', 'pfa/watch.c',
+            'pfa/diff.c', 'pfa/embed.c', 'pfa/gitindex.c', 'pfa/uring.c'],
+            extra_preargs=flags)
+        daemon = comp.compile(['pfa/pfad.c'], extra_preargs=flags)
+        comp.link_executable(cli + lib, 'pfa/pfa', libraries=['pthread', 'z'])
+        comp.link_executable(cli + lib, 'pfa/pfai', libraries=['pthread', 'z'])
+        comp.link_executable(daemon + lib, 'pfa/pfad', libraries=['pthread'])
         build.run(self)
 
 setup(name='pfa', packages=['pfa',], version=VERSION,
@@ -31,7 +42,7 @@ setup(name='pfa', packages=['pfa',], version=VERSION,
 
     cmdclass = {'build':build_and_make_exec},
 
-    data_files = [('bin/', ['pfa/pfa', 'pfa/pfai'])],
+    data_files = [('bin/', ['pfa/pfa', 'pfa/pfai', 'pfa/pfad'])],
 
     classifiers = ["License :: OSI Approved :: MIT License",
         "Intended Audience :: Developers",
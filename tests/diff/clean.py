@@ -0,0 +1,2 @@
+def already(formatted, args):
+    return [formatted, args]
@@ -0,0 +1,43 @@
+import os,sys
+# changes at the start, the end, and in between: some far enough apart for
+# hunks of their own, and some close enough that their hunks merge
+
+def unchanged_one():
+    return "one"
+
+def unchanged_two():
+    return "two"
+
+def unchanged_three():
+    return "three"
+
+def unchanged_four():
+    return "four"
+
+def unchanged_five():
+    return "five"
+
+def second( x ):
+    y=[ x,x ]
+    return y
+
+def near_second():
+    return x+1
+
+def unchanged_six():
+    return "six"
+
+def unchanged_seven():
+    return "seven"
+
+def unchanged_eight():
+    return "eight"
+
+def unchanged_nine():
+    return "nine"
+
+def unchanged_ten():
+    return "ten"
+
+def last():
+    return ( 1,2 )
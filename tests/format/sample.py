@@ -0,0 +1,42 @@
+"""A module of the things the formatter has to get right: strings of
+every kind, brackets over several lines, continuations, and lines long
+enough to be broken."""
+import os,sys
+from collections import (OrderedDict,
+    defaultdict)
+
+
+@decorator( arg=1 )
+class Thing( object ):
+    '''docstring with 'quotes' and "quotes"'''
+    table={ 'a':1,'b':[ 1,2,3 ],'c':( 4, ) }
+
+    def method( self,x,*args,**kwargs ):
+        if x>1 and not x<-1 or x==0:
+            return x**2+self.table[ 'a' ]*-x
+        s = f"{x!r:>10}"+r'\d+'+b'bytes'
+        total = x + \
+            1
+        return [ i for i in range( 10 ) if i%2 ]
+
+
+def long_call():
+    result = some_function_with_a_long_name(first_argument, second_argument, third_argument, fourth_argument)
+    other = {'key_number_one': value_number_one, 'key_number_two': value_number_two, 'three': 3}
+    call_it(aaaaaaaaaa, bbbbbbbbbbbbbbbbbbbbbbbbbbbbb(ccccccccccccc, ddddddddddddddd), eeeeeeeeeeeeeeeeeeeeeeeeeee, ffff, gggggggggggggggggggggggg(hhhhhhhhhh, iiiiiiiiiiiiiiii))
+    return result,other
+
+
+def strings():
+    text = """triple
+    quoted=( 1 ) text
+"""
+    a = 'x=( 1 )' # comment=( 1 )
+    lam = lambda a,b=2:a+b
+    return text[ 1:2 ],a[::2],lam
+
+
+x=[ 1,
+    2,
+  3 ]
+y = x[ 0 ]if x else None
@@ -0,0 +1,32 @@
+# A client for tests/t-pfad.sh. Each argument is a request, "path:FILE" or
+# "text:FILE" (sending FILE's contents), optionally followed by
+# ":FIRST-LAST"; all go over one connection, and each response is printed
+# as its status, then its bytes.
+import socket
+import struct
+import sys
+
+
+def recv_all(sock, n):
+    data = b""
+    while len(data) < n:
+        part = sock.recv(n - len(data))
+        if not part:
+            raise SystemExit("connection closed")
+        data += part
+    return data
+
+
+sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+sock.connect(sys.argv[1])
+out = sys.stdout.buffer
+for req in sys.argv[2:]:
+    kind, name, *rng = req.split(":")
+    first, last = map(int, rng[0].split("-")) if rng else (0, 0)
+    if kind == "path":
+        body, rtype = name.encode(), 1
+    else:
+        body, rtype = open(name, "rb").read(), 2
+    sock.sendall(struct.pack("!4I", rtype, len(body), first, last) + body)
+    status, length = struct.unpack("!2I", recv_all(sock, 8))
+    out.write(b"%d\n" % status + recv_all(sock, length))
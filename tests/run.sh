@@ -0,0 +1,52 @@
+#!/bin/sh
+# Regression tests for pfa, pfai and pfad. Each tests/t-*.sh is run in a
+# fresh scratch directory, with PFA, PFAI and PFAD naming the programs
+# under test and TESTS the directory of checked-in inputs; a test fails by
+# calling fail, or by exiting nonzero. Usage: tests/run.sh [tests...]
+TESTS=$(cd "$(dirname "$0")" && pwd)
+PFA=$(cd "$TESTS/../pfa" && pwd)/pfa
+PFAI=$(cd "$TESTS/../pfa" && pwd)/pfai
+PFAD=$(cd "$TESTS/../pfa" && pwd)/pfad
+export TESTS PFA PFAI PFAD
+
+if [ $# -eq 0 ]; then
+  set -- "$TESTS"/t-*.sh
+fi
+failed=0
+for t in "$@"; do
+  if [ ! -f "$t" ]; then
+    t=$TESTS/$t
+  fi
+  t=$(cd "$(dirname "$t")" && pwd)/$(basename "$t")
+  scratch=$(mktemp -d)
+  if (
+    cd "$scratch" || exit 1
+    fail() {
+      echo "  $*" >&2
+      exit 1
+    }
+    # same FILE EXPECTED: the file must match the expected text
+    same() {
+      cmp -s "$1" "$2" || {
+        diff -u "$2" "$1" | head -20 >&2
+        fail "$1 differs from $2"
+      }
+    }
+    # status N CMD...: the command must exit with status N
+    status() {
+      want=$1
+      shift
+      "$@" > out 2> err
+      got=$?
+      [ "$got" -eq "$want" ] || fail "exit $got, not $want: $*"
+    }
+    . "$t"
+  ); then
+    echo "ok   $(basename "$t")"
+  else
+    echo "FAIL $(basename "$t")"
+    failed=1
+  fi
+  rm -rf "$scratch"
+done
+exit $failed
@@ -0,0 +1,55 @@
+# -c CACHE: files seen to format to themselves are skipped after
+hit() {
+  "$PFA" --check --stats -c C "$1" > stats 2>&1
+  grep -q '"file":"'"$1"'","bytes_in":[0-9]*,"bytes_out":[0-9]*,"lines":0,' stats
+}
+printf 'x = 1\n' > a.py
+printf 'y = 2\n' > b.py
+printf 'z=( 3 )\n' > c.py
+
+status 1 "$PFA" --check -c C a.py b.py c.py
+printf 'c.py\n' > want
+same out want
+hit a.py || fail "a.py was not a cache hit"
+hit b.py || fail "b.py was not a cache hit"
+hit c.py && fail "c.py, which changes, was recorded"
+
+# the hash is of the contents
+printf 'x = 11\n' > a.py
+hit a.py && fail "a.py was a hit after changing"
+
+# every mode records: to stdout, on threads, and in place
+for mode in "" "-j 2" "--check"; do
+  rm -f C
+  "$PFA" $mode -c C b.py > /dev/null
+  hit b.py || fail "pfa $mode -c did not record b.py"
+done
+rm -f C
+"$PFAI" -c C b.py
+hit b.py || fail "pfai -c did not record b.py"
+
+# a torn record is cut off; those before it still count
+rm -f C
+"$PFA" --check -c C b.py
+printf 'torn' >> C
+hit b.py || fail "torn record lost b.py"
+"$PFA" --check -c C a.py
+hit a.py || fail "a.py not recorded after a torn record"
+hit b.py || fail "b.py lost after a torn record"
+
+# a damaged record is skipped, and the rest kept
+rm -f C
+"$PFA" --check -c C a.py b.py
+printf 'XXXXXXXX' | dd of=C bs=1 seek=40 conv=notrunc 2> /dev/null
+hits=0
+hit a.py && hits=$((hits + 1))
+hit b.py && hits=$((hits + 1))
+[ $hits -eq 1 ] || fail "$hits records survived one being damaged"
+
+# garbage, or another version, is started over
+head -c 200 /dev/urandom > C
+status 0 "$PFA" --check -c C b.py
+hit b.py || fail "b.py not recorded over garbage"
+printf '\377' | dd of=C bs=1 seek=12 conv=notrunc 2> /dev/null
+hit b.py && fail "b.py was a hit in another version's cache"
+hit b.py || fail "b.py not recorded after the version changed"
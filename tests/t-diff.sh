@@ -0,0 +1,32 @@
+# --diff: the patch it prints turns each file into its formatted text
+cp "$TESTS"/diff/*.py .
+# and a longer file, with many small changes among unchanged lines
+i=0
+while [ $i -lt 400 ]; do
+  if [ $((i % 7)) -eq 0 ]; then
+    printf 'v%d=[ %d,%d ]\n' $i $i $i
+  else
+    printf 'v%d = %d\n' $i $i
+  fi
+  i=$((i + 1))
+done > long.py
+
+for f in *.py; do
+  "$PFA" "$f" > "$f.want" || fail "formatting $f"
+done
+status 1 "$PFA" --diff clean.py hunks.py long.py nonl.py
+grep -q '^+++ clean.py' out && fail "a diff for clean.py, which is formatted"
+[ "$(grep -c '^@@' out)" -gt 4 ] || fail "too few hunks"
+
+# on threads, the same diffs come out
+mv out diff
+status 1 "$PFA" --diff -j 2 clean.py hunks.py long.py nonl.py
+same out diff
+
+patch -s -p0 < diff || fail "the diff does not apply"
+for f in *.py; do
+  same "$f" "$f.want"
+done
+status 0 "$PFA" --diff clean.py hunks.py long.py nonl.py
+[ -s out ] && fail "a diff after patching"
+exit 0
@@ -0,0 +1,29 @@
+# notebooks and Markdown: only the Python in them is formatted
+cp "$TESTS"/embed/cells.ipynb "$TESTS"/embed/other.ipynb "$TESTS"/embed/doc.md .
+
+status 1 "$PFA" --check cells.ipynb other.ipynb doc.md
+printf 'cells.ipynb\ndoc.md\n' > want
+same out want
+
+# to stdout, and in place, on one thread or several
+for f in cells.ipynb doc.md; do
+  status 0 "$PFA" "$f"
+  same out "$TESTS/embed/$f.want"
+done
+"$PFAI" -j 2 cells.ipynb other.ipynb doc.md || fail "pfai"
+same cells.ipynb "$TESTS"/embed/cells.ipynb.want
+same doc.md "$TESTS"/embed/doc.md.want
+same other.ipynb "$TESTS"/embed/other.ipynb
+status 0 "$PFA" --check cells.ipynb other.ipynb doc.md
+
+# a directory walk leaves them alone
+cp "$TESTS"/embed/cells.ipynb "$TESTS"/embed/doc.md .
+"$PFAI" -r . || fail "pfai -r"
+same cells.ipynb "$TESTS"/embed/cells.ipynb
+same doc.md "$TESTS"/embed/doc.md
+
+# a notebook cut short is copied as it is
+head -c 700 "$TESTS"/embed/cells.ipynb > cut.ipynb
+cp cut.ipynb cut.orig
+"$PFA" cut.ipynb > out || fail "pfa on a damaged notebook"
+same out cut.orig
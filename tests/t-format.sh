@@ -0,0 +1,47 @@
+# plain Python files: to stdout, from stdin, --check, --wrap and --lines
+cp "$TESTS"/format/sample.py "$TESTS"/format/sample.py.want .
+status 0 "$PFA" sample.py
+same out "$TESTS"/format/sample.py.want
+status 0 "$PFA" --wrap optimal sample.py
+same out "$TESTS"/format/sample.py.optimal
+status 0 "$PFA" --wrap greedy sample.py.want
+same out "$TESTS"/format/sample.py.want
+
+# standard input gives what the file does, read a line at a time
+status 0 "$PFA" - < sample.py
+same out "$TESTS"/format/sample.py.want
+status 0 "$PFA" --wrap optimal - < sample.py
+same out "$TESTS"/format/sample.py.optimal
+printf 'x=( 1 )' | "$PFA" - > out || fail "pfa - without a final newline"
+printf 'x = (1)\n' > want
+same out want
+
+# --check lists the files that would change, changing none
+cp sample.py keep.py
+status 1 "$PFA" --check sample.py sample.py.want keep.py
+printf 'sample.py\nkeep.py\n' > want
+same out want
+same sample.py "$TESTS"/format/sample.py
+status 0 "$PFA" --check sample.py.want
+[ -s out ] && fail "--check listed a formatted file"
+status 1 "$PFAI" --check -j 2 sample.py keep.py
+same sample.py "$TESTS"/format/sample.py
+
+# formatting the file a range at a time, each range on the original, gives
+# what formatting it whole does; ranges start at top-level statements
+n=$(wc -l < sample.py)
+starts="1 $(grep -n -E '^(@|def |class |x=)' sample.py | sed 's/:.*//' |
+  tr '\n' ' ') $((n + 1))"
+: > pieces
+first=
+for next in $starts; do
+  if [ -n "$first" ]; then
+    last=$((next - 1))
+    status 0 "$PFA" --lines $first-$last sample.py
+    # drop the lines copied from before and after the range
+    total=$(wc -l < out)
+    tail -n +$first out | head -n $((total - (first - 1) - (n - last))) >> pieces
+  fi
+  first=$next
+done
+same pieces "$TESTS"/format/sample.py.want
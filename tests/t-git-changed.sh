@@ -0,0 +1,78 @@
+# --git-changed: only Python files that differ from HEAD or the index
+command -v git > /dev/null || exit 0
+export GIT_CONFIG_NOSYSTEM=1 HOME=$PWD
+git init -q repo && cd repo || fail "git init"
+git config user.email t@t && git config user.name t
+mkdir pkg
+printf 'a=( 1 )\n' > same.py
+printf 'b = 1\n' > staged.py
+printf 'c = 1\n' > unstaged.py
+printf 'd = 1\n' > gone.py
+printf 'e = 1\n' > pkg/deep.py
+printf 'not python\n' > notes.txt
+# enough paths that a version 4 index is rebuilt past its first 4 KiB
+mkdir lib
+i=0
+while [ $i -lt 150 ]; do
+  printf 'x = %d\n' $i > lib/a_module_with_a_long_enough_name_$i.py
+  i=$((i + 1))
+done
+git add . && git commit -qm one
+
+printf 'b=[ 2 ]\n' > staged.py && git add staged.py
+printf 'c=( 2 )\n' > unstaged.py
+printf 'e=( 2 )\n' > pkg/deep.py
+rm gone.py
+printf 'f=( 1 )\n' > new.py
+printf 'changed\n' > notes.txt
+
+changed() {
+  status 1 "$PFA" --check --git-changed "$@"
+  sort out > got
+  same got want
+}
+printf 'pkg/deep.py\nstaged.py\nunstaged.py\n' > want
+changed
+printf 'new.py\npkg/deep.py\nstaged.py\nunstaged.py\n' > want
+changed --untracked
+
+# packed, and with deltas against older versions; only same.py is
+# committed, so the rest stays changed
+for i in 1 2 3; do
+  printf 'g = %s\n' "$i" >> same.py
+  git commit -qm "more $i" same.py
+done
+git gc -q --aggressive
+printf 'pkg/deep.py\nstaged.py\nunstaged.py\n' > want
+changed
+
+# prefix-compressed index
+git update-index --index-version 4
+changed
+
+# from a subdirectory, the whole work tree is still looked at, and paths
+# are as git status shows them there
+printf '../pkg/deep.py\n../staged.py\n../unstaged.py\n' > pkg/want
+(cd pkg && changed) || exit 1
+
+# in place, only those files are rewritten
+"$PFAI" --git-changed
+printf 'a=( 1 )\ng = 1\ng = 2\ng = 3\n' > want
+same same.py want
+printf 'c = (2)\n' > want
+same unstaged.py want
+
+# a split index can not be read, so nothing is guessed from it
+git update-index --split-index
+status 1 "$PFA" --check --git-changed --untracked
+[ -s out ] && fail "files listed from a split index"
+grep -q "Could not read git repository" err || fail "no error for a split index"
+git update-index --no-split-index
+
+# a damaged pack fails cleanly, not with a crash
+printf 'c=( 3 )\n' > unstaged.py
+for pack in .git/objects/pack/*.pack; do
+  head -c 200 "$pack" > cut && chmod u+w "$pack" && mv cut "$pack"
+done
+"$PFA" --check --git-changed > /dev/null 2>&1
+[ $? -le 1 ] || fail "crashed on a truncated pack"
@@ -0,0 +1,49 @@
+# large files: split among spare threads, and rewritten in place as they
+# are formatted; copies of the sample format to copies of its output
+# repeat FILE N: N copies of FILE, N a power of two
+repeat() {
+  cp "$1" rep
+  k=1
+  while [ $k -lt $2 ]; do
+    cat rep rep > rep2 && mv rep2 rep
+    k=$((k * 2))
+  done
+  cat rep
+}
+repeat "$TESTS"/format/sample.py 256 > small.py
+repeat "$TESTS"/format/sample.py.want 256 > small.want
+repeat small.py 8 > mid.py
+repeat small.want 8 > mid.want
+repeat mid.py 8 > big.py
+repeat mid.want 8 > big.want
+[ $(wc -c < big.py) -gt $((9 << 20)) ] || fail "big.py too small to split"
+[ $(wc -c < mid.py) -gt $((1 << 20)) ] || fail "mid.py too small to stream"
+[ $(wc -c < small.py) -lt $((1 << 20)) ] || fail "small.py too large"
+
+# to stdout, split or not
+for j in 1 4; do
+  status 0 "$PFA" -j $j big.py
+  same out big.want
+done
+status 1 "$PFA" --check -j 4 big.py
+status 0 "$PFA" --check -j 4 big.want
+
+# in place: read ahead by the engine or not, streamed to the temporary or
+# not, split or not
+for j in 1 2 4; do
+  for f in small mid big; do
+    cp $f.py $f.$j.py
+  done
+  "$PFAI" -j $j small.$j.py mid.$j.py big.$j.py || fail "pfai -j $j"
+  for f in small mid big; do
+    same $f.$j.py $f.want
+  done
+done
+
+# a formatted file is left as it is, not rewritten
+cp big.want done.py
+before=$(ls -i done.py)
+"$PFAI" -j 4 done.py || fail "pfai on a formatted file"
+[ "$(ls -i done.py)" = "$before" ] || fail "a formatted file was rewritten"
+[ -z "$(ls -A | grep pfa_)" ] || fail "temporaries left behind"
+exit 0
@@ -0,0 +1,54 @@
+# pfad answers requests for paths and texts over one connection
+command -v python3 > /dev/null || exit 0
+client() {
+  python3 "$TESTS/pfad_client.py" sock "$@"
+}
+"$PFAD" sock 2> daemon.err &
+daemon=$!
+trap 'kill $daemon 2> /dev/null' EXIT
+i=0
+while [ ! -S sock ] && [ $i -lt 100 ]; do
+  sleep 0.05
+  i=$((i + 1))
+done
+[ -S sock ] || fail "pfad did not start"
+
+printf 'x=( 1 )\ny = 2\nz=[ 3 ]\n' > a.py
+printf 'x = 1\n' > clean.py
+client path:a.py text:a.py path:clean.py text:clean.py path:a.py:2-3 \
+  path:missing.py > out || fail "client"
+{
+  printf '0\nx = (1)\ny = 2\nz = [3]\n'
+  printf '0\nx = (1)\ny = 2\nz = [3]\n'
+  printf '1\n1\n'
+  printf '0\nx=( 1 )\ny = 2\nz = [3]\n'
+  printf '2\nCould not open missing.py'
+} > want
+same out want
+
+# a file cut short and rewritten while pfad reads it must not bring the
+# daemon down
+i=0
+while [ $i -lt 20000 ]; do
+  printf 'v%d=[ %d ]\n' $i $i
+  i=$((i + 1))
+done > long
+cp long big.py
+(
+  while [ ! -e stop ]; do
+    : > big.py
+    cat long > big.py
+  done
+) &
+writer=$!
+k=0
+while [ $k -lt 30 ]; do
+  client path:big.py > /dev/null || break
+  k=$((k + 1))
+done
+touch stop
+wait $writer
+kill -0 $daemon 2> /dev/null || fail "pfad died"
+client text:clean.py > out || fail "client after rewrites"
+printf '1\n' > want
+same out want
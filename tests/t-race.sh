@@ -0,0 +1,42 @@
+# a file saved while pfai runs is formatted whole, or left alone; never
+# cut to the size it had when the run began
+mkdir d
+i=0
+while [ $i -lt 3000 ]; do
+  printf 'a%d = %d\n' $i $i > d/f$i.py
+  i=$((i + 1))
+done
+printf 'old=[ 1 ]\n' > short
+i=0
+while [ $i -lt 200 ]; do
+  printf 'new=[ %d ]\n' $i
+  i=$((i + 1))
+done > long
+"$PFA" short > short.want
+"$PFA" long > long.want
+
+# save zz.py over and over, by renaming a new copy over it; whatever pfai
+# leaves in between must be one of the versions
+cp short d/zz.py
+(
+  while [ ! -e stop ]; do
+    for v in long short; do
+      ok=0
+      for want in short long short.want long.want; do
+        cmp -s d/zz.py $want && ok=1
+      done
+      [ $ok = 1 ] || cp d/zz.py bad
+      cp $v d/.zz && mv d/.zz d/zz.py
+    done
+  done
+) &
+saver=$!
+for k in 1 2 3 4 5 6 7 8 9 10 11 12; do
+  "$PFAI" -j 4 d/*.py || fail "pfai"
+done
+touch stop
+wait $saver
+if [ -e bad ]; then
+  head -3 bad >&2
+  fail "zz.py was cut to its old size"
+fi
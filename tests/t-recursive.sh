@@ -0,0 +1,29 @@
+# -r: every *.py and *.pyi below the roots, less those ignored
+mkdir -p a/b a/.git skip
+printf 'x=( 1 )\n' > a/one.py
+printf 'y=[ 2 ]\n' > a/b/two.pyi
+printf 'w=( 4 )\n' > a/ignored.py
+printf 'ignored.py\n' > a/.gitignore
+printf 'v=( 5 )\n' > a/.git/hook.py
+printf 'q=( 6 )\n' > a/notes.txt
+printf 'z=( 3 )\n' > skip/three.py
+printf 'ok = 1\n' > done.py
+
+status 1 "$PFA" --check -r .
+printf './a/b/two.pyi\n./a/one.py\n./skip/three.py\n' > want
+same out want
+
+status 1 "$PFA" --check -r -x skip .
+printf './a/b/two.pyi\n./a/one.py\n' > want
+same out want
+
+status 0 "$PFAI" -r a
+printf 'x = (1)\n' > want
+same a/one.py want
+printf 'y = [2]\n' > want
+same a/b/two.pyi want
+printf 'w=( 4 )\n' > want
+same a/ignored.py want
+printf 'q=( 6 )\n' > want
+same a/notes.txt want
+status 0 "$PFA" --check -r a
@@ -0,0 +1,49 @@
+# --watch formats the files saved under the trees it watches, and only those
+# wait_for FILE TEXT: wait, up to five seconds, until FILE holds TEXT
+wait_for() {
+  i=0
+  while [ $i -lt 100 ]; do
+    [ "$(cat "$1" 2> /dev/null)" = "$2" ] && return 0
+    sleep 0.05
+    i=$((i + 1))
+  done
+  return 1
+}
+mkdir -p d/sub
+printf 'old=( 1 )\n' > d/old.py
+printf 'n=( 1 )\n' > d/notes.txt
+"$PFAI" --watch d 2> err &
+watcher=$!
+mkdir c
+"$PFA" --check --watch c > checked 2> err2 &
+checker=$!
+trap 'kill $watcher $checker 2> /dev/null' EXIT
+sleep 0.3
+
+printf 'x=( 1 )\n' > d/saved.py
+wait_for d/saved.py 'x = (1)' || fail "saved.py was not formatted"
+# in a directory made since, and saved by renaming into place
+mkdir d/new
+printf 'y=[ 2 ]\n' > d/new/.tmp && mv d/new/.tmp d/new/moved.py
+wait_for d/new/moved.py 'y = [2]' || fail "moved.py was not formatted"
+printf 'z=( 3 )\n' > d/sub/deep.py
+wait_for d/sub/deep.py 'z = (3)' || fail "deep.py was not formatted"
+
+# pfai's own writes are not taken for saves, and nothing else is touched
+sleep 0.3
+kill -0 $watcher 2> /dev/null || fail "pfai --watch exited"
+printf 'old=( 1 )\n' > want
+same d/old.py want
+printf 'n=( 1 )\n' > want
+same d/notes.txt want
+[ -z "$(find d -name '.pfa_*')" ] || fail "temporaries left behind"
+
+# --check reports each save that would change, as it comes
+printf 'x=( 1 )\n' > c/bad.py
+printf 'x = 1\n' > c/good.py
+wait_for checked 'c/bad.py' || fail "--check --watch did not list bad.py"
+sleep 0.2
+printf 'c/bad.py\n' > want
+same checked want
+printf 'x=( 1 )\n' > want
+same c/bad.py want
@@ -0,0 +1,33 @@
+# a file that can not be written back whole is left as it was, and the
+# failure is reported; below and above the size rewritten as formatted
+gen() {
+  i=0
+  while [ $i -lt $1 ]; do
+    printf 'v%d=[ %d,%d ]\n' $i $i $i
+    i=$((i + 1))
+  done
+}
+gen 3500 > small.py
+gen 80000 > big.py
+cp small.py small.orig
+cp big.py big.orig
+
+for f in small.py big.py; do
+  (ulimit -f 40 && "$PFAI" $f) > out 2> err && fail "pfai $f succeeded"
+  grep -q "Could not write $f, left unchanged" err || fail "no error for $f"
+done
+same small.py small.orig
+same big.py big.orig
+[ -z "$(ls -A | grep pfa_)" ] || fail "temporaries left behind"
+
+# the same, written back by the I/O engine
+(ulimit -f 40 && "$PFAI" -j 2 small.py big.py) > out 2> err &&
+  fail "pfai -j 2 succeeded"
+for f in small.py big.py; do
+  grep -q "Could not write $f, left unchanged" err || fail "no error for $f"
+done
+grep -q "Failed to overwrite" err && fail "a temporary named, not kept"
+same small.py small.orig
+same big.py big.orig
+[ -z "$(ls -A | grep pfa_)" ] || fail "temporaries left behind"
+exit 0